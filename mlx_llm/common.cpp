@@ -1,39 +1,133 @@
 #pragma once
 
+#include <atomic>
+#include <filesystem>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 #include "mlx/mlx.h"
 #include "utils.cpp"
+#include "json.cpp"
+#include "snapshot.cpp"
 
 namespace mlx::core::nn{
 
+    class Module;
+    class LoRAStack;
+
+    struct SubmoduleRef
+    {
+        // Resolves the registered submodule relative to the module that owns
+        // it, so copies of a module see their own members and not the
+        // originals'
+        std::string name;
+        std::function<Module *(Module *)> resolve;
+    };
+
+    struct ParameterTable
+    {
+        // Flat view of every parameter/buffer below a module: dotted paths
+        // interned once, handles pointing at the arrays the layers use
+        std::vector<std::string> names{};
+        std::vector<array *> handles{};
+        std::unordered_map<std::string_view, size_t> index{};
+        uint64_t version = 0;
+
+        array *find(const std::string &name) const
+        {
+            auto it = index.find(name);
+            return it == index.end() ? nullptr : handles[it->second];
+        }
+        size_t size() const
+        {
+            return names.size();
+        }
+    };
+
+    // Stream used by every forward issued from this thread. Unset, ops go
+    // to the default stream; a Session sets its own so sessions sharing one
+    // model on different threads never share a stream.
+    inline thread_local std::optional<Stream> thread_stream = std::nullopt;
+
+    inline StreamOrDevice current_stream(StreamOrDevice fallback = {})
+    {
+        return thread_stream ? StreamOrDevice(*thread_stream) : fallback;
+    }
+
+    class StreamScope
+    {
+    public:
+        StreamScope(Stream s) : previous(thread_stream)
+        {
+            thread_stream = s;
+        }
+        ~StreamScope()
+        {
+            thread_stream = previous;
+        }
+
+    private:
+        std::optional<Stream> previous;
+    };
+
     class Module
     {
     public:
         std::unordered_map<std::string, array> parameters{};
         std::unordered_map<std::string, array> buffers{};
-        std::unordered_map<std::string, std::shared_ptr<Module>> submodules{};
-        std::unordered_map<std::string, array &> named_parameters_dict{};
+        std::vector<SubmoduleRef> submodules{};
+
+        // Called with the input / output of every forward (see trace.cpp)
+        using ForwardHook = std::function<void(Module &, const array &)>;
+        std::vector<ForwardHook> forward_pre_hooks{};
+        std::vector<ForwardHook> forward_hooks{};
 
         std::string name;
         StreamOrDevice device = metal::is_available() ? Device::gpu : Device::cpu;
 
         Module(){};
-        Module(const Module &) = default;
-        // Module& operator=(Module&&) noexcept = default;
-        //  Module(Module&&) noexcept = default;
+        Module(const Module &other)
+            : parameters(other.parameters),
+              buffers(other.buffers),
+              submodules(other.submodules),
+              name(other.name),
+              device(other.device)
+        {
+            structure_version++;
+        }
+        Module &operator=(const Module &other)
+        {
+            // The table holds pointers into `other`, so it is rebuilt
+            // lazily, and so are the tables of modules above this one
+            // (e.g. `layers[i].self_attn = PhiAttention(args)`)
+            check_mutable(other.name);
+            parameters = other.parameters;
+            buffers = other.buffers;
+            submodules = other.submodules;
+            name = other.name;
+            device = other.device;
+            parameter_table = ParameterTable();
+            structure_version++;
+            return *this;
+        }
 
         virtual ~Module() = default;
 
-        array &register_parameter(std::string name, array &wb)
+        array &register_parameter(std::string name, const array &wb)
         {
             // `register_parameter` allows you to register the Weights & Biases
             // used by the NN
-            parameters.insert({name, wb});
+            check_mutable(name);
+            parameters.insert_or_assign(name, wb);
+            structure_version++;
             return parameters.at(name);
         }
 
@@ -41,161 +135,465 @@ namespace mlx::core::nn{
         {
             // `register_parameter` allows you to register the Weights & Biases
             // used by the NN
-            parameters.insert({name, wb});
+            check_mutable(name);
+            parameters.insert_or_assign(name, wb);
+            structure_version++;
             return parameters.at(name);
         }
 
-        array &register_buffer(std::string name, array &wb)
+        array &register_buffer(std::string name, const array &wb)
         {
-            // `register_parameter` allows you to register the Weights & Biases
+            // `register_buffer` allows you to register non-trainable arrays
             // used by the NN
-            buffers.insert({name, wb});
+            check_mutable(name);
+            buffers.insert_or_assign(name, wb);
+            structure_version++;
             return buffers.at(name);
         }
 
         template <typename T>
         void register_module(std::string sub_name, T &m)
         {
-            // `register_component` allows you to register the component(in order) as
+            // `register_module` registers a member of this module. It is
+            // stored as an offset into the owner rather than a copy, so the
+            // registered module is the one `forward` actually uses.
+            static_assert(std::is_base_of<Module, T>::value, "register_module expects an nn::Module");
+            Module *sub = static_cast<Module *>(&m);
+            std::ptrdiff_t offset = reinterpret_cast<char *>(sub) - reinterpret_cast<char *>(this);
+            sub->name = sub_name;
+            add_submodule(sub_name, [offset](Module *self)
+                          { return reinterpret_cast<Module *>(reinterpret_cast<char *>(self) + offset); });
+        }
+
+        template <typename T>
+        void register_module(std::string sub_name, std::shared_ptr<T> m)
+        {
+            // Modules held through a std::shared_ptr are shared by copies
+            static_assert(std::is_base_of<Module, T>::value, "register_module expects an nn::Module");
+            m->name = sub_name;
+            std::shared_ptr<Module> sub = m;
+            add_submodule(sub_name, [sub](Module *)
+                          { return sub.get(); });
+        }
+
+        template <typename T>
+        void register_layer(std::string layers_name, std::vector<T> &layers)
+        {
+            // `register_layer` allows you to register the layers(in order) as
             // used by the NN
-            if (!std::is_base_of<T, Module>::value)
+            if constexpr (std::is_base_of<Module, T>::value)
             {
-                // Error the code is not correct
+                // Elements are resolved through the vector member, so they
+                // stay valid when the vector reallocates or is copied
+                std::ptrdiff_t offset = reinterpret_cast<char *>(&layers) - reinterpret_cast<char *>(this);
+                for (size_t i = 0; i < layers.size(); i++)
+                {
+                    layers[i].name = get_name(layers_name, i);
+                    add_submodule(layers[i].name, [offset, i](Module *self)
+                                  {
+                        auto *v = reinterpret_cast<std::vector<T> *>(reinterpret_cast<char *>(self) + offset);
+                        return static_cast<Module *>(&(*v)[i]); });
+                }
             }
+            else
+            {
+                for (size_t i = 0; i < layers.size(); i++)
+                {
+                    register_module(get_name(layers_name, i), layers[i]);
+                }
+            }
+        }
 
-            // Check if the submodule exists before trying to access it
-            if (!(submodules.find(sub_name) != submodules.end()))
+        // Registered submodules of this object, in registration order
+        std::vector<std::pair<std::string, Module *>> children()
+        {
+            std::vector<std::pair<std::string, Module *>> out{};
+            out.reserve(submodules.size());
+            for (auto &sub : submodules)
             {
-                // Add the parameters of the submodules to the named_parameters_dict
-                //   m.name = sub_name;
-                //   m.named_parameters();
-                submodules.insert({sub_name, m});
-                submodules.at(sub_name)->name = sub_name;
-                submodules.at(sub_name)->named_parameters();
+                out.push_back({sub.name, sub.resolve(this)});
             }
-            else
+            return out;
+        }
+
+        void register_forward_pre_hook(ForwardHook hook)
+        {
+            forward_pre_hooks.push_back(hook);
+        }
+
+        void register_forward_hook(ForwardHook hook)
+        {
+            forward_hooks.push_back(hook);
+        }
+
+        // Forward method for all submodules
+        // TODO:: Make A general method for all forward implementations
+        virtual array forward(const array &input)
+        {
+            return input;
+        };
+
+        // Layers that support quantized weights override this to swap their
+        // own parameters for packed ones; returns false if not applicable
+        virtual bool to_quantized(int /*group_size*/, int /*bits*/)
+        {
+            return false;
+        }
+
+        // Binds already packed weights (e.g. from a quantized GGUF file)
+        // without going through float32 first
+        virtual bool load_quantized(
+            const array & /*w*/,
+            const array & /*scales*/,
+            const array & /*biases*/,
+            int /*group_size*/,
+            int /*bits*/)
+        {
+            return false;
+        }
+
+        // Whether load_quantized would take these packed weights, checked
+        // without changing the layer
+        virtual bool can_load_quantized(
+            const array & /*w*/,
+            const array & /*scales*/,
+            const array & /*biases*/,
+            int /*group_size*/,
+            int /*bits*/) const
+        {
+            return false;
+        }
+
+        // (group_size, bits) while the layer holds quantized weights
+        virtual std::pair<int, int> quantization() const
+        {
+            return {0, 0};
+        }
+
+        // Layers that can carry LoRA adapters return their adapter stack,
+        // creating it with room for `slots` adapters, `rank` wide to start
+        virtual std::shared_ptr<LoRAStack> lora_stack(int /*slots*/, int /*rank*/)
+        {
+            return nullptr;
+        }
+
+        int quantize(
+            int bits = 4,
+            int group_size = 64,
+            const std::function<bool(const std::string &, Module &)> &predicate = nullptr,
+            std::string prelimiter = "")
+        {
+            // Walks the submodules and quantizes every eligible layer in
+            // place, returning how many were converted
+            int count = 0;
+            for (auto &[k, v] : children())
             {
-                // Handle the case where the submodule doesn't exist
+                std::string sub_name = get_name(prelimiter, k);
+                if ((!predicate || predicate(sub_name, *v)) && v->to_quantized(group_size, bits))
+                {
+                    count++;
+                }
+                count += v->quantize(bits, group_size, predicate, sub_name);
             }
+            return count;
         }
 
-        template <typename T>
-        void register_module(std::string sub_name, std::shared_ptr<T> &&m)
+        Module *find_module(const std::string &path)
         {
-            // `register_component` allows you to register the component(in order) as
-            // used by the NN
-            if (!std::is_base_of<T, Module>::value)
+            // Submodule keys may themselves contain dots (e.g. "layers.0")
+            for (auto &[k, v] : children())
             {
-                // Error the code is not correct
+                if (path == k)
+                {
+                    return v;
+                }
+                if (path.size() > k.size() && path.compare(0, k.size(), k) == 0 && path[k.size()] == '.')
+                {
+                    Module *found = v->find_module(path.substr(k.size() + 1));
+                    if (found != nullptr)
+                    {
+                        return found;
+                    }
+                }
             }
+            return nullptr;
+        }
 
-            // Check if the submodule exists before trying to access it
-            if (!(submodules.find(sub_name) != submodules.end()))
+        const ParameterTable &named_parameters()
+        {
+            // Built once and reused until a parameter or submodule is
+            // registered, or a module is copied, anywhere. A frozen
+            // module keeps the table it was frozen with.
+            if (!frozen && parameter_table.version != structure_version)
             {
-                // Add the parameters of the submodules to the named_parameters_dict
-                // m.name = sub_name;
-                // m.named_parameters();
-                submodules.insert({sub_name, m});
-                submodules.at(sub_name)->name = sub_name;
-                submodules.at(sub_name)->named_parameters();
+                ParameterTable table;
+                collect_parameters("", table);
+                for (size_t i = 0; i < table.names.size(); i++)
+                {
+                    table.index.insert({table.names[i], i});
+                }
+                table.version = structure_version;
+                parameter_table = std::move(table);
             }
-            else
+            return parameter_table;
+        }
+
+        void freeze()
+        {
+            // Makes the weights read-only for this module and everything
+            // below it, so forwards from several threads only ever read
+            // shared state. Registration, loading and quantization throw
+            // afterwards.
+            named_parameters();
+            frozen = true;
+            for (auto &[k, v] : children())
             {
-                // Handle the case where the submodule doesn't exist
+                v->freeze();
             }
         }
 
-        template <typename T>
-        void register_layer(std::string layers_name, std::vector<T> &layers)
+        bool is_frozen() const
         {
-            // `register_component` allows you to register the layers(in order) as
-            // used by the NN
-            if (!std::is_base_of<T, Module>::value)
+            return frozen;
+        }
+
+        StreamOrDevice stream() const
+        {
+            return current_stream(device);
+        }
+
+        void update(std::unordered_map<std::string, array> trained_weights)
+        {
+            for (auto &[k, v] : trained_weights)
             {
-                // Error the code is not correct
+                assign_parameter(k, v);
             }
-            for (size_t i = 0; i < layers.size(); i++)
+        }
+
+        bool assign_parameter(const std::string &k, const array &v)
+        {
+            check_mutable(k);
+            array *param = named_parameters().find(k);
+            if (param == nullptr)
+            {
+                std::cout << "Named parameter does not contain the key: " << k << "\n";
+                return false;
+            }
+            else if (param->shape() != v.shape())
             {
-                register_module(get_name(layers_name, i), layers[i]);
+                // A tensor that does not fit would leave the parameter at
+                // its initial value and the model silently wrong
+                std::ostringstream msg;
+                msg << "Shape mismatch for " << k << ": expected " << param->shape()
+                    << ", got " << v.shape();
+                throw std::invalid_argument(msg.str());
             }
+            *param = v;
+            return true;
         }
 
-        // Forward method for all submodules
-        // TODO:: Make A general method for all forward implementations
-        virtual array forward(const array &input)
+        void load_from_safetensors(const std::string &file, StreamOrDevice s)
         {
-            return input;
-        };
+            SafetensorsLoad loaded_weights = load_safetensors(file, s);
+            update(loaded_weights.first);
+        }
 
-        void named_parameters(std::string prelimiter = "")
+        void load_from_sharded_safetensors(const std::string &path, StreamOrDevice s)
         {
-            for (auto &[k, v] : parameters)
+            // `path` is the shard index JSON, or the directory holding
+            // `model.safetensors.index.json`. Shards are loaded one at a time
+            // and every tensor is assigned straight into its parameter, so
+            // peak memory is the model plus one shard rather than two models.
+            std::filesystem::path index_path = path;
+            if (std::filesystem::is_directory(index_path))
             {
-                std::string sub_name = get_name(prelimiter, name, k);
-                named_parameters_dict.insert({sub_name, v});
+                index_path /= "model.safetensors.index.json";
             }
-            for (auto &[k, v] : buffers)
+            JsonValue index = load_json(index_path.string());
+
+            // Group tensors by shard so each file is opened once
+            std::map<std::string, std::vector<std::string>> shards{};
+            for (auto &[tensor, file] : index.at("weight_map").members)
             {
-                std::string sub_name = get_name(prelimiter, name, k);
-                named_parameters_dict.insert({sub_name, v});
+                shards[file.string].push_back(tensor);
             }
-            if (!submodules.empty())
+
+            for (auto &[file, tensors] : shards)
             {
-                for (auto &[k, v] : submodules)
+                std::string shard_path = (index_path.parent_path() / file).string();
+                SafetensorsLoad loaded_weights = load_safetensors(shard_path, s);
+                auto &weights = loaded_weights.first;
+                std::vector<array> assigned{};
+                for (auto &name : tensors)
                 {
-                    for (auto &[l, m] : v->named_parameters_dict)
+                    auto it = weights.find(name);
+                    if (it == weights.end())
+                    {
+                        std::cout << "Shard " << file << " does not contain the key: " << name << "\n";
+                        continue;
+                    }
+                    if (assign_parameter(name, it->second))
                     {
-                        std::string sub_name = get_name(name, l);
-                        if (!(ends_with(sub_name, ".")))
-                        {
-                            named_parameters_dict.insert({sub_name, m});
-                        }
+                        assigned.push_back(it->second);
                     }
+                    weights.erase(it);
                 }
+                // Read this shard's data before the next file is opened
+                eval(assigned);
             }
         }
 
-        void update(std::unordered_map<std::string, array> trained_weights)
+        void load_from_gguf(const std::string &file, StreamOrDevice s)
         {
-            // Create references for all the known parameters
-            this->named_parameters();
+            GGUFLoad loaded_weights = load_gguf(file, s);
+            std::unordered_map<std::string, array> weights{};
+            for (auto &[k, v] : loaded_weights.first)
+            {
+                weights.insert({gguf_to_hf_name(k), v});
+            }
+            load_quantized_weights(weights);
+            update(weights);
+        }
 
-            for (auto &[k, v] : trained_weights)
+        void load_quantized_weights(std::unordered_map<std::string, array> &weights)
+        {
+            // load_gguf unpacks Q4_0/Q4_1/Q8_0 tensors into `<name>.weight`
+            // (packed uint32), `<name>.scales` and `<name>.biases` using
+            // GGUF's block size as the group size. Those are bound directly
+            // into quantized layers and removed from `weights`.
+            const int group_size = 32;
+            std::vector<std::string> prefixes{};
+            for (auto &[k, v] : weights)
             {
-                if (!(named_parameters_dict.find(k) != named_parameters_dict.end()))
+                if (ends_with(k, ".scales"))
                 {
-                    std::cout << "Named parameter does not contain the key: " << k << "\n";
+                    prefixes.push_back(k.substr(0, k.size() - 7));
                 }
-                else if (named_parameters_dict.at(k).shape() != v.shape())
+            }
+            for (auto &prefix : prefixes)
+            {
+                std::string w_name = prefix + ".weight", s_name = prefix + ".scales", b_name = prefix + ".biases";
+                if (weights.find(w_name) == weights.end() || weights.find(b_name) == weights.end())
                 {
-                    std::cout << "There is a shape difference for : " << k << "->"
-                              << named_parameters_dict.at(k).shape() << " and " << v.shape()
-                              << std::endl;
+                    continue;
                 }
-                else
+                const array &w = weights.at(w_name), &scales = weights.at(s_name);
+                int in_features = scales.shape(-1) * group_size;
+                int bits = w.shape(-1) * 32 / in_features;
+                Module *m = find_module(prefix);
+                if (m == nullptr || !m->load_quantized(w, scales, weights.at(b_name), group_size, bits))
                 {
-                    named_parameters_dict.at(k) = v;
+                    std::cout << "No quantized layer to load the key: " << prefix << "\n";
+                    continue;
                 }
+                weights.erase(w_name);
+                weights.erase(s_name);
+                weights.erase(b_name);
             }
         }
 
-        void load_from_safetensors(const std::string &file, StreamOrDevice s)
+        void save_snapshot(const std::string &file)
         {
-            SafetensorsLoad loaded_weights = load_safetensors(file, s);
-            update(loaded_weights.first);
+            // Every parameter exactly as the layers hold it (fused and
+            // packed quantized weights included) in ParameterTable order,
+            // see snapshot.cpp for the layout
+            const ParameterTable &table = named_parameters();
+            std::vector<array> data{};
+            for (auto *handle : table.handles)
+            {
+                data.push_back(flatten(*handle));
+            }
+            eval(data);
+
+            SnapshotHeader header;
+            for (size_t i = 0; i < table.size(); i++)
+            {
+                const array &a = *table.handles[i];
+                header.tensors.push_back({table.names[i], a.dtype(), a.shape(), 0, data[i].nbytes()});
+            }
+            collect_quantized("", table, header.quantized);
+            header.fingerprint = snapshot_fingerprint(header.tensors);
+            write_snapshot(file, header, data);
         }
 
-        void load_from_gguf(const std::string &file, StreamOrDevice s)
+        void load_snapshot(const std::string &file)
         {
-            GGUFLoad loaded_weights = load_gguf(file, s);
-            update(loaded_weights.first);
+            // The file is mapped and checked against the table this module
+            // will have once its quantized layers take their packed tensors;
+            // only then are those layers bound and the table filled. The
+            // module must be built the same way as the one that was saved,
+            // and is left untouched when it was not.
+            check_mutable(file);
+            auto mapped = std::make_shared<MappedFile>(file);
+            SnapshotHeader header = read_snapshot_header(*mapped);
+            std::vector<array> arrays{};
+            arrays.reserve(header.tensors.size());
+            for (auto &t : header.tensors)
+            {
+                arrays.push_back(snapshot_array(mapped, header, t));
+            }
+
+            const ParameterTable &table = named_parameters();
+            std::unordered_map<std::string, SnapshotTensor> expected{};
+            for (size_t i = 0; i < table.size(); i++)
+            {
+                expected[table.names[i]] = {table.names[i], table.handles[i]->dtype(), table.handles[i]->shape()};
+            }
+            std::vector<Module *> targets{};
+            for (auto &q : header.quantized)
+            {
+                Module *m = q.path.empty() ? this : find_module(q.path);
+                if (m == nullptr ||
+                    !m->can_load_quantized(arrays[q.weight], arrays[q.scales], arrays[q.biases], q.group_size, q.bits))
+                {
+                    throw std::runtime_error("Snapshot has a quantized layer this module cannot take: " + q.path);
+                }
+                for (auto [key, i] : {std::pair<const char *, uint64_t>{"weight", q.weight}, {"scales", q.scales}, {"biases", q.biases}})
+                {
+                    std::string name = get_name(q.path, key);
+                    expected[name] = {name, arrays[i].dtype(), arrays[i].shape()};
+                }
+                targets.push_back(m);
+            }
+            std::vector<SnapshotTensor> bound{};
+            for (auto &[name, t] : expected)
+            {
+                bound.push_back(t);
+            }
+            bool matches = expected.size() == header.tensors.size() && snapshot_fingerprint(bound) == header.fingerprint;
+            for (size_t i = 0; matches && i < header.tensors.size(); i++)
+            {
+                auto it = expected.find(header.tensors[i].name);
+                matches = it != expected.end() && it->second.dtype == header.tensors[i].dtype &&
+                          it->second.shape == header.tensors[i].shape;
+            }
+            if (!matches)
+            {
+                throw std::runtime_error("Snapshot does not match this module's parameters: " + file);
+            }
+
+            for (size_t k = 0; k < targets.size(); k++)
+            {
+                const SnapshotQuantized &q = header.quantized[k];
+                targets[k]->load_quantized(arrays[q.weight], arrays[q.scales], arrays[q.biases], q.group_size, q.bits);
+            }
+            const ParameterTable &filled = named_parameters();
+            for (size_t i = 0; i < arrays.size(); i++)
+            {
+                *filled.find(header.tensors[i].name) = arrays[i];
+            }
         }
 
         void load_weights(
             const std::string &file,
             StreamOrDevice s = metal::is_available() ? Device::gpu : Device::cpu)
         {
-            if (ends_with(file, ".safetensors"))
+            if (ends_with(file, ".json") || std::filesystem::is_directory(file))
+            {
+                std::cout << "Loading model from sharded .safetensors files...\n";
+                load_from_sharded_safetensors(file, s);
+            }
+            else if (ends_with(file, ".safetensors"))
             {
                 std::cout << "Loading model from .safetensors file...\n";
                 load_from_safetensors(file, s);
@@ -205,6 +603,10 @@ namespace mlx::core::nn{
                 load_from_gguf(file, s);
                 std::cout << "Loading model from .gguf file...\n";
             }
+            else if (ends_with(file, ".mlxsnap"))
+            {
+                load_snapshot(file);
+            }
             else
             {
                 std::cout << "Model file format is not supported...\n";
@@ -213,15 +615,80 @@ namespace mlx::core::nn{
 
         void print_parameters()
         {
-            this->named_parameters();
+            const ParameterTable &table = named_parameters();
             std::cout << "\n[\nparameters:\n";
-            for (auto &[k, v] : named_parameters_dict)
+            for (size_t i = 0; i < table.size(); i++)
             {
-                std::cout << k << ":\n"
-                          << v << "\n";
+                std::cout << table.names[i] << ":\n"
+                          << *table.handles[i] << "\n";
             }
             std::cout << "]\n";
         }
+
+    protected:
+        void check_mutable(const std::string &what)
+        {
+            if (frozen)
+            {
+                throw std::logic_error("Module is frozen, cannot change: " + what);
+            }
+        }
+
+    private:
+        // Bumped on every registration so cached tables know to rebuild
+        static inline std::atomic<uint64_t> structure_version = 1;
+        ParameterTable parameter_table{};
+        bool frozen = false;
+
+        void add_submodule(const std::string &sub_name, std::function<Module *(Module *)> resolve)
+        {
+            for (auto &sub : submodules)
+            {
+                if (sub.name == sub_name)
+                {
+                    throw std::invalid_argument("Submodule is already registered: " + sub_name);
+                }
+            }
+            check_mutable(sub_name);
+            submodules.push_back({sub_name, resolve});
+            structure_version++;
+        }
+
+        void collect_quantized(
+            const std::string &prelimiter,
+            const ParameterTable &table,
+            std::vector<SnapshotQuantized> &out)
+        {
+            auto [group_size, bits] = quantization();
+            if (bits)
+            {
+                auto index = [&](const std::string &k)
+                { return table.index.at(get_name(prelimiter, k)); };
+                out.push_back({prelimiter, group_size, bits, index("weight"), index("scales"), index("biases")});
+            }
+            for (auto &[k, v] : children())
+            {
+                v->collect_quantized(get_name(prelimiter, k), table, out);
+            }
+        }
+
+        void collect_parameters(const std::string &prelimiter, ParameterTable &table)
+        {
+            for (auto &[k, v] : parameters)
+            {
+                table.names.push_back(get_name(prelimiter, k));
+                table.handles.push_back(&v);
+            }
+            for (auto &[k, v] : buffers)
+            {
+                table.names.push_back(get_name(prelimiter, k));
+                table.handles.push_back(&v);
+            }
+            for (auto &[k, v] : children())
+            {
+                v->collect_parameters(get_name(prelimiter, k), table);
+            }
+        }
     };
 
 } //namespace mlx::core::nn
\ No newline at end of file
@@ -0,0 +1,273 @@
+// Token generation for mlx_llm.cpp models
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "mlx/mlx.h"
+#include "memory.cpp"
+#include "phi3.cpp"
+#include "prefix_cache.cpp"
+#include "grammar.cpp"
+#include "sampler.cpp"
+
+using namespace mlx::core;
+
+struct GenerationConfig
+{
+    int max_tokens = 256;
+    float temperature = 0.0;
+    // Truncation and penalties, see SamplingParams
+    int top_k = 0;
+    float top_p = 1.0;
+    float min_p = 0.0;
+    float repetition_penalty = 1.0;
+    float frequency_penalty = 0.0;
+    float presence_penalty = 0.0;
+    int penalty_window = 64;
+    int logprobs = 0;
+    std::vector<int> stop_tokens{};
+    // Sampling draws from its own key when set instead of MLX's global
+    // random state, which concurrent sessions must not share
+    std::optional<uint64_t> seed = std::nullopt;
+    // Bounded KV cache (see RotatingKVCache); 0 keeps every position
+    int max_kv_size = 0;
+    int kv_keep = 4;
+    // Prompt positions per prefill forward; 0 prefills in one shot
+    int prefill_chunk_size = 512;
+    // LoRA adapter registered with the scheduler's LoRAManager; empty runs
+    // the base model. Only the Scheduler serves adapters.
+    std::string adapter{};
+    // Constrains output to a grammar / JSON schema. Each step then waits
+    // for the previous token, which the grammar state depends on.
+    std::shared_ptr<Grammar> grammar = nullptr;
+
+    SamplingParams sampling() const
+    {
+        return {temperature, top_k, top_p, min_p, repetition_penalty,
+                frequency_penalty, presence_penalty, penalty_window, logprobs};
+    }
+};
+
+struct GenerationStats
+{
+    int prompt_tokens = 0;
+    int cached_tokens = 0; // prompt tokens served from the prefix cache
+    int generated_tokens = 0;
+    int draft_tokens = 0;    // speculative decoding: proposed by the draft model
+    int accepted_tokens = 0; // speculative decoding: drafts kept after verification
+    double ttft_ms = 0;   // prefill + first sampled token
+    double decode_ms = 0; // all single-token steps after the first
+};
+
+// Returning false from the callback stops generation after that token
+using TokenCallback = std::function<bool(int)>;
+
+array last_token_logits(const array &logits)
+{
+    // [B, L, vocab] -> [B, vocab]
+    StreamOrDevice s = nn::current_stream();
+    int B = logits.shape(0), L = logits.shape(1), V = logits.shape(2);
+    return reshape(slice(logits, {0, L - 1, 0}, {B, L, V}, s), {B, V}, s);
+}
+
+array sample_token(const array &logits, float temperature, const std::optional<array> &key = std::nullopt)
+{
+    StreamOrDevice s = nn::current_stream();
+    if (temperature == 0)
+    {
+        return argmax(logits, -1, false, s);
+    }
+    return random::categorical(multiply(logits, array(1 / temperature), s), -1, key, s);
+}
+
+// Feeds prompt positions [begin, end) to the model, appending them to
+// `cache`; the causal mask of the chunk is offset by what the cache holds.
+// Unless `last`, only the cache is wanted: the chunk is evaluated at once
+// so its activations are freed before the next chunk is built. With
+// `last` the final position's logits are returned instead.
+std::optional<array> prefill_chunk(
+    Model &model,
+    const std::vector<int> &tokens,
+    int begin,
+    int end,
+    nn::KVCacheList &cache,
+    bool last)
+{
+    array x = array(tokens.begin() + begin, {1, end - begin}, int32);
+    if (!last)
+    {
+        eval(model.model.forward(x, &cache));
+        return std::nullopt;
+    }
+    return model.forward_last(x, &cache);
+}
+
+// Prefills tokens[begin:] in chunks of `chunk_size` (0: one chunk) and
+// returns the logits of the last position
+array prefill(
+    Model &model,
+    const std::vector<int> &tokens,
+    int begin,
+    nn::KVCacheList &cache,
+    int chunk_size)
+{
+    int end = tokens.size();
+    if (chunk_size > 0)
+    {
+        for (; end - begin > chunk_size; begin += chunk_size)
+        {
+            prefill_chunk(model, tokens, begin, begin + chunk_size, cache, false);
+        }
+    }
+    return *prefill_chunk(model, tokens, begin, end, cache, true);
+}
+
+std::vector<int> generate(
+    Model &model,
+    const std::vector<int> &prompt,
+    const GenerationConfig &config = GenerationConfig(),
+    const TokenCallback &callback = nullptr,
+    GenerationStats *stats = nullptr,
+    nn::PrefixCache *prefix_cache = nullptr,
+    nn::KVCacheList *session_cache = nullptr)
+{
+    // With `session_cache` the prompt continues from whatever the cache
+    // already holds; every position fed to the model is left in it
+    if (prompt.empty())
+    {
+        throw std::invalid_argument("Prompt must contain at least one token");
+    }
+    if (!config.adapter.empty())
+    {
+        throw std::invalid_argument("generate() runs the base model; serve adapters through a Scheduler");
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+
+    nn::KVCacheList own_cache{};
+    if (session_cache == nullptr)
+    {
+        own_cache = model.make_cache(config.max_kv_size, config.kv_keep);
+    }
+    nn::KVCacheList &cache = session_cache ? *session_cache : own_cache;
+    std::vector<int> tokens{};
+    bool fresh = cache.empty() || cache[0]->offset == 0;
+
+    std::optional<array> key = std::nullopt;
+    auto next_key = [&]() -> std::optional<array>
+    {
+        if (!key)
+        {
+            return std::nullopt;
+        }
+        auto [k, sub] = random::split(*key, nn::current_stream());
+        key = k;
+        return sub;
+    };
+    if (config.seed)
+    {
+        key = random::key(*config.seed);
+    }
+
+    // Sampling stays on device: the penalty window is extended with each
+    // sampled token without reading it back
+    Sampler sampler;
+    std::vector<SamplingParams> params{config.sampling()};
+    std::optional<array> recent = std::nullopt;
+    if (params[0].penalized())
+    {
+        recent = Sampler::history({&prompt}, params);
+    }
+    std::optional<GrammarMatcher> matcher = std::nullopt;
+    if (config.grammar)
+    {
+        matcher.emplace(config.grammar);
+    }
+    auto sample = [&](const array &logits)
+    {
+        std::optional<array> allowed = std::nullopt;
+        if (matcher)
+        {
+            allowed = reshape(matcher->allowed(), {1, -1}, nn::current_stream());
+        }
+        array y = sampler.sample(logits, params, recent, next_key(), allowed).tokens;
+        if (recent)
+        {
+            StreamOrDevice s = nn::current_stream();
+            array r = concatenate({*recent, reshape(y, {1, 1}, s)}, 1, s);
+            int W = r.shape(1), keep = std::min(W, config.penalty_window);
+            recent = slice(r, {0, W - keep}, {1, W}, s);
+        }
+        return y;
+    };
+
+    // Prefill: the prompt (minus any cached prefix) goes through the model
+    // in chunks and fills the cache
+    int cached = (prefix_cache != nullptr && fresh) ? prefix_cache->fill(prompt, cache) : 0;
+    array y = sample(prefill(model, prompt, cached, cache, config.prefill_chunk_size));
+    async_eval({y});
+    auto first_token = start;
+
+    // Decode: one position per step, reading everything else from the
+    // cache. Step t + 1 is queued before token t is read back, so the
+    // device keeps working while the host runs stop checks and callbacks
+    // (unless a grammar needs token t to mask step t + 1).
+    while (int(tokens.size()) < config.max_tokens)
+    {
+        std::optional<array> next = std::nullopt;
+        auto queue_next = [&]()
+        {
+            if (int(tokens.size()) + 1 < config.max_tokens)
+            {
+                nn::MemoryBudget::check("generate");
+                next = sample(model.forward_last(reshape(y, {1, 1}, nn::current_stream()), &cache));
+                async_eval({*next});
+            }
+        };
+        if (!matcher)
+        {
+            queue_next();
+        }
+
+        int token = y.item<int>();
+        if (matcher)
+        {
+            matcher->accept(token);
+            queue_next();
+        }
+        if (tokens.empty())
+        {
+            first_token = clock::now();
+            if (prefix_cache != nullptr && fresh)
+            {
+                prefix_cache->insert(prompt, cache);
+            }
+        }
+        if (std::find(config.stop_tokens.begin(), config.stop_tokens.end(), token) != config.stop_tokens.end())
+        {
+            break;
+        }
+        tokens.push_back(token);
+        if ((callback && !callback(token)) || !next.has_value())
+        {
+            break;
+        }
+        y = *next;
+    }
+
+    if (stats != nullptr)
+    {
+        stats->prompt_tokens = prompt.size();
+        stats->cached_tokens = cached;
+        stats->generated_tokens = tokens.size();
+        stats->ttft_ms = std::chrono::duration<double, std::milli>(first_token - start).count();
+        stats->decode_ms = std::chrono::duration<double, std::milli>(clock::now() - first_token).count();
+    }
+    return tokens;
+}
@@ -0,0 +1,962 @@
+// Grammar-constrained decoding for mlx_llm.cpp
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "mlx/mlx.h"
+#include "common.cpp"
+#include "tokenizer.cpp"
+
+using namespace mlx::core;
+
+// A terminal matches one byte against a set of ranges; a non-terminal
+// refers to a rule. Rules are lists of alternatives, each a sequence of
+// symbols.
+struct GrammarSymbol
+{
+    int rule = -1;
+    bool negated = false;
+    std::vector<std::pair<uint8_t, uint8_t>> ranges{};
+
+    bool matches(uint8_t c) const
+    {
+        bool in = false;
+        for (auto [lo, hi] : ranges)
+        {
+            in |= lo <= c && c <= hi;
+        }
+        return in != negated;
+    }
+};
+
+using GrammarRule = std::vector<std::vector<GrammarSymbol>>;
+
+// Parses GBNF-style grammars:
+//   root  ::= "{" ws pair ("," ws pair)* "}"   # comment
+//   pair  ::= [a-z]+ ws ":" ws ("true" | "false")
+// with string literals, [character classes] (ranges, ^ negation), rule
+// references, ( groups ), | alternation and the * + ? postfixes. Matching
+// is byte level: literals may hold any UTF-8, classes only ASCII (a
+// negated class still accepts every non-ASCII byte).
+class GrammarParser
+{
+public:
+    std::vector<GrammarRule> rules{};
+
+    int parse(const std::string &_text)
+    {
+        text = _text;
+        pos = 0;
+        skip_space();
+        while (pos < text.size())
+        {
+            std::string name = parse_name();
+            skip_space();
+            if (text.compare(pos, 3, "::=") != 0)
+            {
+                fail("expected '::=' after rule name '" + name + "'");
+            }
+            pos += 3;
+            int id = rule_id(name);
+            if (defined[id])
+            {
+                fail("rule '" + name + "' is defined twice");
+            }
+            defined[id] = true;
+            rules[id] = parse_alternatives(false);
+        }
+        for (auto &[name, id] : names)
+        {
+            if (!defined[id])
+            {
+                throw std::invalid_argument("Grammar rule is referenced but not defined: " + name);
+            }
+        }
+        if (!names.count("root"))
+        {
+            throw std::invalid_argument("Grammar has no 'root' rule");
+        }
+        return names.at("root");
+    }
+
+private:
+    std::string text{};
+    size_t pos = 0;
+    std::map<std::string, int> names{};
+    std::vector<bool> defined{};
+
+    [[noreturn]] void fail(const std::string &message)
+    {
+        throw std::invalid_argument("Grammar: " + message + " at offset " + std::to_string(pos));
+    }
+
+    static bool is_name_char(char c)
+    {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
+    }
+
+    void skip_space()
+    {
+        while (pos < text.size())
+        {
+            if (text[pos] == '#')
+            {
+                while (pos < text.size() && text[pos] != '\n')
+                    pos++;
+            }
+            else if (std::isspace(static_cast<unsigned char>(text[pos])))
+            {
+                pos++;
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+
+    std::string parse_name()
+    {
+        size_t start = pos;
+        while (pos < text.size() && is_name_char(text[pos]))
+            pos++;
+        if (pos == start)
+        {
+            fail("expected a rule name");
+        }
+        return text.substr(start, pos - start);
+    }
+
+    // True when the next thing is `name ::=`, i.e. the next rule
+    bool at_rule_start()
+    {
+        size_t p = pos;
+        while (p < text.size() && is_name_char(text[p]))
+            p++;
+        if (p == pos)
+        {
+            return false;
+        }
+        while (p < text.size() && (text[p] == ' ' || text[p] == '\t' || text[p] == '\n' || text[p] == '\r'))
+            p++;
+        return text.compare(p, 3, "::=") == 0;
+    }
+
+    int rule_id(const std::string &name)
+    {
+        auto it = names.find(name);
+        if (it != names.end())
+        {
+            return it->second;
+        }
+        int id = new_rule();
+        names[name] = id;
+        defined[id] = false;
+        return id;
+    }
+
+    int new_rule()
+    {
+        rules.push_back({});
+        defined.push_back(true);
+        return rules.size() - 1;
+    }
+
+    GrammarRule parse_alternatives(bool nested)
+    {
+        GrammarRule alternatives{parse_sequence(nested)};
+        while (pos < text.size() && text[pos] == '|')
+        {
+            pos++;
+            alternatives.push_back(parse_sequence(nested));
+        }
+        return alternatives;
+    }
+
+    std::vector<GrammarSymbol> parse_sequence(bool nested)
+    {
+        std::vector<GrammarSymbol> sequence{};
+        skip_space();
+        while (pos < text.size() && text[pos] != '|' && text[pos] != ')')
+        {
+            if (!nested && at_rule_start())
+            {
+                break;
+            }
+            std::vector<GrammarSymbol> item = parse_item();
+            skip_space();
+            if (pos < text.size() && (text[pos] == '*' || text[pos] == '+' || text[pos] == '?'))
+            {
+                item = repeat(item, text[pos++]);
+                skip_space();
+            }
+            sequence.insert(sequence.end(), item.begin(), item.end());
+        }
+        if (!nested && pos < text.size() && text[pos] == ')')
+        {
+            fail("unbalanced ')'");
+        }
+        return sequence;
+    }
+
+    std::vector<GrammarSymbol> parse_item()
+    {
+        char c = text[pos];
+        if (c == '"')
+        {
+            pos++;
+            std::vector<GrammarSymbol> literal{};
+            while (pos < text.size() && text[pos] != '"')
+            {
+                for (uint8_t b : parse_char())
+                {
+                    literal.push_back({-1, false, {{b, b}}});
+                }
+            }
+            expect('"');
+            return literal;
+        }
+        if (c == '[')
+        {
+            pos++;
+            GrammarSymbol symbol;
+            if (pos < text.size() && text[pos] == '^')
+            {
+                symbol.negated = true;
+                pos++;
+            }
+            while (pos < text.size() && text[pos] != ']')
+            {
+                uint8_t lo = class_char();
+                uint8_t hi = lo;
+                if (pos + 1 < text.size() && text[pos] == '-' && text[pos + 1] != ']')
+                {
+                    pos++;
+                    hi = class_char();
+                }
+                symbol.ranges.push_back({lo, hi});
+            }
+            expect(']');
+            return {symbol};
+        }
+        if (c == '(')
+        {
+            pos++;
+            int id = new_rule();
+            GrammarRule group = parse_alternatives(true);
+            expect(')');
+            rules[id] = std::move(group);
+            return {{id}};
+        }
+        if (c == '.')
+        {
+            pos++;
+            return {{-1, true, {}}};
+        }
+        if (is_name_char(c))
+        {
+            return {{rule_id(parse_name())}};
+        }
+        fail(std::string("unexpected '") + c + "'");
+    }
+
+    std::vector<GrammarSymbol> repeat(const std::vector<GrammarSymbol> &item, char op)
+    {
+        // x* -> R ::= x R | ;  x+ -> x x* ;  x? -> R ::= x |
+        int id = new_rule();
+        if (op == '?')
+        {
+            rules[id] = {item, {}};
+            return {{id}};
+        }
+        std::vector<GrammarSymbol> loop = item;
+        loop.push_back({id});
+        rules[id] = {loop, {}};
+        if (op == '*')
+        {
+            return {{id}};
+        }
+        std::vector<GrammarSymbol> once = item;
+        once.push_back({id});
+        return once;
+    }
+
+    void expect(char c)
+    {
+        if (pos >= text.size() || text[pos] != c)
+        {
+            fail(std::string("expected '") + c + "'");
+        }
+        pos++;
+    }
+
+    uint32_t hex(int digits)
+    {
+        if (pos + digits > text.size())
+        {
+            fail("truncated escape");
+        }
+        uint32_t value = std::stoul(text.substr(pos, digits), nullptr, 16);
+        pos += digits;
+        return value;
+    }
+
+    // One (possibly escaped) character as UTF-8 bytes
+    std::string parse_char()
+    {
+        if (text[pos] != '\\')
+        {
+            return std::string(1, text[pos++]);
+        }
+        pos++;
+        if (pos >= text.size())
+        {
+            fail("truncated escape");
+        }
+        char e = text[pos++];
+        uint32_t cp = 0;
+        switch (e)
+        {
+        case 'n':
+            return "\n";
+        case 'r':
+            return "\r";
+        case 't':
+            return "\t";
+        case 'x':
+            return std::string(1, char(hex(2)));
+        case 'u':
+            cp = hex(4);
+            break;
+        case 'U':
+            cp = hex(8);
+            break;
+        default:
+            return std::string(1, e);
+        }
+        std::string out{};
+        if (cp < 0x80)
+            out += char(cp);
+        else if (cp < 0x800)
+            out += {char(0xC0 | (cp >> 6)), char(0x80 | (cp & 0x3F))};
+        else if (cp < 0x10000)
+            out += {char(0xE0 | (cp >> 12)), char(0x80 | ((cp >> 6) & 0x3F)), char(0x80 | (cp & 0x3F))};
+        else
+            out += {char(0xF0 | (cp >> 18)), char(0x80 | ((cp >> 12) & 0x3F)),
+                    char(0x80 | ((cp >> 6) & 0x3F)), char(0x80 | (cp & 0x3F))};
+        return out;
+    }
+
+    uint8_t class_char()
+    {
+        std::string c = parse_char();
+        if (c.size() != 1 || static_cast<uint8_t>(c[0]) >= 0x80)
+        {
+            fail("character classes only take ASCII, use a string literal");
+        }
+        return c[0];
+    }
+};
+
+// Converts a JSON schema to the grammar above. Covers type (and lists of
+// types), properties / required, items, enum, const, anyOf / oneOf;
+// anything else falls back to an unconstrained JSON value. Properties
+// are emitted in key order (JsonValue keeps members sorted), optional
+// ones may be left out, extra ones never appear.
+class JsonSchemaConverter
+{
+public:
+    std::string convert(const nn::JsonValue &schema)
+    {
+        rules.clear();
+        std::string root = visit(schema, "root-value");
+        rules.push_back({"root", "ws " + root + " ws"});
+        std::string out{};
+        for (auto &[name, body] : rules)
+        {
+            out += name + " ::= " + body + "\n";
+        }
+        return out + primitives;
+    }
+
+    // A JSON value as a grammar string literal, e.g. "\"a\""
+    static std::string literal(const nn::JsonValue &value)
+    {
+        std::string json = json_text(value), out = "\"";
+        for (char c : json)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            if (c == '\n')
+            {
+                out += "\\n";
+                continue;
+            }
+            out += c;
+        }
+        return out + "\"";
+    }
+
+private:
+    std::vector<std::pair<std::string, std::string>> rules{};
+
+    const std::string primitives =
+        "ws ::= ([ \\t\\n] ([ \\t\\n] ([ \\t\\n] ([ \\t\\n])?)?)?)?\n"
+        "value ::= object | array | string | number | boolean | null\n"
+        "object ::= \"{\" ws (string ws \":\" ws value ws (\",\" ws string ws \":\" ws value ws)*)? \"}\"\n"
+        "array ::= \"[\" ws (value ws (\",\" ws value ws)*)? \"]\"\n"
+        "string ::= \"\\\"\" char* \"\\\"\"\n"
+        "char ::= [^\"\\\\\\x00-\\x1f] | \"\\\\\" ([\"\\\\/bfnrt] | \"u\" hex hex hex hex)\n"
+        "hex ::= [0-9a-fA-F]\n"
+        "integer ::= \"-\"? (\"0\" | [1-9] [0-9]*)\n"
+        "number ::= integer (\".\" [0-9]+)? ([eE] [-+]? [0-9]+)?\n"
+        "boolean ::= \"true\" | \"false\"\n"
+        "null ::= \"null\"\n";
+
+    static std::string json_text(const nn::JsonValue &v)
+    {
+        switch (v.type)
+        {
+        case nn::JsonValue::Type::Null:
+            return "null";
+        case nn::JsonValue::Type::Bool:
+            return v.boolean ? "true" : "false";
+        case nn::JsonValue::Type::Number:
+        {
+            char buffer[32];
+            if (v.number == std::floor(v.number) && std::fabs(v.number) < 1e15)
+                std::snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(v.number));
+            else
+                std::snprintf(buffer, sizeof(buffer), "%.17g", v.number);
+            return buffer;
+        }
+        case nn::JsonValue::Type::String:
+        {
+            std::string out = "\"";
+            for (unsigned char c : v.string)
+            {
+                if (c == '"' || c == '\\')
+                    out += {'\\', char(c)};
+                else if (c == '\n')
+                    out += "\\n";
+                else if (c < 0x20)
+                {
+                    char buffer[8];
+                    std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                    out += buffer;
+                }
+                else
+                    out += char(c);
+            }
+            return out + "\"";
+        }
+        case nn::JsonValue::Type::Array:
+        {
+            std::string out = "[";
+            for (size_t i = 0; i < v.items.size(); i++)
+                out += (i ? "," : "") + json_text(v.items[i]);
+            return out + "]";
+        }
+        default:
+        {
+            std::string out = "{";
+            for (auto &[k, m] : v.members)
+                out += (out.size() > 1 ? "," : "") + json_text(nn::JsonValue{nn::JsonValue::Type::String, false, 0, k}) + ":" + json_text(m);
+            return out + "}";
+        }
+        }
+    }
+
+    std::string add(const std::string &hint, const std::string &body)
+    {
+        std::string name = hint + "-" + std::to_string(rules.size());
+        rules.push_back({name, body});
+        return name;
+    }
+
+    std::string visit(const nn::JsonValue &schema, const std::string &hint)
+    {
+        if (!schema.is_object())
+        {
+            return "value";
+        }
+        if (schema.contains("const"))
+        {
+            return add(hint, literal(schema.at("const")));
+        }
+        if (schema.contains("enum"))
+        {
+            std::string body{};
+            for (auto &v : schema.at("enum").items)
+                body += (body.empty() ? "" : " | ") + literal(v);
+            return add(hint, body.empty() ? "value" : body);
+        }
+        for (const char *key : {"anyOf", "oneOf"})
+        {
+            if (schema.contains(key))
+            {
+                std::string body{};
+                for (auto &s : schema.at(key).items)
+                    body += (body.empty() ? "" : " | ") + visit(s, hint);
+                return add(hint, body);
+            }
+        }
+        if (!schema.contains("type"))
+        {
+            return "value";
+        }
+        const nn::JsonValue &type = schema.at("type");
+        if (type.is_array())
+        {
+            std::string body{};
+            for (auto &t : type.items)
+            {
+                nn::JsonValue single = schema;
+                single.members["type"] = t;
+                body += (body.empty() ? "" : " | ") + visit(single, hint);
+            }
+            return add(hint, body);
+        }
+        const std::string &t = type.string;
+        if (t == "object")
+        {
+            return visit_object(schema, hint);
+        }
+        if (t == "array")
+        {
+            std::string item = schema.contains("items") ? visit(schema.at("items"), hint + "-item") : "value";
+            return add(hint, "\"[\" ws (" + item + " ws (\",\" ws " + item + " ws)*)? \"]\"");
+        }
+        if (t == "string" || t == "number" || t == "integer" || t == "boolean" || t == "null")
+        {
+            return t;
+        }
+        return "value";
+    }
+
+    std::string visit_object(const nn::JsonValue &schema, const std::string &hint)
+    {
+        if (!schema.contains("properties"))
+        {
+            return "object";
+        }
+        std::vector<std::pair<std::string, bool>> props{}; // (key-value rule, required)
+        for (auto &[key, sub] : schema.at("properties").members)
+        {
+            bool required = false;
+            if (schema.contains("required"))
+            {
+                for (auto &r : schema.at("required").items)
+                    required |= r.string == key;
+            }
+            nn::JsonValue name{nn::JsonValue::Type::String, false, 0, key};
+            std::string kv = literal(name) + " ws \":\" ws " + visit(sub, hint + "-" + sanitize(key));
+            props.push_back({kv, required});
+        }
+
+        // Commas: optional properties before the first required one carry
+        // a trailing comma, the rest a leading one. With nothing required,
+        // whichever property comes first starts the list.
+        auto first = std::find_if(props.begin(), props.end(), [](auto &p)
+                                  { return p.second; });
+        std::string body = "\"{\" ws ";
+        if (first != props.end())
+        {
+            for (auto it = props.begin(); it != props.end(); ++it)
+            {
+                if (it < first)
+                    body += "(" + it->first + " ws \",\" ws)? ";
+                else if (it == first)
+                    body += it->first + " ws ";
+                else if (it->second)
+                    body += "\",\" ws " + it->first + " ws ";
+                else
+                    body += "(\",\" ws " + it->first + " ws)? ";
+            }
+        }
+        else if (!props.empty())
+        {
+            std::string alternatives{};
+            for (size_t i = 0; i < props.size(); i++)
+            {
+                std::string alt = props[i].first + " ws";
+                for (size_t j = i + 1; j < props.size(); j++)
+                    alt += " (\",\" ws " + props[j].first + " ws)?";
+                alternatives += (i ? " | " : "") + alt;
+            }
+            body += "(" + alternatives + ")? ";
+        }
+        return add(hint, body + "\"}\"");
+    }
+
+    static std::string sanitize(const std::string &key)
+    {
+        std::string out{};
+        for (char c : key)
+            out += std::isalnum(static_cast<unsigned char>(c)) ? c : '-';
+        return out;
+    }
+};
+
+// A compiled grammar bound to a tokenizer's vocabulary. Matching state is a
+// set of parse stacks; the tokens allowed in a state are found by walking
+// a byte trie of the vocabulary, so tokens sharing a prefix share the work.
+// Masks are bit-packed (one bit per token), kept on the device and cached
+// per state, so states that repeat (inside a string, between list items)
+// cost one lookup. One Grammar can back any number of matchers.
+class Grammar
+{
+public:
+    struct Position
+    {
+        int rule, alt, index;
+        bool operator<(const Position &o) const
+        {
+            return std::tie(rule, alt, index) < std::tie(o.rule, o.alt, o.index);
+        }
+        bool operator==(const Position &o) const
+        {
+            return rule == o.rule && alt == o.alt && index == o.index;
+        }
+    };
+    using Stack = std::vector<Position>; // innermost rule last
+    using State = std::vector<Stack>;    // sorted, an empty stack means complete
+
+    // `vocab_size` is the model's logit width (0: the tokenizer's);
+    // `end_tokens` are allowed once the grammar is complete (default: eos).
+    // At least one must be in the vocabulary: a complete state allows
+    // nothing else, so without one generation could not stop.
+    Grammar(
+        const std::string &ebnf,
+        const Tokenizer &tokenizer,
+        int _vocab_size = 0,
+        const std::vector<int> &_end_tokens = {},
+        size_t _cache_size = 4096)
+        : vocab_size(_vocab_size > 0 ? _vocab_size : tokenizer.vocab_size()),
+          end_tokens(_end_tokens),
+          cache_size(_cache_size)
+    {
+        GrammarParser parser;
+        root = parser.parse(ebnf);
+        rules = parser.rules;
+        if (end_tokens.empty() && tokenizer.eos_id >= 0)
+        {
+            end_tokens.push_back(tokenizer.eos_id);
+        }
+        if (std::none_of(end_tokens.begin(), end_tokens.end(), [&](int id)
+                         { return id >= 0 && id < vocab_size; }))
+        {
+            throw std::invalid_argument("Grammar needs an end token in the vocabulary (no eos and no end_tokens given)");
+        }
+
+        int n = std::min(vocab_size, tokenizer.vocab_size());
+        token_bytes.resize(n);
+        trie.push_back({});
+        for (int id = 0; id < n; id++)
+        {
+            if (tokenizer.is_special(id))
+            {
+                continue;
+            }
+            token_bytes[id] = tokenizer.token_bytes(id);
+            if (token_bytes[id].empty())
+            {
+                continue;
+            }
+            int node = 0;
+            for (unsigned char c : token_bytes[id])
+            {
+                auto &children = trie[node].children;
+                auto it = std::find_if(children.begin(), children.end(), [c](auto &e)
+                                       { return e.first == c; });
+                if (it != children.end())
+                {
+                    node = it->second;
+                    continue;
+                }
+                int child = trie.size();
+                children.push_back({c, child});
+                trie.push_back({});
+                node = child;
+            }
+            trie[node].tokens.push_back(id);
+        }
+
+        words = (vocab_size + 31) / 32;
+        std::vector<int> index(vocab_size);
+        std::vector<uint32_t> bit(vocab_size);
+        for (int i = 0; i < vocab_size; i++)
+        {
+            index[i] = i / 32;
+            bit[i] = 1u << (i % 32);
+        }
+        word_index = array(index.begin(), {vocab_size}, int32);
+        bit_value = array(bit.begin(), {vocab_size}, uint32);
+    }
+
+    static std::shared_ptr<Grammar> from_json_schema(
+        const nn::JsonValue &schema,
+        const Tokenizer &tokenizer,
+        int vocab_size = 0,
+        const std::vector<int> &end_tokens = {})
+    {
+        return std::make_shared<Grammar>(JsonSchemaConverter().convert(schema), tokenizer, vocab_size, end_tokens);
+    }
+
+    State initial() const
+    {
+        State state{};
+        for (int a = 0; a < int(rules[root].size()); a++)
+        {
+            expand({{root, a, 0}}, state, 0);
+        }
+        normalize(state);
+        return state;
+    }
+
+    State advance(const State &state, uint8_t c) const
+    {
+        State next{};
+        for (const Stack &stack : state)
+        {
+            if (stack.empty())
+            {
+                continue;
+            }
+            const Position &top = stack.back();
+            if (rules[top.rule][top.alt][top.index].matches(c))
+            {
+                Stack s = stack;
+                s.back().index++;
+                expand(std::move(s), next, 0);
+            }
+        }
+        normalize(next);
+        return next;
+    }
+
+    bool complete(const State &state) const
+    {
+        return !state.empty() && state.front().empty();
+    }
+
+    bool is_end_token(int token) const
+    {
+        return std::find(end_tokens.begin(), end_tokens.end(), token) != end_tokens.end();
+    }
+
+    // Feeds one token's bytes; throws if the grammar does not allow it
+    State accept(const State &state, int token) const
+    {
+        if (is_end_token(token) && complete(state))
+        {
+            return state;
+        }
+        if (token < 0 || token >= int(token_bytes.size()) || token_bytes[token].empty())
+        {
+            throw std::invalid_argument("Token is not allowed by the grammar: " + std::to_string(token));
+        }
+        State next = state;
+        for (unsigned char c : token_bytes[token])
+        {
+            next = advance(next, c);
+            if (next.empty())
+            {
+                throw std::invalid_argument("Token is not allowed by the grammar: " + std::to_string(token));
+            }
+        }
+        return next;
+    }
+
+    // Bit-packed mask of the tokens allowed in `state`, [ceil(vocab / 32)]
+    // uint32 on the device
+    array mask(const State &state)
+    {
+        std::string key = state_key(state);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = cache.find(key);
+            if (it != cache.end())
+            {
+                lru.splice(lru.begin(), lru, it->second.second);
+                return it->second.first;
+            }
+        }
+
+        std::vector<uint32_t> bits(words, 0);
+        walk(0, state, bits);
+        if (complete(state))
+        {
+            for (int id : end_tokens)
+            {
+                if (id >= 0 && id < vocab_size)
+                    bits[id / 32] |= 1u << (id % 32);
+            }
+        }
+        array packed = array(bits.begin(), {words}, uint32);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!cache.count(key))
+        {
+            lru.push_front(key);
+            cache.insert({key, {packed, lru.begin()}});
+            if (cache.size() > cache_size)
+            {
+                cache.erase(lru.back());
+                lru.pop_back();
+            }
+        }
+        return packed;
+    }
+
+    // [vocab] bool mask for the sampler, unpacked on the device
+    array allowed(const State &state)
+    {
+        StreamOrDevice s = nn::current_stream();
+        array packed = mask(state);
+        return not_equal(bitwise_and(take(packed, word_index, 0, s), bit_value, s), array(0, uint32), s);
+    }
+
+    int size() const
+    {
+        return vocab_size;
+    }
+
+private:
+    struct TrieNode
+    {
+        std::vector<std::pair<uint8_t, int>> children{};
+        std::vector<int> tokens{};
+    };
+
+    std::vector<GrammarRule> rules{};
+    int root = 0;
+    int vocab_size;
+    std::vector<int> end_tokens;
+    size_t cache_size;
+    std::vector<std::string> token_bytes{};
+    std::vector<TrieNode> trie{};
+    int words = 0;
+    array word_index = array(0);
+    array bit_value = array(0);
+
+    std::mutex mutex;
+    std::list<std::string> lru{};
+    std::unordered_map<std::string, std::pair<array, std::list<std::string>::iterator>> cache{};
+
+    // Moves `stack` forward until its top is a terminal: finished rules
+    // pop, rule references push each of their alternatives. A frame is
+    // stepped past a reference before the referenced rule is pushed and
+    // dropped if that was its last symbol, so right recursion
+    // (`r ::= x r |`) keeps the stack flat and its states repeat.
+    void expand(Stack stack, State &out, int depth) const
+    {
+        if (depth > 256)
+        {
+            throw std::invalid_argument("Grammar is left-recursive");
+        }
+        while (!stack.empty() && stack.back().index == int(rules[stack.back().rule][stack.back().alt].size()))
+        {
+            stack.pop_back();
+        }
+        if (stack.empty())
+        {
+            out.push_back(stack);
+            return;
+        }
+        const Position &top = stack.back();
+        const GrammarSymbol &symbol = rules[top.rule][top.alt][top.index];
+        if (symbol.rule < 0)
+        {
+            out.push_back(std::move(stack));
+            return;
+        }
+        int rule = symbol.rule;
+        Stack rest = stack;
+        rest.back().index++;
+        while (!rest.empty() && rest.back().index == int(rules[rest.back().rule][rest.back().alt].size()))
+        {
+            rest.pop_back();
+        }
+        for (int a = 0; a < int(rules[rule].size()); a++)
+        {
+            Stack s = rest;
+            s.push_back({rule, a, 0});
+            expand(std::move(s), out, depth + 1);
+        }
+    }
+
+    static void normalize(State &state)
+    {
+        std::sort(state.begin(), state.end());
+        state.erase(std::unique(state.begin(), state.end()), state.end());
+    }
+
+    static std::string state_key(const State &state)
+    {
+        std::string key{};
+        for (const Stack &stack : state)
+        {
+            int n = stack.size();
+            key.append(reinterpret_cast<const char *>(&n), sizeof(n));
+            key.append(reinterpret_cast<const char *>(stack.data()), stack.size() * sizeof(Position));
+        }
+        return key;
+    }
+
+    void walk(int node, const State &state, std::vector<uint32_t> &bits) const
+    {
+        for (auto [c, child] : trie[node].children)
+        {
+            State next = advance(state, c);
+            if (next.empty())
+            {
+                continue;
+            }
+            for (int id : trie[child].tokens)
+            {
+                bits[id / 32] |= 1u << (id % 32);
+            }
+            walk(child, next, bits);
+        }
+    }
+};
+
+// Per-sequence matching state over a shared Grammar
+class GrammarMatcher
+{
+public:
+    GrammarMatcher(std::shared_ptr<Grammar> _grammar) : grammar(_grammar), state(_grammar->initial()) {}
+
+    array allowed()
+    {
+        return grammar->allowed(state);
+    }
+
+    void accept(int token)
+    {
+        state = grammar->accept(state, token);
+    }
+
+    bool complete() const
+    {
+        return grammar->complete(state);
+    }
+
+private:
+    std::shared_ptr<Grammar> grammar;
+    Grammar::State state;
+};
@@ -0,0 +1,348 @@
+// Minimal JSON reader for mlx_llm.cpp (model index and config files)
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace mlx::core::nn {
+
+class JsonValue
+{
+public:
+    enum class Type
+    {
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object
+    };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string{};
+    std::vector<JsonValue> items{};
+    std::map<std::string, JsonValue> members{};
+
+    bool is_null() const { return type == Type::Null; }
+    bool is_string() const { return type == Type::String; }
+    bool is_number() const { return type == Type::Number; }
+    bool is_array() const { return type == Type::Array; }
+    bool is_object() const { return type == Type::Object; }
+
+    bool contains(const std::string &key) const
+    {
+        return type == Type::Object && members.find(key) != members.end();
+    }
+
+    const JsonValue &at(const std::string &key) const
+    {
+        auto it = members.find(key);
+        if (type != Type::Object || it == members.end())
+        {
+            throw std::runtime_error("JSON object has no key: " + key);
+        }
+        return it->second;
+    }
+
+    const JsonValue &at(size_t i) const
+    {
+        if (type != Type::Array || i >= items.size())
+        {
+            throw std::runtime_error("JSON array index out of range");
+        }
+        return items[i];
+    }
+
+    size_t size() const
+    {
+        return type == Type::Array ? items.size() : members.size();
+    }
+
+    int as_int() const
+    {
+        return int(number);
+    }
+};
+
+class JsonParser
+{
+public:
+    JsonParser(const std::string &_text) : text(_text) {}
+
+    JsonValue parse()
+    {
+        JsonValue v = parse_value();
+        skip_whitespace();
+        if (pos != text.size())
+        {
+            fail("trailing characters");
+        }
+        return v;
+    }
+
+private:
+    const std::string &text;
+    size_t pos = 0;
+
+    [[noreturn]] void fail(const std::string &what)
+    {
+        throw std::runtime_error("Invalid JSON at offset " + std::to_string(pos) + ": " + what);
+    }
+
+    void skip_whitespace()
+    {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\n' || text[pos] == '\r' || text[pos] == '\t'))
+        {
+            pos++;
+        }
+    }
+
+    void expect(char c)
+    {
+        skip_whitespace();
+        if (pos >= text.size() || text[pos] != c)
+        {
+            fail(std::string("expected '") + c + "'");
+        }
+        pos++;
+    }
+
+    bool consume_literal(const char *literal)
+    {
+        size_t n = std::char_traits<char>::length(literal);
+        if (text.compare(pos, n, literal) == 0)
+        {
+            pos += n;
+            return true;
+        }
+        return false;
+    }
+
+    JsonValue parse_value()
+    {
+        skip_whitespace();
+        if (pos >= text.size())
+        {
+            fail("unexpected end of input");
+        }
+        JsonValue v;
+        char c = text[pos];
+        if (c == '{')
+        {
+            v.type = JsonValue::Type::Object;
+            pos++;
+            skip_whitespace();
+            if (pos < text.size() && text[pos] == '}')
+            {
+                pos++;
+                return v;
+            }
+            while (true)
+            {
+                skip_whitespace();
+                std::string key = parse_string();
+                expect(':');
+                v.members[key] = parse_value();
+                skip_whitespace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    pos++;
+                    continue;
+                }
+                expect('}');
+                return v;
+            }
+        }
+        if (c == '[')
+        {
+            v.type = JsonValue::Type::Array;
+            pos++;
+            skip_whitespace();
+            if (pos < text.size() && text[pos] == ']')
+            {
+                pos++;
+                return v;
+            }
+            while (true)
+            {
+                v.items.push_back(parse_value());
+                skip_whitespace();
+                if (pos < text.size() && text[pos] == ',')
+                {
+                    pos++;
+                    continue;
+                }
+                expect(']');
+                return v;
+            }
+        }
+        if (c == '"')
+        {
+            v.type = JsonValue::Type::String;
+            v.string = parse_string();
+            return v;
+        }
+        if (consume_literal("true"))
+        {
+            v.type = JsonValue::Type::Bool;
+            v.boolean = true;
+            return v;
+        }
+        if (consume_literal("false"))
+        {
+            v.type = JsonValue::Type::Bool;
+            return v;
+        }
+        if (consume_literal("null"))
+        {
+            return v;
+        }
+
+        size_t start = pos;
+        while (pos < text.size() && (isdigit(text[pos]) || text[pos] == '-' || text[pos] == '+' ||
+                                     text[pos] == '.' || text[pos] == 'e' || text[pos] == 'E'))
+        {
+            pos++;
+        }
+        if (start == pos)
+        {
+            fail("unexpected character");
+        }
+        v.type = JsonValue::Type::Number;
+        v.number = std::stod(text.substr(start, pos - start));
+        return v;
+    }
+
+    uint32_t parse_hex4()
+    {
+        if (pos + 4 > text.size())
+        {
+            fail("truncated unicode escape");
+        }
+        uint32_t cp = std::stoul(text.substr(pos, 4), nullptr, 16);
+        pos += 4;
+        return cp;
+    }
+
+    static void append_utf8(std::string &out, uint32_t cp)
+    {
+        if (cp < 0x80)
+        {
+            out += char(cp);
+        }
+        else if (cp < 0x800)
+        {
+            out += char(0xC0 | (cp >> 6));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            out += char(0xE0 | (cp >> 12));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += char(0xF0 | (cp >> 18));
+            out += char(0x80 | ((cp >> 12) & 0x3F));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+    }
+
+    std::string parse_string()
+    {
+        if (pos >= text.size() || text[pos] != '"')
+        {
+            fail("expected string");
+        }
+        pos++;
+        std::string out{};
+        while (pos < text.size() && text[pos] != '"')
+        {
+            char c = text[pos++];
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size())
+            {
+                fail("truncated escape");
+            }
+            char e = text[pos++];
+            switch (e)
+            {
+            case '"':
+            case '\\':
+            case '/':
+                out += e;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u':
+            {
+                uint32_t cp = parse_hex4();
+                // Surrogate pair
+                if (cp >= 0xD800 && cp < 0xDC00 && text.compare(pos, 2, "\\u") == 0)
+                {
+                    pos += 2;
+                    uint32_t low = parse_hex4();
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default:
+                fail("unknown escape");
+            }
+        }
+        if (pos >= text.size())
+        {
+            fail("unterminated string");
+        }
+        pos++;
+        return out;
+    }
+};
+
+JsonValue parse_json(const std::string &text)
+{
+    return JsonParser(text).parse();
+}
+
+JsonValue load_json(const std::string &file)
+{
+    std::ifstream in(file);
+    if (!in)
+    {
+        throw std::runtime_error("Unable to open file: " + file);
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    return parse_json(buffer.str());
+}
+
+} // namespace mlx::core::nn
@@ -0,0 +1,471 @@
+// KV cache for mlx_llm.cpp
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "mlx/mlx.h"
+#include "common.cpp"
+
+namespace mlx::core::nn {
+
+class KVCache
+{
+public:
+    // Keys and values are kept as [B, n_kv_heads, capacity, head_dim] and
+    // grown in chunks of `step` positions, so a decode step only writes the
+    // new position instead of re-projecting the whole prefix.
+    std::optional<array> keys = std::nullopt;
+    std::optional<array> values = std::nullopt;
+    int offset = 0;
+    int step = 256;
+
+    KVCache() = default;
+    KVCache(int _step)
+    {
+        step = _step;
+    }
+    virtual ~KVCache() = default;
+
+    virtual std::pair<array, array> update_and_fetch(const array &new_keys, const array &new_values)
+    {
+        StreamOrDevice s = current_stream();
+        int prev = offset;
+        int B = new_keys.shape(0), n_kv_heads = new_keys.shape(1), L = new_keys.shape(2);
+        int k_head_dim = new_keys.shape(3), v_head_dim = new_values.shape(3);
+
+        if (!keys.has_value() || (prev + L) > keys->shape(2))
+        {
+            int n_steps = (step + L - 1) / step;
+            array k_chunk = zeros({B, n_kv_heads, n_steps * step, k_head_dim}, new_keys.dtype(), s);
+            array v_chunk = zeros({B, n_kv_heads, n_steps * step, v_head_dim}, new_values.dtype(), s);
+            if (keys.has_value())
+            {
+                // Drop the unused tail of the last chunk before growing
+                if (prev % step != 0)
+                {
+                    keys = slice(*keys, {0, 0, 0, 0}, {B, n_kv_heads, prev, k_head_dim}, s);
+                    values = slice(*values, {0, 0, 0, 0}, {B, n_kv_heads, prev, v_head_dim}, s);
+                }
+                keys = concatenate({*keys, k_chunk}, 2, s);
+                values = concatenate({*values, v_chunk}, 2, s);
+            }
+            else
+            {
+                keys = k_chunk;
+                values = v_chunk;
+            }
+        }
+
+        offset += L;
+        keys = slice_update(*keys, new_keys, {0, 0, prev, 0}, {B, n_kv_heads, offset, k_head_dim}, s);
+        values = slice_update(*values, new_values, {0, 0, prev, 0}, {B, n_kv_heads, offset, v_head_dim}, s);
+
+        return state();
+    }
+
+    // Everything cached so far as [B, n_kv_heads, offset, head_dim]
+    virtual std::pair<array, array> state()
+    {
+        if (!keys.has_value())
+        {
+            throw std::runtime_error("KVCache is empty");
+        }
+        const auto &ks = keys->shape(), &vs = values->shape();
+        StreamOrDevice s = current_stream();
+        return {
+            slice(*keys, {0, 0, 0, 0}, {ks[0], ks[1], offset, ks[3]}, s),
+            slice(*values, {0, 0, 0, 0}, {vs[0], vs[1], offset, vs[3]}, s)};
+    }
+
+    // Drops the last n positions (e.g. rejected draft tokens); the next
+    // update overwrites them. Returns how many were dropped.
+    virtual int trim(int n)
+    {
+        n = std::min(offset, n);
+        offset -= n;
+        return n;
+    }
+
+    virtual void reset()
+    {
+        keys = std::nullopt;
+        values = std::nullopt;
+        offset = 0;
+    }
+
+    // Positions a new query attends to before its own; the causal mask is
+    // built against this rather than `offset`
+    virtual int length()
+    {
+        return offset;
+    }
+};
+
+// One cache per layer for a single sequence
+using KVCacheList = std::vector<std::shared_ptr<KVCache>>;
+
+KVCacheList make_kv_cache(int num_layers)
+{
+    KVCacheList cache{};
+    for (int i = 0; i < num_layers; i++)
+    {
+        cache.push_back(std::make_shared<KVCache>());
+    }
+    return cache;
+}
+
+class RotatingKVCache : public KVCache
+{
+public:
+    // Holds at most `max_size` positions: the first `keep` ("attention
+    // sinks") forever, the rest as a ring of the most recent ones. Keys are
+    // stored after RoPE at their absolute position (`offset` keeps growing),
+    // so distances between the kept positions stay exact after eviction.
+    // Single-token updates write into the ring in place; the order inside
+    // the buffer does not matter since a decode query sees every position.
+    int max_size, keep;
+    int size = 0; // positions held, at most max_size
+    int idx = 0;  // next slot to write
+
+    RotatingKVCache(int _max_size, int _keep = 4, int _step = 256) : KVCache(_step)
+    {
+        if (_keep >= _max_size)
+        {
+            throw std::invalid_argument("RotatingKVCache must keep fewer positions than it holds");
+        }
+        max_size = _max_size;
+        keep = _keep;
+    }
+
+    std::pair<array, array> update_and_fetch(const array &new_keys, const array &new_values) override
+    {
+        StreamOrDevice s = current_stream();
+        int L = new_keys.shape(2);
+        offset += L;
+        if (L > 1 || !keys.has_value())
+        {
+            // Prefill: attend over everything held plus the new chunk in
+            // order, then keep the sinks and the newest positions
+            array k = keys.has_value() ? concatenate({ordered(*keys, s), new_keys}, 2, s) : new_keys;
+            array v = values.has_value() ? concatenate({ordered(*values, s), new_values}, 2, s) : new_values;
+            keys = evict(k, s);
+            values = evict(v, s);
+            size = keys->shape(2);
+            idx = size == max_size ? keep : size;
+            return {k, v};
+        }
+
+        int B = new_keys.shape(0), n_kv_heads = new_keys.shape(1);
+        int k_head_dim = new_keys.shape(3), v_head_dim = new_values.shape(3);
+        if (size < max_size && size >= keys->shape(2))
+        {
+            // Not full yet: grow by `step`, never past max_size
+            int grow = std::min(step, max_size - size);
+            keys = concatenate({slice(*keys, {0, 0, 0, 0}, {B, n_kv_heads, size, k_head_dim}, s),
+                                zeros({B, n_kv_heads, grow, k_head_dim}, new_keys.dtype(), s)},
+                               2, s);
+            values = concatenate({slice(*values, {0, 0, 0, 0}, {B, n_kv_heads, size, v_head_dim}, s),
+                                  zeros({B, n_kv_heads, grow, v_head_dim}, new_values.dtype(), s)},
+                                 2, s);
+        }
+        keys = slice_update(*keys, new_keys, {0, 0, idx, 0}, {B, n_kv_heads, idx + 1, k_head_dim}, s);
+        values = slice_update(*values, new_values, {0, 0, idx, 0}, {B, n_kv_heads, idx + 1, v_head_dim}, s);
+        size = std::min(size + 1, max_size);
+        idx = idx + 1 == max_size ? keep : idx + 1;
+        return held(s);
+    }
+
+    // Held positions in the order they were written
+    std::pair<array, array> state() override
+    {
+        if (!keys.has_value())
+        {
+            throw std::runtime_error("KVCache is empty");
+        }
+        StreamOrDevice s = current_stream();
+        return {ordered(*keys, s), ordered(*values, s)};
+    }
+
+    int trim(int n) override
+    {
+        // Evicted positions cannot come back, so trimming only shortens the
+        // window; the next writes refill it
+        n = std::min(size, n);
+        if (n == 0)
+        {
+            return 0;
+        }
+        StreamOrDevice s = current_stream();
+        auto [k, v] = state();
+        const auto &ks = k.shape(), &vs = v.shape();
+        keys = slice(k, {0, 0, 0, 0}, {ks[0], ks[1], size - n, ks[3]}, s);
+        values = slice(v, {0, 0, 0, 0}, {vs[0], vs[1], size - n, vs[3]}, s);
+        size -= n;
+        idx = size;
+        offset -= n;
+        return n;
+    }
+
+    void reset() override
+    {
+        KVCache::reset();
+        size = 0;
+        idx = 0;
+    }
+
+    int length() override
+    {
+        return size;
+    }
+
+private:
+    std::pair<array, array> held(StreamOrDevice s)
+    {
+        const auto &ks = keys->shape(), &vs = values->shape();
+        return {
+            slice(*keys, {0, 0, 0, 0}, {ks[0], ks[1], size, ks[3]}, s),
+            slice(*values, {0, 0, 0, 0}, {vs[0], vs[1], size, vs[3]}, s)};
+    }
+
+    array ordered(const array &buffer, StreamOrDevice s)
+    {
+        // Once the ring has wrapped the oldest recent position sits at idx
+        const auto &sh = buffer.shape();
+        if (size < max_size || idx == keep)
+        {
+            return slice(buffer, {0, 0, 0, 0}, {sh[0], sh[1], size, sh[3]}, s);
+        }
+        return concatenate(
+            {slice(buffer, {0, 0, 0, 0}, {sh[0], sh[1], keep, sh[3]}, s),
+             slice(buffer, {0, 0, idx, 0}, {sh[0], sh[1], max_size, sh[3]}, s),
+             slice(buffer, {0, 0, keep, 0}, {sh[0], sh[1], idx, sh[3]}, s)},
+            2, s);
+    }
+
+    array evict(const array &ordered_buffer, StreamOrDevice s)
+    {
+        const auto &sh = ordered_buffer.shape();
+        int n = sh[2];
+        if (n <= max_size)
+        {
+            return ordered_buffer;
+        }
+        return concatenate(
+            {slice(ordered_buffer, {0, 0, 0, 0}, {sh[0], sh[1], keep, sh[3]}, s),
+             slice(ordered_buffer, {0, 0, n - (max_size - keep), 0}, {sh[0], sh[1], n, sh[3]}, s)},
+            2, s);
+    }
+};
+
+// Bounded-memory variant of make_kv_cache for long conversations
+KVCacheList make_rotating_kv_cache(int num_layers, int max_size, int keep = 4)
+{
+    KVCacheList cache{};
+    for (int i = 0; i < num_layers; i++)
+    {
+        cache.push_back(std::make_shared<RotatingKVCache>(max_size, keep));
+    }
+    return cache;
+}
+
+struct BlockPoolStats
+{
+    int num_blocks = 0;
+    int used_blocks = 0;
+    int free_blocks = 0;
+    int block_size = 0;
+    size_t bytes = 0;
+    float occupancy = 0;
+};
+
+class BlockPool
+{
+public:
+    // Fixed-size pages of `block_size` positions shared by every sequence.
+    // Block ids index all layers at once: keys[layer][block] is one page
+    // of shape [n_kv_heads, block_size, head_dim]. Every page is its own
+    // array, so a write copies at most one page rather than the pool;
+    // pages nobody has written yet are unmaterialized zeros.
+    int num_layers, num_blocks, block_size, n_kv_heads, head_dim;
+    std::vector<std::vector<array>> keys{};
+    std::vector<std::vector<array>> values{};
+    std::vector<int> free_list{};
+
+    BlockPool(
+        int _num_layers,
+        int _num_blocks,
+        int _block_size,
+        int _n_kv_heads,
+        int _head_dim,
+        Dtype dtype = float32)
+    {
+        num_layers = _num_layers;
+        num_blocks = _num_blocks;
+        block_size = _block_size;
+        n_kv_heads = _n_kv_heads;
+        head_dim = _head_dim;
+        array page = zeros({n_kv_heads, block_size, head_dim}, dtype);
+        keys.assign(num_layers, std::vector<array>(num_blocks, page));
+        values.assign(num_layers, std::vector<array>(num_blocks, page));
+        // Popped from the back, so recently released blocks are reused first
+        for (int b = num_blocks - 1; b >= 0; b--)
+        {
+            free_list.push_back(b);
+        }
+    }
+
+    int allocate()
+    {
+        if (free_list.empty())
+        {
+            throw std::runtime_error("KV block pool is exhausted");
+        }
+        int block = free_list.back();
+        free_list.pop_back();
+        return block;
+    }
+
+    void release(int block)
+    {
+        free_list.push_back(block);
+    }
+
+    int blocks_for(int num_positions)
+    {
+        return (num_positions + block_size - 1) / block_size;
+    }
+
+    bool can_allocate(int num_blocks_needed)
+    {
+        return int(free_list.size()) >= num_blocks_needed;
+    }
+
+    BlockPoolStats stats()
+    {
+        BlockPoolStats s;
+        s.num_blocks = num_blocks;
+        s.free_blocks = free_list.size();
+        s.used_blocks = num_blocks - s.free_blocks;
+        s.block_size = block_size;
+        if (num_layers && num_blocks)
+        {
+            s.bytes = size_t(2) * num_layers * num_blocks * keys[0][0].nbytes();
+        }
+        s.occupancy = num_blocks ? float(s.used_blocks) / num_blocks : 0;
+        return s;
+    }
+};
+
+class BlockTable
+{
+public:
+    // Pages owned by one sequence, shared by its per-layer caches and
+    // returned to the pool when the sequence goes away
+    std::shared_ptr<BlockPool> pool;
+    std::vector<int> blocks{};
+
+    BlockTable(std::shared_ptr<BlockPool> _pool) : pool(_pool) {}
+    BlockTable(const BlockTable &) = delete;
+    ~BlockTable()
+    {
+        for (int b : blocks)
+        {
+            pool->release(b);
+        }
+    }
+
+    void ensure_capacity(int num_positions)
+    {
+        while (int(blocks.size()) * pool->block_size < num_positions)
+        {
+            blocks.push_back(pool->allocate());
+        }
+    }
+};
+
+class PagedKVCache : public KVCache
+{
+public:
+    std::shared_ptr<BlockTable> table;
+    int layer;
+
+    PagedKVCache(std::shared_ptr<BlockTable> _table, int _layer)
+        : table(_table), layer(_layer) {}
+
+    std::pair<array, array> update_and_fetch(const array &new_keys, const array &new_values) override
+    {
+        if (new_keys.shape(0) != 1)
+        {
+            throw std::invalid_argument("PagedKVCache holds a single sequence");
+        }
+        BlockPool &pool = *table->pool;
+        int H = pool.n_kv_heads, D = pool.head_dim, bs = pool.block_size;
+        int L = new_keys.shape(2);
+        table->ensure_capacity(offset + L);
+        StreamOrDevice s = current_stream();
+
+        // Scatter the new positions into their pages, one page at a time
+        int written = 0;
+        while (written < L)
+        {
+            int pos = offset + written;
+            int block = table->blocks[pos / bs], start = pos % bs;
+            int n = std::min(bs - start, L - written);
+            array k = reshape(slice(new_keys, {0, 0, written, 0}, {1, H, written + n, D}, s), {H, n, D}, s);
+            array v = reshape(slice(new_values, {0, 0, written, 0}, {1, H, written + n, D}, s), {H, n, D}, s);
+            array &key_page = pool.keys[layer][block], &value_page = pool.values[layer][block];
+            key_page = slice_update(key_page, k, {0, start, 0}, {H, start + n, D}, s);
+            value_page = slice_update(value_page, v, {0, start, 0}, {H, start + n, D}, s);
+            written += n;
+        }
+        offset += L;
+        return state();
+    }
+
+    std::pair<array, array> state() override
+    {
+        // Gather this sequence's pages back into a contiguous [1, H, offset, D] view
+        BlockPool &pool = *table->pool;
+        int H = pool.n_kv_heads, D = pool.head_dim;
+        int n_blocks = pool.blocks_for(offset);
+        if (n_blocks == 0)
+        {
+            throw std::runtime_error("KVCache is empty");
+        }
+        StreamOrDevice s = current_stream();
+        auto gather = [&](const std::vector<array> &pages)
+        {
+            std::vector<array> owned{};
+            for (int i = 0; i < n_blocks; i++)
+            {
+                owned.push_back(pages[table->blocks[i]]);
+            }
+            array out = n_blocks == 1 ? owned[0] : concatenate(owned, 1, s);
+            return reshape(slice(out, {0, 0, 0}, {H, offset, D}, s), {1, H, offset, D}, s);
+        };
+        return {gather(pool.keys[layer]), gather(pool.values[layer])};
+    }
+
+    void reset() override
+    {
+        // Pages stay with the table until the sequence is dropped
+        offset = 0;
+    }
+};
+
+KVCacheList make_paged_kv_cache(std::shared_ptr<BlockPool> pool)
+{
+    auto table = std::make_shared<BlockTable>(pool);
+    KVCacheList cache{};
+    for (int i = 0; i < pool->num_layers; i++)
+    {
+        cache.push_back(std::make_shared<PagedKVCache>(table, i));
+    }
+    return cache;
+}
+
+} // namespace mlx::core::nn
@@ -0,0 +1,355 @@
+// LoRA adapters served over one shared base model for mlx_llm.cpp
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mlx/mlx.h"
+#include "common.cpp"
+
+namespace mlx::core::nn {
+
+class LoRAStack
+{
+public:
+    // Low-rank factors of every resident adapter for one layer, stacked by
+    // slot so each batch row can use its own: a is [slots, in, rank], b is
+    // [slots, rank, out]. `rank` is the largest rank loaded so far; the
+    // stacks widen when a larger adapter arrives and smaller ranks are
+    // zero padded. Slot 0 stays zero and stands for the base model.
+    // Scales are folded into b.
+    array a, b;
+    int rank;
+
+    LoRAStack(int slots, int in_features, int out_features, int _rank, Dtype dtype)
+        : a(zeros({slots, in_features, _rank}, dtype)),
+          b(zeros({slots, _rank, out_features}, dtype)),
+          rank(_rank) {}
+
+    // Whether lora_a [in, r] and lora_b [r, out] are factors for this layer
+    bool fits(const array &lora_a, const array &lora_b) const
+    {
+        return lora_a.ndim() == 2 && lora_b.ndim() == 2 && lora_a.shape(0) == a.shape(1) &&
+               lora_b.shape(0) == lora_a.shape(1) && lora_b.shape(1) == b.shape(2);
+    }
+
+    void set(int slot, const array &lora_a, const array &lora_b)
+    {
+        int in_features = a.shape(1), out_features = b.shape(2), r = lora_a.shape(1);
+        if (!fits(lora_a, lora_b))
+        {
+            throw std::invalid_argument("LoRA factors do not fit this layer");
+        }
+        if (r > rank)
+        {
+            widen(r);
+        }
+        clear(slot);
+        StreamOrDevice s = current_stream();
+        a = slice_update(a, reshape(astype(lora_a, a.dtype(), s), {1, in_features, r}, s),
+                         {slot, 0, 0}, {slot + 1, in_features, r}, s);
+        b = slice_update(b, reshape(astype(lora_b, b.dtype(), s), {1, r, out_features}, s),
+                         {slot, 0, 0}, {slot + 1, r, out_features}, s);
+    }
+
+    void clear(int slot)
+    {
+        int in_features = a.shape(1), out_features = b.shape(2);
+        StreamOrDevice s = current_stream();
+        a = slice_update(a, zeros({1, in_features, rank}, a.dtype(), s), {slot, 0, 0}, {slot + 1, in_features, rank}, s);
+        b = slice_update(b, zeros({1, rank, out_features}, b.dtype(), s), {slot, 0, 0}, {slot + 1, rank, out_features}, s);
+    }
+
+    // x: [B, L, in], slots: [B] -> the low-rank update [B, L, out], each
+    // row through its own adapter's gathered factors
+    array apply(const array &x, const array &slots, StreamOrDevice s = {})
+    {
+        array h = matmul(x, take(a, slots, 0, s), s);
+        return matmul(h, take(b, slots, 0, s), s);
+    }
+
+private:
+    void widen(int r)
+    {
+        int slots = a.shape(0), in_features = a.shape(1), out_features = b.shape(2);
+        StreamOrDevice s = current_stream();
+        a = concatenate({a, zeros({slots, in_features, r - rank}, a.dtype(), s)}, 2, s);
+        b = concatenate({b, zeros({slots, r - rank, out_features}, b.dtype(), s)}, 1, s);
+        rank = r;
+    }
+};
+
+// Adapter slot of every batch row for forwards issued from this thread;
+// layers with a LoRAStack add their update only while it is set
+inline thread_local std::optional<array> lora_slots = std::nullopt;
+
+class LoRAScope
+{
+public:
+    LoRAScope(const array &slots) : previous(lora_slots)
+    {
+        lora_slots = slots;
+    }
+    LoRAScope(const std::vector<int> &slots) : previous(lora_slots)
+    {
+        // A batch entirely on the base model (slot 0) skips the LoRA
+        // update instead of adding gathered zeros
+        bool adapted = std::any_of(slots.begin(), slots.end(), [](int slot) { return slot != 0; });
+        lora_slots = adapted ? std::optional<array>(array(slots.begin(), {int(slots.size())}, int32)) : std::nullopt;
+    }
+    ~LoRAScope()
+    {
+        lora_slots = previous;
+    }
+
+private:
+    std::optional<array> previous;
+};
+
+class LoRAManager
+{
+public:
+    // Keeps up to `capacity` adapters resident in the layers' stacks and
+    // loads others on demand, evicting the least recently used adapter no
+    // running sequence holds. Adapters above `max_rank` are refused; the
+    // stacks themselves are only as wide as the largest rank loaded.
+    // Driven from one thread (e.g. the scheduler). Loading writes the
+    // layers' stacks, so the model must not be frozen.
+    LoRAManager(Module &_model, int _capacity = 8, int _max_rank = 64)
+        : model(_model), capacity(_capacity), max_rank(_max_rank), slots(_capacity + 1) {}
+
+    // `scale` 0 reads it from adapter_config.json next to the file
+    // (PEFT lora_alpha / r or mlx_lm lora_parameters.scale), else 1
+    void register_adapter(const std::string &name, const std::string &file, float scale = 0)
+    {
+        if (name.empty() || adapters.count(name))
+        {
+            throw std::invalid_argument("Adapter name must be new and non-empty: " + name);
+        }
+        adapters[name] = {file, scale != 0 ? scale : config_scale(file)};
+    }
+
+    bool contains(const std::string &name) const
+    {
+        return adapters.count(name) > 0;
+    }
+
+    bool can_acquire(const std::string &name)
+    {
+        if (name.empty())
+        {
+            return true;
+        }
+        Entry &entry = adapters.at(name);
+        return entry.slot > 0 || free_slot() > 0;
+    }
+
+    // Slot of `name`, loading it if needed; "" is the base model (slot 0)
+    int acquire(const std::string &name)
+    {
+        if (name.empty())
+        {
+            return 0;
+        }
+        auto it = adapters.find(name);
+        if (it == adapters.end())
+        {
+            throw std::invalid_argument("Unknown adapter: " + name);
+        }
+        Entry &entry = it->second;
+        if (entry.slot <= 0)
+        {
+            int slot = free_slot();
+            if (slot <= 0)
+            {
+                throw std::runtime_error("All adapter slots are in use");
+            }
+            // The evicted adapter keeps its slot if the load fails
+            load(entry, slot);
+            if (!slots[slot].empty())
+            {
+                adapters.at(slots[slot]).slot = -1;
+            }
+            slots[slot] = name;
+            entry.slot = slot;
+        }
+        entry.in_use++;
+        entry.last_used = ++clock;
+        return entry.slot;
+    }
+
+    void release(const std::string &name)
+    {
+        if (!name.empty())
+        {
+            Entry &entry = adapters.at(name);
+            entry.in_use = std::max(entry.in_use - 1, 0);
+        }
+    }
+
+    int resident()
+    {
+        int n = 0;
+        for (int i = 1; i <= capacity; i++)
+        {
+            n += !slots[i].empty();
+        }
+        return n;
+    }
+
+private:
+    struct Entry
+    {
+        std::string file;
+        float scale = 1;
+        int slot = -1;
+        int in_use = 0;
+        uint64_t last_used = 0;
+    };
+
+    Module &model;
+    int capacity, max_rank;
+    uint64_t clock = 0;
+    std::unordered_map<std::string, Entry> adapters{};
+    std::vector<std::string> slots; // adapter name per slot, slot 0 unused
+    std::unordered_map<std::string, std::shared_ptr<LoRAStack>> stacks{};
+
+    int free_slot()
+    {
+        // An empty slot, else the least recently used idle adapter's
+        int best = -1;
+        for (int i = 1; i <= capacity; i++)
+        {
+            if (slots[i].empty())
+            {
+                return i;
+            }
+            const Entry &e = adapters.at(slots[i]);
+            if (e.in_use == 0 && (best < 0 || e.last_used < adapters.at(slots[best]).last_used))
+            {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    static float config_scale(const std::string &file)
+    {
+        std::filesystem::path config = std::filesystem::path(file).parent_path() / "adapter_config.json";
+        if (!std::filesystem::exists(config))
+        {
+            return 1;
+        }
+        JsonValue json = load_json(config.string());
+        if (json.contains("lora_alpha") && json.contains("r"))
+        {
+            return json.at("lora_alpha").number / json.at("r").number;
+        }
+        if (json.contains("lora_parameters") && json.at("lora_parameters").contains("scale"))
+        {
+            return json.at("lora_parameters").at("scale").number;
+        }
+        return 1;
+    }
+
+    void load(const Entry &entry, int slot)
+    {
+        if (model.is_frozen())
+        {
+            throw std::logic_error("Adapters cannot be loaded into a frozen model");
+        }
+        // PEFT names `<layer>.lora_A.weight` [r, in] / `.lora_B.weight`
+        // [out, r] under `base_model.model.`; mlx_lm names `<layer>.lora_a`
+        // [in, r] / `.lora_b` [r, out]
+        const std::string peft_prefix = "base_model.model.";
+        std::unordered_map<std::string, std::pair<std::optional<array>, std::optional<array>>> factors{};
+        for (auto &[k, v] : load_safetensors(entry.file).first)
+        {
+            std::string key = k.compare(0, peft_prefix.size(), peft_prefix) == 0 ? k.substr(peft_prefix.size()) : k;
+            for (auto [suffix, is_a, transposed] : {std::tuple<const char *, bool, bool>{".lora_A.weight", true, true},
+                                                    {".lora_B.weight", false, true},
+                                                    {".lora_a", true, false},
+                                                    {".lora_b", false, false}})
+            {
+                if (ends_with(key, suffix))
+                {
+                    std::string path = key.substr(0, key.size() - std::char_traits<char>::length(suffix));
+                    array f = transposed ? transpose(v, {1, 0}) : v;
+                    (is_a ? factors[path].first : factors[path].second) = f;
+                    break;
+                }
+            }
+        }
+
+        // Every factor is checked before any stack is written, so a bad
+        // file leaves the slot, and the adapter still in it, untouched. New
+        // stacks start all zero, which changes no layer's output.
+        std::vector<std::pair<std::shared_ptr<LoRAStack>, std::pair<array, array>>> writes{};
+        for (auto &[path, ab] : factors)
+        {
+            if (!ab.first || !ab.second)
+            {
+                throw std::runtime_error("Adapter is missing a LoRA factor for: " + path);
+            }
+            int rank = ab.first->ndim() == 2 ? ab.first->shape(1) : 0;
+            if (rank > max_rank)
+            {
+                throw std::runtime_error("Adapter rank " + std::to_string(rank) + " exceeds max_rank at: " + path);
+            }
+            auto it = stacks.find(path);
+            if (it == stacks.end())
+            {
+                Module *m = model.find_module(path);
+                std::shared_ptr<LoRAStack> stack = m ? m->lora_stack(capacity + 1, rank) : nullptr;
+                if (stack == nullptr)
+                {
+                    throw std::runtime_error("No layer takes a LoRA adapter at: " + path);
+                }
+                it = stacks.insert({path, stack}).first;
+            }
+            if (!it->second->fits(*ab.first, *ab.second))
+            {
+                throw std::runtime_error("LoRA factors do not fit the layer at: " + path);
+            }
+            writes.push_back({it->second, {*ab.first, *ab.second}});
+        }
+
+        // Then the slot is rewritten in every stack, all restored if
+        // anything still fails
+        std::vector<std::pair<std::shared_ptr<LoRAStack>, LoRAStack>> saved{};
+        for (auto &[path, stack] : stacks)
+        {
+            saved.push_back({stack, *stack});
+        }
+        try
+        {
+            for (auto &[path, stack] : stacks)
+            {
+                stack->clear(slot);
+            }
+            std::vector<array> written{};
+            for (auto &[stack, ab] : writes)
+            {
+                stack->set(slot, ab.first, multiply(ab.second, array(entry.scale), current_stream()));
+                written.push_back(stack->a);
+                written.push_back(stack->b);
+            }
+            eval(written);
+        }
+        catch (...)
+        {
+            for (auto &[stack, before] : saved)
+            {
+                *stack = before;
+            }
+            throw;
+        }
+    }
+};
+
+} // namespace mlx::core::nn
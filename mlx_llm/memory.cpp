@@ -0,0 +1,206 @@
+// Memory accounting for mlx_llm.cpp modules
+#pragma once
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "mlx/mlx.h"
+#include "common.cpp"
+
+namespace mlx::core::nn {
+
+struct ModuleMemory
+{
+    std::string name;
+    size_t bytes = 0; // this module and everything below it
+    std::map<std::string, size_t> bytes_by_dtype{};
+    std::vector<ModuleMemory> children{};
+};
+
+// Figures from the Metal allocator. Without Metal its counters stay at 0,
+// so the process's resident set stands in: `active` is the current RSS,
+// `peak` the peak RSS and `cache` 0. RSS also counts memory outside MLX.
+struct AllocatorStats
+{
+    size_t active = 0; // bytes held by live arrays
+    size_t peak = 0;   // high-water mark of `active`
+    size_t cache = 0;  // freed buffers kept by the allocator for reuse
+};
+
+size_t peak_rss_bytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes
+#else
+    return size_t(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+}
+
+size_t rss_bytes()
+{
+    // Current resident set from /proc where there is one, else the peak
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident)
+    {
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+    return peak_rss_bytes();
+}
+
+std::string dtype_name(Dtype dtype)
+{
+    std::ostringstream oss;
+    oss << dtype;
+    return oss.str();
+}
+
+ModuleMemory memory_report(Module &m, const std::string &name = "")
+{
+    // Parameter and buffer bytes per submodule and dtype; nothing is
+    // evaluated, so this is cheap even on an unloaded model
+    ModuleMemory report;
+    report.name = name;
+    for (auto *arrays : {&m.parameters, &m.buffers})
+    {
+        for (auto &[k, v] : *arrays)
+        {
+            report.bytes += v.nbytes();
+            report.bytes_by_dtype[dtype_name(v.dtype())] += v.nbytes();
+        }
+    }
+    for (auto &[k, v] : m.children())
+    {
+        ModuleMemory child = memory_report(*v, get_name(name, k));
+        report.bytes += child.bytes;
+        for (auto &[dtype, bytes] : child.bytes_by_dtype)
+        {
+            report.bytes_by_dtype[dtype] += bytes;
+        }
+        report.children.push_back(std::move(child));
+    }
+    return report;
+}
+
+std::string format_bytes(size_t bytes)
+{
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4)
+    {
+        value /= 1024;
+        unit++;
+    }
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(unit ? 2 : 0) << value << " " << units[unit];
+    return oss.str();
+}
+
+void print_memory_report(const ModuleMemory &report, int max_depth = -1, int depth = 0)
+{
+    std::cout << std::string(2 * depth, ' ') << (report.name.empty() ? "<model>" : report.name)
+              << ": " << format_bytes(report.bytes);
+    for (auto &[dtype, bytes] : report.bytes_by_dtype)
+    {
+        std::cout << " [" << dtype << " " << format_bytes(bytes) << "]";
+    }
+    std::cout << "\n";
+    if (max_depth >= 0 && depth >= max_depth)
+    {
+        return;
+    }
+    for (auto &child : report.children)
+    {
+        print_memory_report(child, max_depth, depth + 1);
+    }
+}
+
+AllocatorStats allocator_stats()
+{
+    if (!metal::is_available())
+    {
+        return {rss_bytes(), peak_rss_bytes(), 0};
+    }
+    return {metal::get_active_memory(), metal::get_peak_memory(), metal::get_cache_memory()};
+}
+
+void print_allocator_stats(const AllocatorStats &stats)
+{
+    std::cout << "active: " << format_bytes(stats.active)
+              << ", peak: " << format_bytes(stats.peak)
+              << ", cache: " << format_bytes(stats.cache) << "\n";
+}
+
+// Allocator figures before and after `fn` (e.g. a forward or a generate
+// call). With Metal the peak is reset first, so `after.peak` is the
+// high-water mark of `fn` alone. Without Metal it is the process's peak
+// RSS, which cannot be reset: it only reflects `fn` when `fn` goes past
+// every earlier peak.
+template <typename F>
+std::pair<AllocatorStats, AllocatorStats> measure_memory(F fn)
+{
+    if (metal::is_available())
+    {
+        metal::reset_peak_memory();
+    }
+    AllocatorStats before = allocator_stats();
+    fn();
+    return {before, allocator_stats()};
+}
+
+class MemoryBudget
+{
+public:
+    // Hard limit on allocator memory. The Metal allocator is told not to go
+    // past it, and check() lets loops fail between steps rather than deep
+    // inside an allocation. Without Metal only check() enforces it, against
+    // the process RSS.
+    static inline size_t limit = 0;
+
+    static void set(size_t bytes)
+    {
+        limit = bytes;
+        if (metal::is_available())
+        {
+            metal::set_memory_limit(bytes, false);
+        }
+    }
+
+    static void check(const std::string &what = "")
+    {
+        if (limit == 0)
+        {
+            return;
+        }
+        size_t active = allocator_stats().active;
+        if (active > limit)
+        {
+            throw std::runtime_error(
+                "Memory budget exceeded" + (what.empty() ? std::string() : " during " + what) + ": " +
+                format_bytes(active) + " active, budget " + format_bytes(limit));
+        }
+    }
+
+    // Fails before any weights are loaded if the parameters alone do not fit
+    static void check_fits(Module &m)
+    {
+        size_t bytes = memory_report(m).bytes;
+        if (limit != 0 && bytes > limit)
+        {
+            throw std::runtime_error(
+                "Model parameters need " + format_bytes(bytes) + ", budget is " + format_bytes(limit));
+        }
+    }
+};
+
+} // namespace mlx::core::nn
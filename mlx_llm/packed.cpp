@@ -0,0 +1,128 @@
+// Packed variable-length batches for mlx_llm.cpp models
+#pragma once
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+#include "mlx/mlx.h"
+
+using namespace mlx::core;
+
+// Sequences laid back to back in one [1, T] row instead of padded to the
+// longest: sequence i is tokens [offsets[i], offsets[i + 1]). Attention is
+// kept within each sequence by a block-diagonal causal mask, and RoPE uses
+// `positions`, which restart at 0 for every sequence.
+struct PackedBatch
+{
+    array tokens;               // [1, T] int32
+    array positions;            // [T] int32, position within its sequence
+    array segments;             // [T] int32, index of its sequence
+    std::vector<int> offsets{}; // n + 1 cumulative lengths
+    std::vector<int> indices{}; // where each sequence was in the caller's list
+
+    int size() const
+    {
+        return offsets.size() - 1;
+    }
+
+    int length() const
+    {
+        return offsets.back();
+    }
+};
+
+// Sequence embeddings from a packed forward
+enum class Pooling
+{
+    Last,
+    Mean
+};
+
+PackedBatch pack(const std::vector<std::vector<int>> &sequences, const std::vector<int> &indices = {})
+{
+    if (sequences.empty())
+    {
+        throw std::invalid_argument("Cannot pack an empty batch");
+    }
+    std::vector<int> tokens{}, positions{}, segments{}, offsets{0};
+    for (size_t i = 0; i < sequences.size(); i++)
+    {
+        if (sequences[i].empty())
+        {
+            throw std::invalid_argument("Packed sequences must contain at least one token");
+        }
+        tokens.insert(tokens.end(), sequences[i].begin(), sequences[i].end());
+        for (size_t p = 0; p < sequences[i].size(); p++)
+        {
+            positions.push_back(p);
+            segments.push_back(i);
+        }
+        offsets.push_back(tokens.size());
+    }
+    int T = tokens.size();
+    std::vector<int> order = indices;
+    if (order.empty())
+    {
+        order.resize(sequences.size());
+        std::iota(order.begin(), order.end(), 0);
+    }
+    return {
+        array(tokens.begin(), {1, T}, int32),
+        array(positions.begin(), {T}, int32),
+        array(segments.begin(), {T}, int32),
+        offsets,
+        order};
+}
+
+// Splits `sequences` into packs of at most `max_tokens` tokens (a longer
+// sequence gets a pack of its own), longest first into the first pack with
+// room. The mask is [T, T] per pack, so the budget bounds its size too.
+std::vector<PackedBatch> pack_sequences(const std::vector<std::vector<int>> &sequences, int max_tokens = 4096)
+{
+    std::vector<int> order(sequences.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                     { return sequences[a].size() > sequences[b].size(); });
+
+    std::vector<std::vector<int>> bins{};
+    std::vector<int> used{};
+    for (int i : order)
+    {
+        int n = sequences[i].size();
+        size_t b = 0;
+        while (b < bins.size() && used[b] + n > max_tokens)
+        {
+            b++;
+        }
+        if (b == bins.size())
+        {
+            bins.push_back({});
+            used.push_back(0);
+        }
+        bins[b].push_back(i);
+        used[b] += n;
+    }
+
+    std::vector<PackedBatch> packs{};
+    for (auto &bin : bins)
+    {
+        std::vector<std::vector<int>> members{};
+        for (int i : bin)
+        {
+            members.push_back(sequences[i]);
+        }
+        packs.push_back(pack(members, bin));
+    }
+    return packs;
+}
+
+array create_packed_causal_mask(const array &segments, Dtype dtype = float32, StreamOrDevice s = {})
+{
+    // Additive [T, T] mask: a token sees earlier tokens of its own sequence
+    int T = segments.shape(0);
+    array inds = arange(T, s);
+    array same = equal(expand_dims(segments, 1, s), expand_dims(segments, 0, s), s);
+    array causal = less_equal(expand_dims(inds, 0, s), expand_dims(inds, 1, s), s);
+    return astype(where(logical_and(same, causal, s), array(0.0f), array(-1e9f), s), dtype, s);
+}
@@ -7,10 +7,15 @@ Based on https://github.com/ml-explore/mlx-examples/blob/main/llms/mlx_lm/models
 #include <any>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <vector>
 #include "mlx/mlx.h"
 #include "common.cpp"
+#include "kv_cache.cpp"
+#include "lora.cpp"
+#include "packed.cpp"
+#include "trace.cpp"
 
 using namespace mlx::core;
 
@@ -19,6 +24,8 @@ class LinearLayer : public nn::Module
 public:
     int input_dim, output_dim;
     bool with_bias = true;
+    int group_size = 0, bits = 0; // set once the weight is quantized
+    std::shared_ptr<nn::LoRAStack> lora = nullptr; // adapters over this layer, if any
 
     LinearLayer() = default;
     LinearLayer(const LinearLayer &) = default;
@@ -26,7 +33,8 @@ public:
     {
         input_dim = in_features;
         output_dim = out_features;
-        array weight = random::normal({in_features, out_features}, float32);
+        // [out, in] as in HF, GGUF and MLX checkpoints, so weights load as stored
+        array weight = random::normal({out_features, in_features}, float32);
         array bias = random::normal({out_features}, float32);
         with_bias = _with_bias;
 
@@ -36,21 +44,124 @@ public:
 
     ~LinearLayer() = default;
 
+    bool to_quantized(int _group_size, int _bits) override
+    {
+        if (bits || input_dim % _group_size != 0)
+        {
+            return false;
+        }
+        auto [w, scales, biases] = mlx::core::quantize(parameters.at("weight"), _group_size, _bits);
+        eval(w, scales, biases);
+        return load_quantized(w, scales, biases, _group_size, _bits);
+    }
+
+    bool load_quantized(
+        const array &w,
+        const array &scales,
+        const array &biases,
+        int _group_size,
+        int _bits) override
+    {
+        if (!can_load_quantized(w, scales, biases, _group_size, _bits))
+        {
+            return false;
+        }
+        register_parameter("weight", w);
+        register_parameter("scales", scales);
+        register_parameter("biases", biases);
+        group_size = _group_size;
+        bits = _bits;
+        return true;
+    }
+
+    bool can_load_quantized(
+        const array &w,
+        const array &scales,
+        const array & /*biases*/,
+        int _group_size,
+        int /*_bits*/) const override
+    {
+        // Packed as [out, in * bits / 32] with per-group scales and biases
+        return w.shape(0) == output_dim && scales.shape(-1) * _group_size == input_dim;
+    }
+
+    std::pair<int, int> quantization() const override
+    {
+        return {group_size, bits};
+    }
+
+    // Whether the layer fits a compiled block: no bias and no adapter in use
+    bool compilable() const
+    {
+        return !with_bias && !(lora && nn::lora_slots);
+    }
+
+    // Appends the weights linear_inputs() reads back inside a compiled block
+    void append_inputs(std::vector<array> &inputs) const
+    {
+        inputs.push_back(parameters.at("weight"));
+        if (bits)
+        {
+            inputs.push_back(parameters.at("scales"));
+            inputs.push_back(parameters.at("biases"));
+        }
+    }
+
+    std::shared_ptr<nn::LoRAStack> lora_stack(int slots, int rank) override
+    {
+        if (!lora)
+        {
+            // A new stack changes what forwards read, so frozen models
+            // (shared by concurrent sessions) cannot take one
+            check_mutable("lora");
+            // Adapters compute in the layer's activation dtype
+            Dtype dtype = bits ? parameters.at("scales").dtype() : parameters.at("weight").dtype();
+            lora = std::make_shared<nn::LoRAStack>(slots, input_dim, output_dim, rank, dtype);
+        }
+        return lora;
+    }
+
     array forward(const array &input) override
     {
+        nn::ForwardScope scope(*this, input);
         // Check if input size matches number of weights in first layer
-        if (input.shape(-1) != parameters.at("weight").shape(0))
+        if (input.shape(-1) != input_dim)
         {
             throw std::invalid_argument(
                 "Input size doesn't match weight vector size");
         }
         // Allocate space for the outputs
-        array outputs = matmul(input, parameters.at("weight"));
+        StreamOrDevice s = stream();
+        array outputs = bits
+                            ? quantized_matmul(
+                                  input, parameters.at("weight"), parameters.at("scales"),
+                                  parameters.at("biases"), true, group_size, bits, s)
+                            : matmul(input, transpose(parameters.at("weight"), {1, 0}, s), s);
+        if (lora && nn::lora_slots)
+        {
+            outputs = add(outputs, lora->apply(input, *nn::lora_slots, s), s);
+        }
 
-        return with_bias ? (outputs + parameters.at("bias")) : outputs;
+        return scope.done(with_bias ? add(outputs, parameters.at("bias"), s) : outputs);
     }
 };
 
+// x times the weights append_inputs() stored at inputs[i], advancing i.
+// Compiled traces are per shape, so the quantization is read off them: a
+// uint32 weight is packed, with its bits and group size implied by the
+// packed width and the number of scales.
+array linear_inputs(const array &x, const std::vector<array> &inputs, size_t &i)
+{
+    const array &w = inputs[i++];
+    if (w.dtype() != uint32)
+    {
+        return matmul(x, transpose(w, {1, 0}));
+    }
+    const array &scales = inputs[i++], &biases = inputs[i++];
+    int in = x.shape(-1);
+    return quantized_matmul(x, w, scales, biases, true, in / scales.shape(-1), w.shape(1) * 32 / in);
+}
+
 class Dropout : public nn::Module
 {
 public:
@@ -94,14 +205,64 @@ public:
     }
     array forward(array x, int offset = 0)
     {
-        return mlx::core::fast::rope(x, dims, traditional, base, scale, offset, device);
+        return mlx::core::fast::rope(x, dims, traditional, base, scale, offset, stream());
+    }
+
+    // cos / sin of every position's angles, [T, dims / 2] each, for inputs
+    // whose positions are not one contiguous range (packed batches). Built
+    // once per forward and shared by all layers.
+    std::pair<array, array> tables(const array &positions, Dtype dtype)
+    {
+        StreamOrDevice s = stream();
+        array inv_freq = exp(multiply(arange(0, dims, 2, float32, s), array(-std::log(base) / dims), s), s);
+        array angles = multiply(
+            expand_dims(multiply(astype(positions, float32, s), array(scale), s), 1, s),
+            expand_dims(inv_freq, 0, s), s);
+        return {astype(cos(angles, s), dtype, s), astype(sin(angles, s), dtype, s)};
+    }
+
+    // x: [B, H, T, D] rotated by precomputed tables
+    array forward(array x, const std::pair<array, array> &tables)
+    {
+        return rotate(x, tables, traditional, stream());
+    }
+
+    // The first 2 * tables' width dims of x rotated, for callers without a
+    // RoPE at hand (compiled blocks)
+    static array rotate(const array &x, const std::pair<array, array> &tables, bool traditional, StreamOrDevice s = {})
+    {
+        auto &[c, sn] = tables;
+        int B = x.shape(0), H = x.shape(1), T = x.shape(2), D = x.shape(3), half = c.shape(-1), dims = 2 * half;
+        array rotated = slice(x, {0, 0, 0, 0}, {B, H, T, dims}, s);
+        array x1 = rotated, x2 = rotated;
+        if (traditional)
+        {
+            // Interleaved pairs (x0, x1), (x2, x3), ...
+            rotated = reshape(rotated, {B, H, T, half, 2}, s);
+            x1 = squeeze(slice(rotated, {0, 0, 0, 0, 0}, {B, H, T, half, 1}, s), -1, s);
+            x2 = squeeze(slice(rotated, {0, 0, 0, 0, 1}, {B, H, T, half, 2}, s), -1, s);
+        }
+        else
+        {
+            x1 = slice(rotated, {0, 0, 0, 0}, {B, H, T, half}, s);
+            x2 = slice(rotated, {0, 0, 0, half}, {B, H, T, dims}, s);
+        }
+        array o1 = subtract(multiply(x1, c, s), multiply(x2, sn, s), s);
+        array o2 = add(multiply(x1, sn, s), multiply(x2, c, s), s);
+        array out = traditional ? reshape(stack({o1, o2}, -1, s), {B, H, T, dims}, s)
+                                : concatenate({o1, o2}, -1, s);
+        if (dims < D)
+        {
+            out = concatenate({out, slice(x, {0, 0, 0, dims}, {B, H, T, D}, s)}, -1, s);
+        }
+        return out;
     }
 };
 
 class RMSNorm : public nn::Module
 {
 public:
-    float eps;
+    float eps = 1e-5;
     RMSNorm() = default;
     RMSNorm(int dims, float _eps = 1e-5)
     {
@@ -112,8 +273,9 @@ public:
 
     array forward(array x)
     {
-        return mlx::core::fast::rms_norm(
-            x, parameters.at("weight"), eps);
+        nn::ForwardScope scope(*this, x);
+        return scope.done(mlx::core::fast::rms_norm(
+            x, parameters.at("weight"), eps, stream()));
     }
 };
 
@@ -123,14 +285,15 @@ public:
     Embedding() = default;
     Embedding(int dims, int num_embeddings)
     {
-        array scale = array(sqrt(1 / dims));
+        array scale = array(std::sqrt(1.0f / dims));
         array weight = random::normal({num_embeddings, dims}, float32) * scale;
 
         register_parameter("weight", weight);
     }
     array forward(array x)
     {
-        return matmul(parameters.at("weight"), x);
+        nn::ForwardScope scope(*this, x);
+        return scope.done(take(parameters.at("weight"), x, 0, stream()));
     }
 };
 
@@ -139,15 +302,85 @@ array scaled_dot_product_attention(
     array keys,
     array values,
     float scale,
-    const std::__1::optional<mlx::core::array> &mask = std::nullopt,
+    const std::optional<mlx::core::array> &mask = std::nullopt,
     StreamOrDevice s = metal::is_available() ? Device::gpu : Device::cpu)
 {
-    return mlx::core::fast::scaled_dot_product_attention(queries, keys, values, scale, mask, s);
+    return mlx::core::fast::scaled_dot_product_attention(queries, keys, values, scale, mask, std::nullopt, s);
+}
+
+array create_causal_mask(int N, int offset = 0, Dtype dtype = float32, StreamOrDevice s = {})
+{
+    // Additive mask of shape [N, offset + N] for N new queries attending to
+    // `offset` cached positions followed by themselves
+    array rinds = arange(offset + N, s);
+    array linds = offset ? arange(offset, offset + N, s) : rinds;
+    array mask = less(expand_dims(linds, 1, s), expand_dims(rinds, 0, s), s);
+    return astype(multiply(mask, array(-1e9f), s), dtype, s);
 }
 
-array silu(array x)
+array silu(array x, StreamOrDevice s = {})
 {
-    return x * sigmoid(x);
+    return multiply(x, sigmoid(x, s), s);
+}
+
+std::vector<array> swiglu_impl(const std::vector<array> &inputs)
+{
+    return {silu(inputs[0]) * inputs[1]};
+}
+
+array compiled_swiglu(const array &gate, const array &up)
+{
+    // sigmoid + two multiplies fused into one kernel; shapeless, so a single
+    // trace serves prefill and decode shapes alike. The split stays outside:
+    // shapeless compile cannot trace ops whose output shape depends on the
+    // input's, as split's does.
+    static auto fn = compile(swiglu_impl, true);
+    return fn({gate, up})[0];
+}
+
+// fast::rms_norm's own fallback, with eps an input so one trace serves
+// every norm
+array rms_norm_inputs(const array &x, const array &weight, const array &eps)
+{
+    array f = astype(x, float32);
+    array normalized = multiply(f, rsqrt(add(mean(square(f), -1, true), eps)));
+    return multiply(weight, astype(normalized, x.dtype()));
+}
+
+// First half of a compiled decode step, up to the cache update. inputs: x
+// [B, L, hidden], eps, the input norm's weight, RoPE cos and sin tables,
+// then qkv_proj's weights. Returns rotated queries and keys, and values, as
+// [B, heads, L, head_dim]; head counts follow from the shapes since RoPE
+// rotates whole heads.
+template <bool Traditional>
+std::vector<array> block_qkv_impl(const std::vector<array> &inputs)
+{
+    const array &x = inputs[0];
+    size_t i = 5;
+    array qkv = linear_inputs(rms_norm_inputs(x, inputs[2], inputs[1]), inputs, i);
+    int B = x.shape(0), L = x.shape(1), head_dim = 2 * inputs[3].shape(-1);
+    int n_heads = x.shape(2) / head_dim, n_kv_heads = (qkv.shape(2) / head_dim - n_heads) / 2;
+    auto parts = split(qkv, {n_heads * head_dim, (n_heads + n_kv_heads) * head_dim}, -1);
+    auto heads = [&](const array &part, int n)
+    { return transpose(reshape(part, {B, L, n, head_dim}), {0, 2, 1, 3}); };
+    std::pair<array, array> tables = {inputs[3], inputs[4]};
+    return {
+        RoPE::rotate(heads(parts[0], n_heads), tables, Traditional),
+        RoPE::rotate(heads(parts[1], n_kv_heads), tables, Traditional),
+        heads(parts[2], n_kv_heads)};
+}
+
+// Second half, from attention to the block's output. inputs: x, the
+// attention output [B, heads, L, head_dim], eps, the post-attention norm's
+// weight, then the weights of o_proj, gate_up_proj and down_proj.
+std::vector<array> block_out_impl(const std::vector<array> &inputs)
+{
+    const array &x = inputs[0];
+    int B = x.shape(0), L = x.shape(1);
+    size_t i = 4;
+    array h = add(x, linear_inputs(reshape(transpose(inputs[1], {0, 2, 1, 3}), {B, L, -1}), inputs, i));
+    auto parts = split(linear_inputs(rms_norm_inputs(h, inputs[3], inputs[2]), inputs, i), 2, -1);
+    return {add(h, linear_inputs(multiply(silu(parts[0]), parts[1]), inputs, i))};
 }
 
 struct PhiModelConfig
@@ -155,23 +388,43 @@ struct PhiModelConfig
     int num_hidden_layers;
     int vocab_size;
     int hidden_size;
-    int rms_norm_eps;
+    float rms_norm_eps = 1e-5;
     std::string model_type;
     int num_hidden_layer;
     int intermediate_size;
     int num_attention_heads;
-    int num_key_value_heads = 0;
+    int num_key_value_heads = 0; // 0 means one KV head per attention head
     float rope_theta = 10000;
-    float rope_scale;
+    float rope_scale = 1.0;
     bool rope_traditional = false;
     // <std::map<std::variant<float, std::string>> rope_scaling = nullptr;
 
-    PhiModelConfig()
+    int kv_heads() const
     {
-        if (!num_key_value_heads)
-            num_key_value_heads = num_attention_heads;
+        return num_key_value_heads ? num_key_value_heads : num_attention_heads;
     }
 };
+
+// Reads the HF `config.json` of a checkpoint
+PhiModelConfig load_phi_config(const std::string &file)
+{
+    nn::JsonValue json = nn::load_json(file);
+    auto number = [&](const std::string &key, double fallback)
+    {
+        return json.contains(key) && json.at(key).is_number() ? json.at(key).number : fallback;
+    };
+    PhiModelConfig config;
+    config.model_type = json.contains("model_type") ? json.at("model_type").string : "phi3";
+    config.num_hidden_layers = int(number("num_hidden_layers", 32));
+    config.vocab_size = int(number("vocab_size", 32064));
+    config.hidden_size = int(number("hidden_size", 3072));
+    config.intermediate_size = int(number("intermediate_size", 8192));
+    config.num_attention_heads = int(number("num_attention_heads", 32));
+    config.num_key_value_heads = int(number("num_key_value_heads", 0));
+    config.rms_norm_eps = float(number("rms_norm_eps", 1e-5));
+    config.rope_theta = float(number("rope_theta", 10000));
+    return config;
+}
 class PhiAttention : public nn::Module
 {
 public:
@@ -187,7 +440,7 @@ public:
     {
         dim = args.hidden_size;
         n_heads = args.num_attention_heads;
-        n_kv_head = args.num_key_value_heads;
+        n_kv_head = args.kv_heads();
         head_dim = int(args.hidden_size / n_heads);
         scale = pow(head_dim, -0.5);
         op_size = n_heads * head_dim + 2 * (n_kv_head * head_dim);
@@ -199,26 +452,93 @@ public:
         register_module("qkv_proj", qkv_proj);
         register_module("o_proj", o_proj);
     }
-    array forward(array x, array &queries, array &keys, array &values, array &mask)
+    std::vector<array> project(array x)
     {
-        int B = queries.shape(0), L = queries.shape(1), D = queries.shape(2);
+        StreamOrDevice s = stream();
+        int B = x.shape(0), L = x.shape(1);
         array qkv = qkv_proj.forward(x);
-        auto res = split(qkv, 3, -1);
-        array _queries = res[0], _keys = res[1], _values = res[2];
-        _queries = transpose(reshape(_queries, {B, L, n_kv_head, -1}), {0, 2, 1, 3});
-        _keys = transpose(reshape(_keys, {B, L, n_kv_head}), {2, 3, 1});
-        _values = transpose(reshape(_values, {B, L, n_heads, -1}), {0, 2, 1, 3});
-        eval(_queries);
-        eval(_keys);
-        eval(_values);
-
-        _queries = rope.forward(_queries);
-        _keys = rope.forward(_keys, dim);
-
-        array output = scaled_dot_product_attention(
-            queries, keys, values, scale, mask);
-        output = reshape(transpose(output, {0, 2, 1, 3}), {B, L, -1});
-        return o_proj.forward(output);
+        int query_pos = n_heads * head_dim;
+        auto res = split(qkv, {query_pos, query_pos + n_kv_head * head_dim}, -1, s);
+        array queries = transpose(reshape(res[0], {B, L, n_heads, -1}, s), {0, 2, 1, 3}, s);
+        array keys = transpose(reshape(res[1], {B, L, n_kv_head, -1}, s), {0, 2, 1, 3}, s);
+        array values = transpose(reshape(res[2], {B, L, n_kv_head, -1}, s), {0, 2, 1, 3}, s);
+        return {queries, keys, values};
+    }
+
+    array attend(
+        array queries,
+        array keys,
+        array values,
+        const std::optional<array> &mask,
+        nn::KVCache *cache)
+    {
+        if (cache != nullptr)
+        {
+            // Only the new positions are projected; earlier ones come from the cache
+            queries = rope.forward(queries, cache->offset);
+            keys = rope.forward(keys, cache->offset);
+            std::tie(keys, values) = cache->update_and_fetch(keys, values);
+        }
+        else
+        {
+            queries = rope.forward(queries);
+            keys = rope.forward(keys);
+        }
+        return scaled_dot_product_attention(queries, keys, values, scale, mask, stream());
+    }
+
+    array forward(
+        array x,
+        const std::optional<array> &mask = std::nullopt,
+        nn::KVCache *cache = nullptr)
+    {
+        nn::ForwardScope scope(*this, x);
+        int B = x.shape(0), L = x.shape(1);
+        auto qkv = project(x);
+        array output = attend(qkv[0], qkv[1], qkv[2], mask, cache);
+        output = reshape(transpose(output, {0, 2, 1, 3}, stream()), {B, L, -1}, stream());
+        return scope.done(o_proj.forward(output));
+    }
+
+    array forward_packed(array x, const array &mask, const std::pair<array, array> &rope_tables)
+    {
+        // x is one packed row of several sequences: no cache, positions
+        // from the tables, isolation from the block-diagonal mask
+        nn::ForwardScope scope(*this, x);
+        StreamOrDevice s = stream();
+        int T = x.shape(1);
+        auto qkv = project(x);
+        array queries = rope.forward(qkv[0], rope_tables);
+        array keys = rope.forward(qkv[1], rope_tables);
+        array output = scaled_dot_product_attention(queries, keys, qkv[2], scale, mask, s);
+        output = reshape(transpose(output, {0, 2, 1, 3}, s), {1, T, -1}, s);
+        return scope.done(o_proj.forward(output));
+    }
+
+    array forward(array x, const std::vector<nn::KVCache *> &caches)
+    {
+        // Every row of x is a different sequence with its own cache and
+        // position; projections stay batched, attention runs per row
+        nn::ForwardScope scope(*this, x);
+        StreamOrDevice s = stream();
+        int B = x.shape(0), L = x.shape(1);
+        auto qkv = project(x);
+        std::vector<array> outputs{};
+        for (int b = 0; b < B; b++)
+        {
+            array queries = slice(qkv[0], {b, 0, 0, 0}, {b + 1, n_heads, L, head_dim}, s);
+            array keys = slice(qkv[1], {b, 0, 0, 0}, {b + 1, n_kv_head, L, head_dim}, s);
+            array values = slice(qkv[2], {b, 0, 0, 0}, {b + 1, n_kv_head, L, head_dim}, s);
+            std::optional<array> mask = std::nullopt;
+            if (L > 1)
+            {
+                mask = create_causal_mask(L, caches[b]->length(), x.dtype(), s);
+            }
+            outputs.push_back(attend(queries, keys, values, mask, caches[b]));
+        }
+        array output = concatenate(outputs, 0, s);
+        output = reshape(transpose(output, {0, 2, 1, 3}, s), {B, L, -1}, s);
+        return scope.done(o_proj.forward(output));
     }
 };
 
@@ -226,6 +546,7 @@ class MLP : public nn::Module
 {
 public:
     LinearLayer gate_up_proj, down_proj;
+    bool compiled = false;
 
     MLP() = default;
     MLP(int dim, int hidden_dim)
@@ -237,10 +558,18 @@ public:
     }
     array forward(array x)
     {
+        nn::ForwardScope scope(*this, x);
         x = gate_up_proj.forward(x);
-        auto res = split(x, 2, -1);
+        StreamOrDevice s = stream();
+        auto res = split(x, 2, -1, s);
         array gate = res[0], _x = res[1];
-        return down_proj.forward(silu(gate) * _x);
+        // Compiled functions run on the default stream, so sessions with a
+        // stream of their own take the uncompiled path
+        if (compiled && !nn::thread_stream)
+        {
+            return scope.done(down_proj.forward(compiled_swiglu(gate, _x)));
+        }
+        return scope.done(down_proj.forward(multiply(silu(gate, s), _x, s)));
     }
 };
 
@@ -248,6 +577,7 @@ class TransformerBlock : public nn::Module
 {
 public:
     int num_attention_heads, hidden_size;
+    bool compiled = false;
     PhiAttention self_attn;
     MLP mlp;
     RMSNorm input_layernorm, post_attention_layernorm;
@@ -269,13 +599,66 @@ public:
         register_module("input_layernorm", input_layernorm);
         register_module("post_attention_layernorm", post_attention_layernorm);
     }
-    array forward(array x)
+
+    bool compilable() const
+    {
+        return self_attn.qkv_proj.compilable() && self_attn.o_proj.compilable() &&
+               mlp.gate_up_proj.compilable() && mlp.down_proj.compilable();
+    }
+
+    // The block as two compiled segments around the cache update, which
+    // mutates the cache and so stays outside. Every weight is an input, so
+    // the layers share one trace per [B, L]; `rope_tables` holds the
+    // positions' angles, built once per step by the caller.
+    array forward_compiled(array x, nn::KVCache *cache, const std::pair<array, array> &rope_tables)
     {
-        array r = self_attn.forward(input_layernorm.forward(x));
-        array h = x + r;
+        nn::ForwardScope scope(*this, x);
+        static auto qkv_fn = compile(block_qkv_impl<false>);
+        static auto qkv_traditional_fn = compile(block_qkv_impl<true>);
+        static auto out_fn = compile(block_out_impl);
+
+        std::vector<array> inputs = {
+            x, array(input_layernorm.eps), input_layernorm.parameters.at("weight"),
+            rope_tables.first, rope_tables.second};
+        self_attn.qkv_proj.append_inputs(inputs);
+        auto qkv = self_attn.rope.traditional ? qkv_traditional_fn(inputs) : qkv_fn(inputs);
+        array keys = qkv[1], values = qkv[2];
+        if (cache != nullptr)
+        {
+            std::tie(keys, values) = cache->update_and_fetch(keys, values);
+        }
+        array attention = scaled_dot_product_attention(qkv[0], keys, values, self_attn.scale, std::nullopt, stream());
+
+        inputs = {x, attention, array(post_attention_layernorm.eps), post_attention_layernorm.parameters.at("weight")};
+        self_attn.o_proj.append_inputs(inputs);
+        mlp.gate_up_proj.append_inputs(inputs);
+        mlp.down_proj.append_inputs(inputs);
+        return scope.done(out_fn(inputs)[0]);
+    }
+
+    array forward(
+        array x,
+        const std::optional<array> &mask = std::nullopt,
+        nn::KVCache *cache = nullptr)
+    {
+        nn::ForwardScope scope(*this, x);
+        array r = self_attn.forward(input_layernorm.forward(x), mask, cache);
+        array h = add(x, r, stream());
         r = mlp.forward(post_attention_layernorm.forward(h));
-        array out = h + r;
-        return out;
+        array out = add(h, r, stream());
+        return scope.done(out);
+    }
+    array forward(array x, const std::vector<nn::KVCache *> &caches)
+    {
+        nn::ForwardScope scope(*this, x);
+        array h = add(x, self_attn.forward(input_layernorm.forward(x), caches), stream());
+        return scope.done(add(h, mlp.forward(post_attention_layernorm.forward(h)), stream()));
+    }
+    array forward_packed(array x, const array &mask, const std::pair<array, array> &rope_tables)
+    {
+        nn::ForwardScope scope(*this, x);
+        array h = add(x, self_attn.forward_packed(input_layernorm.forward(x), mask, rope_tables), stream());
+        return scope.done(add(h, mlp.forward(post_attention_layernorm.forward(h)), stream()));
     }
 };
 class Phi3Model : public nn::Module
@@ -293,8 +676,8 @@ public:
         args = _args;
         vocab_size = args.vocab_size;
         num_hidden_layers = args.num_hidden_layers;
-        embed_tokens = Embedding(args.vocab_size, args.hidden_size);
-        for (size_t i = 0; i < args.num_hidden_layers; i++)
+        embed_tokens = Embedding(args.hidden_size, args.vocab_size);
+        for (int i = 0; i < args.num_hidden_layers; i++)
         {
             layers.push_back(TransformerBlock(args));
         }
@@ -304,14 +687,68 @@ public:
         register_layer("layers", layers);
         register_module("norm", norm);
     }
-    array forward(array x)
+    array forward(array x, nn::KVCacheList *cache = nullptr)
+    {
+        nn::ForwardScope scope(*this, x);
+        array h = embed_tokens.forward(x);
+
+        std::optional<array> mask = std::nullopt;
+        int L = h.shape(1);
+        if (L > 1)
+        {
+            int held = (cache != nullptr) ? (*cache)[0]->length() : 0;
+            mask = create_causal_mask(L, held, h.dtype(), stream());
+        }
+
+        // Compiled mode runs decode steps through compiled blocks. Prefill
+        // stays uncompiled: it would need a trace per prompt length, and
+        // its graph overhead is spread over the whole prompt anyway.
+        // Compiled functions run on the default stream, so sessions with a
+        // stream of their own are left out as well.
+        std::optional<std::pair<array, array>> rope_tables = std::nullopt;
+        if (L == 1 && !layers.empty() && layers[0].compiled && !nn::thread_stream)
+        {
+            int offset = (cache != nullptr) ? (*cache)[0]->offset : 0;
+            rope_tables = layers[0].self_attn.rope.tables(arange(offset, offset + 1, stream()), h.dtype());
+        }
+
+        for (size_t i = 0; i < layers.size(); i++)
+        {
+            nn::KVCache *layer_cache = (cache != nullptr) ? (*cache)[i].get() : nullptr;
+            h = rope_tables && layers[i].compilable() ? layers[i].forward_compiled(h, layer_cache, *rope_tables)
+                                                      : layers[i].forward(h, mask, layer_cache);
+        }
+        return scope.done(norm.forward(h));
+    }
+    array forward(array x, const std::vector<nn::KVCacheList *> &caches)
     {
+        // One cache set per batch row, so rows may sit at different positions
+        nn::ForwardScope scope(*this, x);
         array h = embed_tokens.forward(x);
-        for (auto &l : layers)
+        std::vector<nn::KVCache *> layer_caches(caches.size());
+        for (size_t i = 0; i < layers.size(); i++)
         {
-            h = l.forward(x);
+            for (size_t b = 0; b < caches.size(); b++)
+            {
+                layer_caches[b] = (*caches[b])[i].get();
+            }
+            h = layers[i].forward(h, layer_caches);
         }
-        return norm.forward(h);
+        return scope.done(norm.forward(h));
+    }
+    array forward_packed(const PackedBatch &batch)
+    {
+        // [1, T, hidden] for a packed batch; the mask and RoPE tables are
+        // built once and shared by every layer
+        nn::ForwardScope scope(*this, batch.tokens);
+        array h = embed_tokens.forward(batch.tokens);
+        array mask = create_packed_causal_mask(batch.segments, h.dtype(), stream());
+        auto rope_tables = layers[0].self_attn.rope.tables(batch.positions, h.dtype());
+        for (auto &layer : layers)
+        {
+            h = layer.forward_packed(h, mask, rope_tables);
+        }
+        return scope.done(norm.forward(h));
     }
 };
 
@@ -330,13 +767,129 @@ public:
         model_type = args.model_type;
         model = Phi3Model(args);
         lm_head = LinearLayer(args.hidden_size, args.vocab_size, false);
+
+        register_module("model", model);
+        register_module("lm_head", lm_head);
     }
 
-    array forward(array x)
+    array forward(array x, nn::KVCacheList *cache = nullptr)
     {
-        array out = model.forward(x);
-        eval(out);
-        return lm_head.forward(out);
+        nn::ForwardScope scope(*this, x);
+        array out = model.forward(x, cache);
+        return scope.done(lm_head.forward(out));
+    }
+
+    array forward(array x, const std::vector<nn::KVCacheList *> &caches)
+    {
+        nn::ForwardScope scope(*this, x);
+        array out = model.forward(x, caches);
+        return scope.done(lm_head.forward(out));
+    }
+
+    // Logits of each row's last position only, [B, vocab]: the LM head
+    // runs on one position per sequence instead of all of them
+    array forward_last(array x, nn::KVCacheList *cache = nullptr)
+    {
+        nn::ForwardScope scope(*this, x);
+        return scope.done(head_last(model.forward(x, cache)));
+    }
+
+    array forward_last(array x, const std::vector<nn::KVCacheList *> &caches)
+    {
+        nn::ForwardScope scope(*this, x);
+        return scope.done(head_last(model.forward(x, caches)));
+    }
+
+    // Final hidden state of each packed sequence, [n, hidden]
+    array last_hidden(const PackedBatch &batch)
+    {
+        StreamOrDevice s = stream();
+        std::vector<int> last(batch.offsets.begin() + 1, batch.offsets.end());
+        for (auto &i : last)
+        {
+            i -= 1;
+        }
+        array h = model.forward_packed(batch);
+        return take(reshape(h, {batch.length(), -1}, s), array(last.begin(), {batch.size()}, int32), 0, s);
+    }
+
+    // One embedding per packed sequence, [n, hidden] float32: its last
+    // token's hidden state or the mean over its tokens, optionally L2
+    // normalized
+    array embed(const PackedBatch &batch, Pooling pooling = Pooling::Mean, bool normalize = true)
+    {
+        StreamOrDevice s = stream();
+        array e = array(0.0f);
+        if (pooling == Pooling::Last)
+        {
+            e = astype(last_hidden(batch), float32, s);
+        }
+        else
+        {
+            // Segment mean as one matmul: [n, T] membership / length @ [T, hidden]
+            array h = astype(reshape(model.forward_packed(batch), {batch.length(), -1}, s), float32, s);
+            array seq = reshape(arange(batch.size(), s), {batch.size(), 1}, s);
+            array member = astype(equal(seq, expand_dims(batch.segments, 0, s), s), float32, s);
+            e = matmul(divide(member, sum(member, 1, true, s), s), h, s);
+        }
+        if (normalize)
+        {
+            e = divide(e, maximum(sqrt(sum(square(e, s), 1, true, s), s), array(1e-12f), s), s);
+        }
+        return e;
+    }
+
+    // Log-likelihood of each packed sequence, [n] float32: the sum over
+    // its tokens after the first of log p(token | earlier tokens)
+    array score(const PackedBatch &batch)
+    {
+        StreamOrDevice s = stream();
+        int T = batch.length();
+        array logits = astype(reshape(forward_packed(batch), {T, -1}, s), float32, s);
+        array logprobs = subtract(logits, logsumexp(logits, -1, true, s), s);
+        // Position t predicts token t + 1 unless t ends its sequence
+        array targets = concatenate({slice(reshape(batch.tokens, {T}, s), {1}, {T}, s), zeros({1}, int32, s)}, 0, s);
+        array picked = squeeze(take_along_axis(logprobs, expand_dims(targets, 1, s), 1, s), 1, s);
+        std::vector<float> keep(T, 1.0f);
+        for (int i = 1; i < int(batch.offsets.size()); i++)
+        {
+            keep[batch.offsets[i] - 1] = 0;
+        }
+        picked = multiply(picked, array(keep.begin(), {T}, float32), s);
+        array seq = reshape(arange(batch.size(), s), {batch.size(), 1}, s);
+        array member = astype(equal(seq, expand_dims(batch.segments, 0, s), s), float32, s);
+        return matmul(member, picked, s);
+    }
+
+    // Logits of every packed position, [1, T, vocab]
+    array forward_packed(const PackedBatch &batch)
+    {
+        nn::ForwardScope scope(*this, batch.tokens);
+        return scope.done(lm_head.forward(model.forward_packed(batch)));
+    }
+
+    void set_compiled(bool enable)
+    {
+        // Compiled mode runs decode steps as compiled blocks (see
+        // Phi3Model::forward) and every other MLP's SwiGLU chain as one
+        // fused kernel
+        for (auto &l : model.layers)
+        {
+            l.compiled = enable;
+            l.mlp.compiled = enable;
+        }
+    }
+
+    nn::KVCacheList make_cache(int max_kv_size = 0, int kv_keep = 4)
+    {
+        // One cache per TransformerBlock, passed to every forward of a
+        // sequence. With max_kv_size the caches roll: `kv_keep` sink
+        // positions plus the most recent ones, at most max_kv_size in all.
+        if (max_kv_size > 0)
+        {
+            return nn::make_rotating_kv_cache(args.num_hidden_layers, max_kv_size, kv_keep);
+        }
+        return nn::make_kv_cache(args.num_hidden_layers);
     }
 
     int head_dim()
@@ -345,6 +898,15 @@ public:
     }
     int n_kv_heads()
     {
-        return args.num_key_value_heads;
+        return args.kv_heads();
+    }
+
+private:
+    array head_last(const array &h)
+    {
+        StreamOrDevice s = stream();
+        int B = h.shape(0), L = h.shape(1), D = h.shape(2);
+        array logits = lm_head.forward(slice(h, {0, L - 1, 0}, {B, L, D}, s));
+        return reshape(logits, {B, logits.shape(2)}, s);
     }
 };
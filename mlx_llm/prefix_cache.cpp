@@ -0,0 +1,255 @@
+// Prompt prefix cache for mlx_llm.cpp
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "mlx/mlx.h"
+#include "kv_cache.cpp"
+
+namespace mlx::core::nn {
+
+struct PrefixNode
+{
+    // Tokens on the edge from the parent and, per layer, the keys/values
+    // for exactly those positions ([1, n_kv_heads, tokens.size(), head_dim])
+    std::vector<int> tokens{};
+    std::vector<array> keys{};
+    std::vector<array> values{};
+    std::unordered_map<int, std::unique_ptr<PrefixNode>> children{};
+    PrefixNode *parent = nullptr;
+    uint64_t last_used = 0;
+    size_t bytes = 0;
+};
+
+class PrefixCache
+{
+public:
+    // Radix tree over prompt tokens. A request reuses the keys/values of the
+    // longest cached prefix and only prefills the remainder; leaves are
+    // evicted least-recently-used first once `max_bytes` is exceeded.
+    size_t max_bytes;
+    size_t bytes = 0;
+
+    PrefixCache(size_t _max_bytes) : max_bytes(_max_bytes) {}
+
+    // Seeds a fresh cache with the longest cached prefix of `tokens` and
+    // returns its length. At least one token is always left to prefill so
+    // the caller gets logits for the last prompt position.
+    int fill(const std::vector<int> &tokens, KVCacheList &cache)
+    {
+        int limit = int(tokens.size()) - 1;
+        std::vector<std::vector<array>> key_parts(cache.size()), value_parts(cache.size());
+        int pos = 0;
+        PrefixNode *node = &root;
+        clock++;
+        while (pos < limit)
+        {
+            auto it = node->children.find(tokens[pos]);
+            if (it == node->children.end())
+            {
+                break;
+            }
+            PrefixNode *child = it->second.get();
+            int n = common_length(child->tokens, tokens, pos, limit);
+            child->last_used = clock;
+            for (size_t i = 0; i < cache.size(); i++)
+            {
+                key_parts[i].push_back(n == int(child->tokens.size()) ? child->keys[i] : head(child->keys[i], n));
+                value_parts[i].push_back(n == int(child->tokens.size()) ? child->values[i] : head(child->values[i], n));
+            }
+            pos += n;
+            if (n < int(child->tokens.size()))
+            {
+                break;
+            }
+            node = child;
+        }
+
+        if (pos > 0)
+        {
+            for (size_t i = 0; i < cache.size(); i++)
+            {
+                cache[i]->update_and_fetch(concatenate(key_parts[i], 2), concatenate(value_parts[i], 2));
+            }
+        }
+        return pos;
+    }
+
+    // Stores the keys/values of `tokens`, which must be the first
+    // tokens.size() positions held by `cache`
+    void insert(const std::vector<int> &tokens, KVCacheList &cache)
+    {
+        // A rolling cache that already evicted part of the prompt cannot
+        // provide its prefix
+        if (cache.empty() || cache[0]->length() != cache[0]->offset)
+        {
+            return;
+        }
+        int n_tokens = tokens.size();
+        std::vector<array> all_keys{}, all_values{};
+        for (auto &c : cache)
+        {
+            auto kv = c->state();
+            all_keys.push_back(kv.first);
+            all_values.push_back(kv.second);
+        }
+
+        int pos = 0;
+        PrefixNode *node = &root;
+        clock++;
+        while (pos < n_tokens)
+        {
+            auto it = node->children.find(tokens[pos]);
+            if (it == node->children.end())
+            {
+                auto leaf = std::make_unique<PrefixNode>();
+                leaf->tokens.assign(tokens.begin() + pos, tokens.end());
+                for (size_t i = 0; i < cache.size(); i++)
+                {
+                    leaf->keys.push_back(span(all_keys[i], pos, n_tokens));
+                    leaf->values.push_back(span(all_values[i], pos, n_tokens));
+                }
+                attach(node, std::move(leaf));
+                break;
+            }
+
+            PrefixNode *child = it->second.get();
+            int n = common_length(child->tokens, tokens, pos, n_tokens);
+            if (n < int(child->tokens.size()))
+            {
+                child = split(child, n);
+            }
+            child->last_used = clock;
+            pos += n;
+            node = child;
+        }
+        evict();
+    }
+
+    void clear()
+    {
+        root.children.clear();
+        bytes = 0;
+    }
+
+private:
+    PrefixNode root;
+    uint64_t clock = 0;
+
+    static int common_length(const std::vector<int> &edge, const std::vector<int> &tokens, int pos, int limit)
+    {
+        int n = 0;
+        while (n < int(edge.size()) && pos + n < limit && edge[n] == tokens[pos + n])
+        {
+            n++;
+        }
+        return n;
+    }
+
+    static array span(const array &x, int start, int stop)
+    {
+        return slice(x, {0, 0, start, 0}, {x.shape(0), x.shape(1), stop, x.shape(3)});
+    }
+
+    static array head(const array &x, int n)
+    {
+        return span(x, 0, n);
+    }
+
+    // A span is a view that keeps the whole request's buffer alive, and
+    // copy() would share that buffer too; a multiply by one writes just
+    // the span into a buffer of its own, so nbytes() is what it holds
+    static array own(const array &x)
+    {
+        return multiply(x, array(1, x.dtype()));
+    }
+
+    static size_t node_bytes(PrefixNode *node)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < node->keys.size(); i++)
+        {
+            total += node->keys[i].nbytes() + node->values[i].nbytes();
+        }
+        return total;
+    }
+
+    void attach(PrefixNode *parent, std::unique_ptr<PrefixNode> child)
+    {
+        for (size_t i = 0; i < child->keys.size(); i++)
+        {
+            child->keys[i] = own(child->keys[i]);
+            child->values[i] = own(child->values[i]);
+        }
+        eval(child->keys);
+        eval(child->values);
+        child->parent = parent;
+        child->last_used = clock;
+        child->bytes = node_bytes(child.get());
+        bytes += child->bytes;
+        int first = child->tokens[0];
+        parent->children[first] = std::move(child);
+    }
+
+    // Splits `node` after its first `n` tokens and returns the new upper half
+    PrefixNode *split(PrefixNode *node, int n)
+    {
+        PrefixNode *parent = node->parent;
+        std::unique_ptr<PrefixNode> lower = std::move(parent->children[node->tokens[0]]);
+        bytes -= lower->bytes;
+
+        auto upper = std::make_unique<PrefixNode>();
+        upper->tokens.assign(lower->tokens.begin(), lower->tokens.begin() + n);
+        for (size_t i = 0; i < lower->keys.size(); i++)
+        {
+            int len = lower->tokens.size();
+            upper->keys.push_back(span(lower->keys[i], 0, n));
+            upper->values.push_back(span(lower->values[i], 0, n));
+            lower->keys[i] = span(lower->keys[i], n, len);
+            lower->values[i] = span(lower->values[i], n, len);
+        }
+        lower->tokens.erase(lower->tokens.begin(), lower->tokens.begin() + n);
+        uint64_t lower_used = lower->last_used;
+
+        PrefixNode *upper_ptr = upper.get();
+        attach(parent, std::move(upper));
+        attach(upper_ptr, std::move(lower));
+        upper_ptr->children.begin()->second->last_used = lower_used;
+        return upper_ptr;
+    }
+
+    void evict()
+    {
+        while (bytes > max_bytes && !root.children.empty())
+        {
+            // Only leaves are evicted so every remaining path stays complete
+            PrefixNode *oldest = nullptr;
+            std::vector<PrefixNode *> stack{&root};
+            while (!stack.empty())
+            {
+                PrefixNode *node = stack.back();
+                stack.pop_back();
+                for (auto &[k, child] : node->children)
+                {
+                    if (child->children.empty())
+                    {
+                        if (oldest == nullptr || child->last_used < oldest->last_used)
+                        {
+                            oldest = child.get();
+                        }
+                    }
+                    else
+                    {
+                        stack.push_back(child.get());
+                    }
+                }
+            }
+            bytes -= oldest->bytes;
+            oldest->parent->children.erase(oldest->tokens[0]);
+        }
+    }
+};
+
+} // namespace mlx::core::nn
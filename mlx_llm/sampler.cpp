@@ -0,0 +1,322 @@
+// Batched on-device sampling for mlx_llm.cpp models
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "mlx/mlx.h"
+#include "common.cpp"
+
+using namespace mlx::core;
+
+struct SamplingParams
+{
+    float temperature = 0.0; // 0 is greedy
+    int top_k = 0;           // 0 keeps the whole vocabulary
+    float top_p = 1.0;
+    float min_p = 0.0; // drops tokens less likely than min_p * p(top token)
+    // Over the penalty window: seen tokens' positive logits are
+    // divided by repetition_penalty and negative ones multiplied; every
+    // occurrence subtracts frequency_penalty and any occurrence
+    // presence_penalty
+    float repetition_penalty = 1.0;
+    float frequency_penalty = 0.0;
+    float presence_penalty = 0.0;
+    int penalty_window = 64; // most recent tokens the penalties look at
+    int logprobs = 0; // top-n log-probabilities reported per token
+
+    bool penalized() const
+    {
+        return repetition_penalty != 1 || frequency_penalty != 0 || presence_penalty != 0;
+    }
+};
+
+struct SampledTokens
+{
+    array tokens;                                      // [B] int32
+    std::optional<array> logprobs = std::nullopt;     // [B] of the sampled tokens
+    std::optional<array> top_tokens = std::nullopt;   // [B, n], most likely first
+    std::optional<array> top_logprobs = std::nullopt; // [B, n]
+
+    std::vector<array> outputs() const
+    {
+        std::vector<array> out{tokens};
+        for (auto &a : {logprobs, top_tokens, top_logprobs})
+        {
+            if (a)
+            {
+                out.push_back(*a);
+            }
+        }
+        return out;
+    }
+};
+
+struct TokenLogprobs
+{
+    int token = 0;
+    float logprob = 0;
+    std::vector<std::pair<int, float>> top{};
+};
+
+// Turns [B, vocab] logits into token ids with per-row parameters. Every
+// step is an array op in one graph, so only B ids (and the requested
+// log-probabilities) ever reach the host. Log-probabilities are taken
+// after penalties and before temperature and truncation.
+class Sampler
+{
+public:
+    // The last `penalty_window` tokens of every row as [B, W], padded with -1
+    static array history(const std::vector<const std::vector<int> *> &rows, const std::vector<SamplingParams> &params)
+    {
+        int B = rows.size(), W = 1;
+        for (int b = 0; b < B; b++)
+        {
+            W = std::max(W, std::min(int(rows[b]->size()), params[b].penalty_window));
+        }
+        std::vector<int> data(B * W, -1);
+        for (int b = 0; b < B; b++)
+        {
+            int n = std::min(int(rows[b]->size()), params[b].penalty_window);
+            std::copy(rows[b]->end() - n, rows[b]->end(), data.begin() + b * W);
+        }
+        return array(data.begin(), {B, W}, int32);
+    }
+
+    SampledTokens sample(
+        const array &logits,
+        const std::vector<SamplingParams> &params,
+        const std::optional<array> &history = std::nullopt,
+        const std::optional<array> &key = std::nullopt,
+        const std::optional<array> &allowed = std::nullopt) const
+    {
+        auto draw = [&](const array &scaled, StreamOrDevice s)
+        { return random::categorical(scaled, -1, key, s); };
+        return sample_with(logits, params, history, allowed, draw);
+    }
+
+    // As above with a key per row (nullopt: MLX's global random state), so
+    // each row's draws depend on its own key and not on the rest of the
+    // batch. Same Gumbel-max draw as random::categorical row by row.
+    SampledTokens sample(
+        const array &logits,
+        const std::vector<SamplingParams> &params,
+        const std::optional<array> &history,
+        const std::vector<std::optional<array>> &keys,
+        const std::optional<array> &allowed = std::nullopt) const
+    {
+        if (int(keys.size()) != logits.shape(0))
+        {
+            throw std::invalid_argument("Sampler needs one key per row");
+        }
+        auto draw = [&](const array &scaled, StreamOrDevice s)
+        {
+            int V = scaled.shape(1);
+            std::vector<array> noise{};
+            for (auto &key : keys)
+            {
+                noise.push_back(random::gumbel({1, V}, float32, key, s));
+            }
+            return argmax(add(scaled, concatenate(noise, 0, s), s), -1, false, s);
+        };
+        return sample_with(logits, params, history, allowed, draw);
+    }
+
+    // Log-probabilities [B, vocab] of the distribution sample() draws each
+    // row from: penalties, temperature and truncation applied, and all the
+    // mass on the argmax for greedy rows. Rejection sampling (speculative
+    // decoding) compares these between models.
+    array distribution(
+        const array &logits,
+        const std::vector<SamplingParams> &params,
+        const std::optional<array> &history = std::nullopt,
+        const std::optional<array> &allowed = std::nullopt) const
+    {
+        StreamOrDevice s = nn::current_stream();
+        const float inf = std::numeric_limits<float>::infinity();
+        int V = logits.shape(1);
+        array x = adjust(logits, params, history, allowed, s);
+        array vocab = reshape(arange(V, s), {1, V}, s);
+        array greedy = where(equal(vocab, argmax(x, -1, true, s), s), array(0.0f), array(-inf), s);
+        if (!any_sampled(params))
+        {
+            return greedy;
+        }
+        array scaled = truncate(x, params, s);
+        scaled = subtract(scaled, logsumexp(scaled, -1, true, s), s);
+        return where(equal(column(params, &SamplingParams::temperature), array(0.0f), s), greedy, scaled, s);
+    }
+
+    // Host view of row `b` of an evaluated sample, cut to `n` top entries
+    static TokenLogprobs token_logprobs(const SampledTokens &sampled, int b, int n)
+    {
+        TokenLogprobs t;
+        t.token = sampled.tokens.data<int>()[b];
+        if (!sampled.logprobs)
+        {
+            return t;
+        }
+        t.logprob = sampled.logprobs->data<float>()[b];
+        int width = sampled.top_tokens->shape(1);
+        for (int i = 0; i < std::min(n, width); i++)
+        {
+            t.top.push_back({sampled.top_tokens->data<uint32_t>()[b * width + i],
+                             sampled.top_logprobs->data<float>()[b * width + i]});
+        }
+        return t;
+    }
+
+private:
+    // `allowed` ([B, vocab] bool, e.g. from a Grammar) rules tokens out
+    // before anything else, log-probabilities included. `draw` picks a
+    // token per row from the truncated, temperature-scaled logits.
+    template <typename Draw>
+    SampledTokens sample_with(
+        const array &logits,
+        const std::vector<SamplingParams> &params,
+        const std::optional<array> &history,
+        const std::optional<array> &allowed,
+        Draw draw) const
+    {
+        StreamOrDevice s = nn::current_stream();
+        int V = logits.shape(1);
+        array x = adjust(logits, params, history, allowed, s);
+        array greedy = argmax(x, -1, false, s);
+        array tokens = greedy;
+        if (any_sampled(params))
+        {
+            array sampled = draw(truncate(x, params, s), s);
+            tokens = where(equal(squeeze(column(params, &SamplingParams::temperature), -1, s), array(0.0f), s),
+                           greedy, sampled, s);
+        }
+        SampledTokens out{astype(tokens, int32, s)};
+        int B = logits.shape(0), n = 0;
+        for (auto &p : params)
+        {
+            n = std::max(n, p.logprobs);
+        }
+        if (n > 0)
+        {
+            n = std::min(n, V);
+            array lp = subtract(x, logsumexp(x, -1, true, s), s);
+            out.logprobs = squeeze(take_along_axis(lp, expand_dims(out.tokens, -1, s), -1, s), -1, s);
+            array top = slice(argpartition(negative(lp, s), n - 1, -1, s), {0, 0}, {B, n}, s);
+            array top_lp = take_along_axis(lp, top, -1, s);
+            array order = argsort(negative(top_lp, s), -1, s);
+            out.top_tokens = take_along_axis(top, order, -1, s);
+            out.top_logprobs = take_along_axis(top_lp, order, -1, s);
+        }
+        return out;
+    }
+
+    static bool any_sampled(const std::vector<SamplingParams> &params)
+    {
+        return std::any_of(params.begin(), params.end(), [](const SamplingParams &p)
+                           { return p.temperature != 0; });
+    }
+
+    template <typename T>
+    static array column(const std::vector<SamplingParams> &params, T SamplingParams::*field)
+    {
+        std::vector<float> v{};
+        for (auto &p : params)
+        {
+            v.push_back(p.*field);
+        }
+        return array(v.begin(), {int(params.size()), 1}, float32);
+    }
+
+    // Float32 logits with the grammar mask and the penalties applied
+    static array adjust(
+        const array &logits,
+        const std::vector<SamplingParams> &params,
+        const std::optional<array> &history,
+        const std::optional<array> &allowed,
+        StreamOrDevice s)
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        array x = astype(logits, float32, s);
+        if (allowed)
+        {
+            x = where(*allowed, x, array(-inf), s);
+        }
+        if (history && std::any_of(params.begin(), params.end(), [](const SamplingParams &p)
+                                   { return p.penalized(); }))
+        {
+            x = penalize(x, *history, column(params, &SamplingParams::repetition_penalty),
+                         column(params, &SamplingParams::frequency_penalty),
+                         column(params, &SamplingParams::presence_penalty), s);
+        }
+        return x;
+    }
+
+    // Temperature-scaled logits with min_p, top_k and top_p applied:
+    // dropped tokens are -inf. Rows with temperature 0 are scaled by 1.
+    static array truncate(const array &x, const std::vector<SamplingParams> &params, StreamOrDevice s)
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        int B = x.shape(0), V = x.shape(1);
+        auto any = [&](auto pred)
+        { return std::any_of(params.begin(), params.end(), pred); };
+        array temps = column(params, &SamplingParams::temperature);
+        array scaled = divide(x, where(equal(temps, array(0.0f), s), array(1.0f), temps, s), s);
+        if (any([](const SamplingParams &p)
+                { return p.min_p > 0; }))
+        {
+            array probs = softmax(scaled, -1, false, s);
+            array floor = multiply(column(params, &SamplingParams::min_p), max(probs, -1, true, s), s);
+            scaled = where(less(probs, floor, s), array(-inf), scaled, s);
+        }
+        if (any([](const SamplingParams &p)
+                { return p.top_k > 0 || p.top_p < 1; }))
+        {
+            // Truncate in sorted order, then scatter back to vocab order
+            array order = argsort(negative(scaled, s), -1, s);
+            array sorted = take_along_axis(scaled, order, -1, s);
+            array rank = reshape(arange(V, s), {1, V}, s);
+            std::vector<int> k(B);
+            for (int b = 0; b < B; b++)
+            {
+                k[b] = params[b].top_k > 0 ? params[b].top_k : V;
+            }
+            sorted = where(less(rank, array(k.begin(), {B, 1}, int32), s), sorted, array(-inf), s);
+            array before = cumsum(softmax(sorted, -1, false, s), -1, false, false, s);
+            array top_p = column(params, &SamplingParams::top_p);
+            array keep = logical_or(less(before, top_p, s), greater_equal(top_p, array(1.0f), s), s);
+            scaled = put_along_axis(scaled, order, where(keep, sorted, array(-inf), s), -1, s);
+        }
+        return scaled;
+    }
+
+    static array penalize(
+        const array &x,
+        const array &history,
+        const array &repetition,
+        const array &frequency,
+        const array &presence,
+        StreamOrDevice s)
+    {
+        // Rewrites only the logits of tokens in the window: gather them,
+        // penalize, scatter back. Padding points at an extra scratch
+        // column, and repeated tokens write identical values, so the
+        // scatter needs no deduplication.
+        int B = x.shape(0), V = x.shape(1);
+        array valid = greater_equal(history, array(0), s);
+        array idx = where(valid, history, array(V), s);
+        array counts = astype(
+            sum(logical_and(equal(expand_dims(idx, 2, s), expand_dims(idx, 1, s), s), expand_dims(valid, 1, s), s),
+                2, false, s),
+            float32, s);
+
+        array ext = concatenate({x, zeros({B, 1}, float32, s)}, 1, s);
+        array seen = take_along_axis(ext, idx, 1, s);
+        seen = where(greater(seen, array(0.0f), s), divide(seen, repetition, s), multiply(seen, repetition, s), s);
+        seen = subtract(seen, multiply(counts, frequency, s), s);
+        seen = subtract(seen, multiply(astype(greater(counts, array(0.0f), s), float32, s), presence, s), s);
+        ext = put_along_axis(ext, idx, seen, 1, s);
+        return slice(ext, {0, 0}, {B, V}, s);
+    }
+};
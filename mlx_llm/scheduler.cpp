@@ -0,0 +1,503 @@
+// Continuous batching for mlx_llm.cpp models
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "mlx/mlx.h"
+#include "generate.cpp"
+
+using namespace mlx::core;
+
+// Receives the log-probabilities of every sampled token (a stop token
+// included) when GenerationConfig::logprobs is set
+using LogprobCallback = std::function<void(const TokenLogprobs &)>;
+
+// Receives the reason when the scheduler has to drop a request on its own,
+// e.g. because its adapter failed to load
+using ErrorCallback = std::function<void(const std::string &)>;
+
+struct Sequence
+{
+    int id;
+    std::vector<int> prompt;
+    GenerationConfig config;
+    TokenCallback callback;
+    LogprobCallback logprob_callback = nullptr;
+    ErrorCallback error_callback = nullptr;
+    nn::KVCacheList cache{};
+    std::vector<int> tokens{};
+    int next_token = 0;
+    int prefilled = 0; // prompt positions already in the cache
+    int adapter_slot = 0; // LoRA slot held while running, 0 is the base model
+    std::optional<array> key = std::nullopt; // with config.seed, split once per sampled token
+    std::optional<GrammarMatcher> matcher = std::nullopt; // with config.grammar
+    bool finished = false;
+
+    bool decoding() const
+    {
+        return prefilled == int(prompt.size());
+    }
+
+    // Prompt and generated tokens, as the penalties see them
+    std::vector<int> context() const
+    {
+        std::vector<int> all = prompt;
+        all.insert(all.end(), tokens.begin(), tokens.end());
+        return all;
+    }
+
+    // Commits a sampled token; returns false once the sequence is done
+    bool push(int token)
+    {
+        const auto &stop = config.stop_tokens;
+        if (std::find(stop.begin(), stop.end(), token) != stop.end())
+        {
+            finished = true;
+            return false;
+        }
+        tokens.push_back(token);
+        next_token = token;
+        if ((callback && !callback(token)) || int(tokens.size()) >= config.max_tokens)
+        {
+            finished = true;
+        }
+        return !finished;
+    }
+};
+
+class Scheduler
+{
+public:
+    Model &model;
+    int max_batch_size;
+    std::shared_ptr<nn::BlockPool> pool;
+    nn::PrefixCache *prefix_cache = nullptr;
+    // Serves `GenerationConfig::adapter`; each running sequence holds its
+    // adapter's slot, and one decode step mixes adapters across rows
+    nn::LoRAManager *adapters = nullptr;
+    Sampler sampler{};
+    std::deque<Sequence> waiting{};
+    std::vector<Sequence> running{};
+
+    // With a block pool, sequences draw KV pages from it instead of each
+    // growing a private contiguous cache
+    Scheduler(Model &_model, int _max_batch_size = 8, std::shared_ptr<nn::BlockPool> _pool = nullptr)
+        : model(_model), max_batch_size(_max_batch_size), pool(_pool) {}
+
+    int submit(
+        const std::vector<int> &prompt,
+        const GenerationConfig &config = GenerationConfig(),
+        const TokenCallback &callback = nullptr,
+        const LogprobCallback &logprob_callback = nullptr,
+        const ErrorCallback &error_callback = nullptr)
+    {
+        if (prompt.empty())
+        {
+            throw std::invalid_argument("Prompt must contain at least one token");
+        }
+        // Rejected here rather than at admission, where a bad request
+        // would sit at the head of the queue and block everything behind it
+        const std::string &adapter = config.adapter;
+        if (!adapter.empty() && (!adapters || !adapters->contains(adapter)))
+        {
+            throw std::invalid_argument(
+                adapters ? "Unknown adapter: " + adapter : "Adapter requested without a LoRAManager: " + adapter);
+        }
+        if (pool && config.max_kv_size > 0)
+        {
+            throw std::invalid_argument("max_kv_size needs contiguous caches; this scheduler pages them");
+        }
+        Sequence seq{next_id++, prompt, config, callback, logprob_callback, error_callback};
+        waiting.push_back(std::move(seq));
+        return waiting.back().id;
+    }
+
+    bool has_work()
+    {
+        return !waiting.empty() || !running.empty();
+    }
+
+    // True while the sequence is queued or decoding
+    bool contains(int id)
+    {
+        auto match = [id](const Sequence &s)
+        { return s.id == id; };
+        return std::any_of(waiting.begin(), waiting.end(), match) ||
+               std::any_of(running.begin(), running.end(), match);
+    }
+
+    // Drops a sequence wherever it is; its cache is freed with it
+    void cancel(int id)
+    {
+        auto match = [id](const Sequence &s)
+        { return s.id == id; };
+        waiting.erase(std::remove_if(waiting.begin(), waiting.end(), match), waiting.end());
+        for (auto &seq : running)
+        {
+            if (seq.id == id)
+            {
+                release(seq);
+            }
+        }
+        running.erase(std::remove_if(running.begin(), running.end(), match), running.end());
+    }
+
+    // One scheduling iteration: admit waiting sequences into free slots,
+    // make room in the block pool for what this step writes, prefill one
+    // chunk of the oldest unfinished prompt, run a single batched decode
+    // step and drop whatever finished
+    void step()
+    {
+        nn::MemoryBudget::check("scheduler step");
+        admit();
+        make_room();
+        prefill_step();
+        decode_step();
+        evict();
+    }
+
+    void run()
+    {
+        while (has_work())
+        {
+            step();
+        }
+    }
+
+private:
+    int next_id = 0;
+
+    void admit()
+    {
+        while (!waiting.empty() && int(running.size()) < max_batch_size)
+        {
+            // Leave the request queued until the pool can hold its prompt
+            // on top of the next position of every running sequence
+            if (pool)
+            {
+                int committed = 0;
+                for (auto &seq : running)
+                {
+                    committed += blocks_needed(seq, seq.prompt.size() + seq.tokens.size() + 1);
+                }
+                if (!pool->can_allocate(committed + pool->blocks_for(waiting.front().prompt.size() + 1)))
+                {
+                    break;
+                }
+            }
+            // ... and until its adapter can be made resident
+            const std::string &adapter = waiting.front().config.adapter;
+            if (!adapter.empty() && !adapters->can_acquire(adapter))
+            {
+                break;
+            }
+            // A failed load fails only this request; it leaves the queue
+            // so the ones behind it are still admitted
+            int adapter_slot = 0;
+            try
+            {
+                adapter_slot = adapters ? adapters->acquire(adapter) : 0;
+            }
+            catch (const std::exception &e)
+            {
+                Sequence failed = std::move(waiting.front());
+                waiting.pop_front();
+                if (failed.error_callback)
+                {
+                    failed.error_callback(e.what());
+                }
+                continue;
+            }
+            Sequence seq = std::move(waiting.front());
+            waiting.pop_front();
+
+            // The prompt is prefilled by later steps, chunk by chunk
+            seq.adapter_slot = adapter_slot;
+            if (seq.config.grammar && !seq.matcher)
+            {
+                seq.matcher.emplace(seq.config.grammar);
+            }
+            if (seq.config.seed && !seq.key)
+            {
+                seq.key = random::key(*seq.config.seed);
+            }
+            const GenerationConfig &config = seq.config;
+            seq.cache = pool ? nn::make_paged_kv_cache(pool) : model.make_cache(config.max_kv_size, config.kv_keep);
+            seq.prefilled = shares_prefix(seq) ? prefix_cache->fill(seq.prompt, seq.cache) : 0;
+            running.push_back(std::move(seq));
+        }
+    }
+
+    // The sequence whose prompt this step prefills, if any
+    Sequence *prefilling()
+    {
+        auto it = std::find_if(running.begin(), running.end(), [](const Sequence &s)
+                               { return !s.decoding() && !s.finished; });
+        return it == running.end() ? nullptr : &*it;
+    }
+
+    // End of the prompt chunk this step prefills for `seq`
+    static int chunk_end(const Sequence &seq)
+    {
+        int end = seq.prompt.size();
+        if (seq.config.prefill_chunk_size > 0)
+        {
+            end = std::min(end, seq.prefilled + seq.config.prefill_chunk_size);
+        }
+        return end;
+    }
+
+    int blocks_held(const Sequence &seq)
+    {
+        auto paged = seq.cache.empty() ? nullptr : std::dynamic_pointer_cast<nn::PagedKVCache>(seq.cache.front());
+        return paged ? paged->table->blocks.size() : 0;
+    }
+
+    // Blocks `seq` still has to draw from the pool to hold `positions`
+    int blocks_needed(const Sequence &seq, int positions)
+    {
+        return std::max(pool->blocks_for(positions) - blocks_held(seq), 0);
+    }
+
+    // Preempts the most recently admitted sequences until the pool holds
+    // every block this step writes, so a sequence never runs out of pages
+    // mid-forward. A sequence left alone that still does not fit has
+    // outgrown the pool and is finished where it stands.
+    void make_room()
+    {
+        while (pool && !running.empty())
+        {
+            Sequence *chunk = prefilling();
+            int needed = 0;
+            for (auto &seq : running)
+            {
+                if (seq.finished)
+                {
+                    continue;
+                }
+                if (seq.decoding())
+                {
+                    needed += blocks_needed(seq, seq.prompt.size() + seq.tokens.size());
+                }
+                else if (&seq == chunk)
+                {
+                    // The last chunk also decodes this step
+                    int end = chunk_end(seq);
+                    needed += blocks_needed(seq, end + (end == int(seq.prompt.size())));
+                }
+            }
+            if (pool->can_allocate(needed))
+            {
+                return;
+            }
+            if (running.size() == 1)
+            {
+                running.front().finished = true;
+                return;
+            }
+            preempt(running.size() - 1);
+        }
+    }
+
+    // Frees a running sequence's pages and queues it to be recomputed
+    // ahead of new requests: its generated tokens join the prompt, so the
+    // prefill of that context samples the token after the last one sent
+    void preempt(size_t i)
+    {
+        Sequence seq = std::move(running[i]);
+        running.erase(running.begin() + i);
+        release(seq);
+        seq.config.max_tokens -= seq.tokens.size();
+        seq.prompt = seq.context();
+        seq.tokens.clear();
+        seq.prefilled = 0;
+        seq.adapter_slot = 0;
+        seq.cache.clear();
+        waiting.push_front(std::move(seq));
+    }
+
+    void prefill_step()
+    {
+        // A step prefills at most `prefill_chunk_size` positions of one
+        // prompt, so a long prompt is spread over many steps and running
+        // sequences keep decoding in between
+        Sequence *chunk = prefilling();
+        if (chunk == nullptr)
+        {
+            return;
+        }
+        Sequence &seq = *chunk;
+        int end = chunk_end(seq);
+        bool last = end == int(seq.prompt.size());
+        nn::LoRAScope lora(std::vector<int>{seq.adapter_slot});
+        auto logits = prefill_chunk(model, seq.prompt, seq.prefilled, end, seq.cache, last);
+        seq.prefilled = end;
+        if (!last)
+        {
+            return;
+        }
+
+        // Prompt done: sample its first token, then it joins the decode batch
+        std::vector<Sequence *> batch{&seq};
+        SampledTokens y = sample(*logits, batch);
+        if (shares_prefix(seq))
+        {
+            prefix_cache->insert(seq.prompt, seq.cache);
+        }
+        if (seq.config.max_tokens > 0)
+        {
+            commit(seq, y, 0);
+        }
+        else
+        {
+            seq.finished = true;
+        }
+    }
+
+    void decode_step()
+    {
+        std::vector<Sequence *> batch{};
+        for (auto &seq : running)
+        {
+            if (seq.decoding() && !seq.finished)
+            {
+                batch.push_back(&seq);
+            }
+        }
+        if (batch.empty())
+        {
+            return;
+        }
+
+        int B = batch.size();
+        std::vector<int> inputs(B);
+        std::vector<int> slots(B);
+        std::vector<nn::KVCacheList *> caches(B);
+        for (int b = 0; b < B; b++)
+        {
+            inputs[b] = batch[b]->next_token;
+            slots[b] = batch[b]->adapter_slot;
+            caches[b] = &batch[b]->cache;
+        }
+
+        array x = array(inputs.begin(), {B, 1}, int32);
+        nn::LoRAScope lora(slots);
+        SampledTokens y = sample(model.forward_last(x, caches), batch);
+        for (int b = 0; b < B; b++)
+        {
+            commit(*batch[b], y, b);
+        }
+    }
+
+    // Samples one token per row with each sequence's own parameters; only
+    // the ids and any requested log-probabilities are read back
+    SampledTokens sample(const array &logits, const std::vector<Sequence *> &batch)
+    {
+        std::vector<SamplingParams> params{};
+        std::vector<std::vector<int>> contexts{};
+        bool penalized = false;
+        for (auto *seq : batch)
+        {
+            params.push_back(seq->config.sampling());
+            penalized |= params.back().penalized();
+        }
+        std::optional<array> history = std::nullopt;
+        if (penalized)
+        {
+            for (auto *seq : batch)
+            {
+                contexts.push_back(seq->context());
+            }
+            std::vector<const std::vector<int> *> rows{};
+            for (auto &c : contexts)
+            {
+                rows.push_back(&c);
+            }
+            history = Sampler::history(rows, params);
+        }
+        // Grammar masks come from each matcher's cache; unconstrained rows
+        // in a mixed batch allow everything
+        std::optional<array> allowed = std::nullopt;
+        if (std::any_of(batch.begin(), batch.end(), [](Sequence *seq)
+                        { return seq->matcher.has_value(); }))
+        {
+            StreamOrDevice s = nn::current_stream();
+            std::vector<array> rows{};
+            for (auto *seq : batch)
+            {
+                rows.push_back(seq->matcher ? seq->matcher->allowed() : ones({logits.shape(1)}, bool_, s));
+            }
+            allowed = stack(rows, 0, s);
+        }
+        // Seeded rows draw from their own keys, so their tokens do not
+        // depend on what else is in the batch
+        SampledTokens y = std::any_of(batch.begin(), batch.end(), [](Sequence *seq)
+                                      { return seq->key.has_value(); })
+                              ? sampler.sample(logits, params, history, next_keys(batch), allowed)
+                              : sampler.sample(logits, params, history, std::nullopt, allowed);
+        eval(y.outputs());
+        return y;
+    }
+
+    std::vector<std::optional<array>> next_keys(const std::vector<Sequence *> &batch)
+    {
+        std::vector<std::optional<array>> keys{};
+        for (auto *seq : batch)
+        {
+            std::optional<array> sub = std::nullopt;
+            if (seq->key)
+            {
+                auto [k, s] = random::split(*seq->key, nn::current_stream());
+                seq->key = k;
+                sub = s;
+            }
+            keys.push_back(sub);
+        }
+        return keys;
+    }
+
+    void commit(Sequence &seq, const SampledTokens &y, int b)
+    {
+        TokenLogprobs t = Sampler::token_logprobs(y, b, seq.config.logprobs);
+        if (seq.config.logprobs > 0 && seq.logprob_callback)
+        {
+            seq.logprob_callback(t);
+        }
+        if (seq.matcher)
+        {
+            seq.matcher->accept(t.token);
+        }
+        seq.push(t.token);
+    }
+
+    // Cached prefixes were computed by the base model, so adapted
+    // sequences neither read nor populate them
+    bool shares_prefix(const Sequence &seq)
+    {
+        return prefix_cache && seq.config.adapter.empty();
+    }
+
+    void release(const Sequence &seq)
+    {
+        if (adapters)
+        {
+            adapters->release(seq.config.adapter);
+        }
+    }
+
+    void evict()
+    {
+        for (auto &seq : running)
+        {
+            if (seq.finished)
+            {
+                release(seq);
+            }
+        }
+        running.erase(
+            std::remove_if(running.begin(), running.end(), [](const Sequence &s)
+                           { return s.finished; }),
+            running.end());
+    }
+};
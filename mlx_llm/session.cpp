@@ -0,0 +1,124 @@
+// Concurrent inference sessions over one shared model for mlx_llm.cpp
+#pragma once
+
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include "mlx/mlx.h"
+#include "generate.cpp"
+
+using namespace mlx::core;
+
+// Per-conversation state: the KV cache, the tokens it covers, the RNG seed
+// and the MLX stream every op of this session goes to. The Model itself is
+// only read, so it must be frozen first; after that any number of sessions
+// on different threads share one copy of the weights. MLX graph building
+// and evaluation is not safe to drive from several threads at once, so
+// sessions take turns at it; token callbacks run outside that lock and do
+// not hold up the other sessions. To decode many conversations in one
+// forward per step use a Scheduler instead.
+class Session
+{
+public:
+    Session(
+        Model &_model,
+        uint64_t _seed = 0,
+        Device device = metal::is_available() ? Device::gpu : Device::cpu,
+        int max_kv_size = 0,
+        int kv_keep = 4)
+        : model(_model), stream(create_stream(device)), seed(_seed)
+    {
+        if (!model.is_frozen())
+        {
+            throw std::logic_error("Sessions need a frozen model, call freeze() before creating them");
+        }
+        // A rolling cache keeps memory and per-token cost flat however long
+        // the conversation runs
+        cache = model.make_cache(max_kv_size, kv_keep);
+    }
+
+    // Continues the conversation with `prompt` and returns the new tokens
+    std::vector<int> generate(
+        const std::vector<int> &prompt,
+        GenerationConfig config = GenerationConfig(),
+        const TokenCallback &callback = nullptr,
+        GenerationStats *stats = nullptr)
+    {
+        std::unique_lock<std::mutex> lock(graph_mutex());
+        nn::StreamScope scope(stream);
+        if (!config.seed)
+        {
+            config.seed = seed + 0x9E3779B97F4A7C15ull * ++calls;
+        }
+
+        // Tokens from the last turn that never went through the model
+        // (the final one when max_tokens was hit) lead the new input
+        std::vector<int> input(history.begin() + cache[0]->offset, history.end());
+        input.insert(input.end(), prompt.begin(), prompt.end());
+        // The next step is already queued when a token is handed out, so
+        // the lock can go for the duration of the callback
+        TokenCallback unlocked = nullptr;
+        if (callback)
+        {
+            unlocked = [&](int token)
+            {
+                lock.unlock();
+                bool more = callback(token);
+                lock.lock();
+                return more;
+            };
+        }
+        std::vector<int> tokens = ::generate(model, input, config, unlocked, stats, nullptr, &cache);
+        history.insert(history.end(), prompt.begin(), prompt.end());
+        history.insert(history.end(), tokens.begin(), tokens.end());
+
+        // Decode runs a step ahead, so the cache can hold a position past
+        // the returned tokens (a stop token or an unused look-ahead)
+        int extra = cache[0]->offset - int(history.size());
+        for (auto &c : cache)
+        {
+            c->trim(std::max(extra, 0));
+        }
+        return tokens;
+    }
+
+    void reset()
+    {
+        for (auto &c : cache)
+        {
+            c->reset();
+        }
+        history.clear();
+    }
+
+    int position() const
+    {
+        return history.size();
+    }
+
+    const std::vector<int> &tokens() const
+    {
+        return history;
+    }
+
+private:
+    Model &model;
+    Stream stream;
+    uint64_t seed;
+    uint64_t calls = 0;
+    nn::KVCacheList cache{};
+    std::vector<int> history{};
+
+    static Stream create_stream(Device device)
+    {
+        std::lock_guard<std::mutex> lock(graph_mutex());
+        return new_stream(device);
+    }
+
+    // Held while a session builds or evaluates MLX graphs
+    static std::mutex &graph_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+};
@@ -0,0 +1,369 @@
+// Snapshot files for mlx_llm.cpp modules
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "mlx/mlx.h"
+
+namespace mlx::core::nn {
+
+// Layout:
+//   "MLXSNAP1" | u64 header bytes | header | padding | data
+// The header lists every tensor in ParameterTable order (name, dtype,
+// shape, offset into data) followed by the quantized layers and a
+// fingerprint of the parameters' names, dtypes and shapes. Data starts page
+// aligned and every tensor is 64-byte aligned, already in the dtype and
+// layout its layer consumes, so loading needs no conversion.
+constexpr char snapshot_magic[8] = {'M', 'L', 'X', 'S', 'N', 'A', 'P', '1'};
+constexpr uint64_t snapshot_tensor_alignment = 64;
+constexpr uint64_t snapshot_data_alignment = 4096;
+
+struct SnapshotTensor
+{
+    std::string name;
+    Dtype dtype = float32;
+    std::vector<int> shape{};
+    uint64_t offset = 0;
+    uint64_t nbytes = 0;
+};
+
+struct SnapshotQuantized
+{
+    // A layer whose packed weights are bound with load_quantized before
+    // the table is filled; indices point into the tensor list
+    std::string path;
+    int group_size = 0, bits = 0;
+    uint64_t weight = 0, scales = 0, biases = 0;
+};
+
+struct SnapshotHeader
+{
+    std::vector<SnapshotTensor> tensors{};
+    std::vector<SnapshotQuantized> quantized{};
+    uint64_t fingerprint = 0;
+    uint64_t data_start = 0;
+};
+
+const std::vector<Dtype> &snapshot_dtypes()
+{
+    // Position in this list is the on-disk dtype code; append only
+    static const std::vector<Dtype> dtypes{
+        bool_, uint8, uint16, uint32, uint64, int8, int16, int32, int64,
+        float16, float32, bfloat16, complex64};
+    return dtypes;
+}
+
+uint8_t snapshot_dtype_code(Dtype dtype)
+{
+    const auto &dtypes = snapshot_dtypes();
+    for (size_t i = 0; i < dtypes.size(); i++)
+    {
+        if (dtypes[i] == dtype)
+        {
+            return i;
+        }
+    }
+    throw std::invalid_argument("Unsupported dtype in snapshot");
+}
+
+uint64_t snapshot_fingerprint(std::vector<SnapshotTensor> tensors)
+{
+    // FNV-1a over names, dtypes and shapes in name order: a snapshot only
+    // loads into a module whose parameters are the ones it was saved from,
+    // which can be checked before quantized layers are rebound
+    std::sort(tensors.begin(), tensors.end(), [](const SnapshotTensor &a, const SnapshotTensor &b)
+              { return a.name < b.name; });
+    uint64_t hash = 1469598103934665603ull;
+    auto mix = [&](const void *data, size_t n)
+    {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < n; i++)
+        {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    };
+    for (auto &t : tensors)
+    {
+        uint8_t code = snapshot_dtype_code(t.dtype);
+        mix(t.name.data(), t.name.size());
+        mix(&code, sizeof(code));
+        mix(t.shape.data(), t.shape.size() * sizeof(int));
+    }
+    return hash;
+}
+
+uint64_t align_up(uint64_t n, uint64_t alignment)
+{
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+class SnapshotBuffer
+{
+    // Little helpers to append / read fixed-width fields
+public:
+    std::string bytes{};
+
+    template <typename T>
+    void put(T value)
+    {
+        bytes.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+    void put_string(const std::string &s)
+    {
+        put<uint32_t>(s.size());
+        bytes += s;
+    }
+};
+
+class SnapshotReader
+{
+public:
+    SnapshotReader(const char *_data, size_t _size) : data(_data), size(_size) {}
+
+    template <typename T>
+    T get()
+    {
+        require(sizeof(T));
+        T value;
+        std::memcpy(&value, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+    std::string get_string()
+    {
+        uint32_t n = get<uint32_t>();
+        require(n);
+        std::string s(data + pos, n);
+        pos += n;
+        return s;
+    }
+
+private:
+    const char *data;
+    size_t size, pos = 0;
+
+    void require(size_t n)
+    {
+        if (pos + n > size)
+        {
+            throw std::runtime_error("Snapshot header is truncated");
+        }
+    }
+};
+
+void write_snapshot(const std::string &file, SnapshotHeader &header, const std::vector<array> &data)
+{
+    // `data` holds evaluated, row-contiguous arrays in header order
+    uint64_t offset = 0;
+    for (auto &t : header.tensors)
+    {
+        t.offset = offset;
+        offset = align_up(offset + t.nbytes, snapshot_tensor_alignment);
+    }
+
+    SnapshotBuffer h;
+    h.put<uint64_t>(header.tensors.size());
+    for (auto &t : header.tensors)
+    {
+        h.put_string(t.name);
+        h.put<uint8_t>(snapshot_dtype_code(t.dtype));
+        h.put<uint8_t>(t.shape.size());
+        for (int d : t.shape)
+        {
+            h.put<int32_t>(d);
+        }
+        h.put<uint64_t>(t.offset);
+        h.put<uint64_t>(t.nbytes);
+    }
+    h.put<uint64_t>(header.quantized.size());
+    for (auto &q : header.quantized)
+    {
+        h.put_string(q.path);
+        h.put<int32_t>(q.group_size);
+        h.put<int32_t>(q.bits);
+        h.put<uint64_t>(q.weight);
+        h.put<uint64_t>(q.scales);
+        h.put<uint64_t>(q.biases);
+    }
+    h.put<uint64_t>(header.fingerprint);
+
+    std::ofstream out(file, std::ios::binary);
+    if (!out)
+    {
+        throw std::runtime_error("Cannot write snapshot: " + file);
+    }
+    uint64_t header_bytes = h.bytes.size();
+    header.data_start = align_up(sizeof(snapshot_magic) + sizeof(uint64_t) + header_bytes, snapshot_data_alignment);
+    out.write(snapshot_magic, sizeof(snapshot_magic));
+    out.write(reinterpret_cast<const char *>(&header_bytes), sizeof(header_bytes));
+    out.write(h.bytes.data(), header_bytes);
+
+    std::string padding(snapshot_data_alignment, '\0');
+    uint64_t written = sizeof(snapshot_magic) + sizeof(uint64_t) + header_bytes;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        uint64_t target = header.data_start + header.tensors[i].offset;
+        out.write(padding.data(), target - written);
+        out.write(data[i].data<char>(), header.tensors[i].nbytes);
+        written = target + header.tensors[i].nbytes;
+    }
+    if (!out)
+    {
+        throw std::runtime_error("Failed writing snapshot: " + file);
+    }
+}
+
+// Read-only mapping of a snapshot; arrays built from it keep it alive
+class MappedFile
+{
+public:
+    const char *data = nullptr;
+    size_t size = 0;
+
+    MappedFile(const std::string &file)
+    {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Cannot open snapshot: " + file);
+        }
+        struct stat st;
+        fstat(fd, &st);
+        size = st.st_size;
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            throw std::runtime_error("Cannot map snapshot: " + file);
+        }
+        data = static_cast<const char *>(mapped);
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile()
+    {
+        munmap(const_cast<char *>(data), size);
+    }
+};
+
+SnapshotHeader read_snapshot_header(const MappedFile &file)
+{
+    if (file.size < sizeof(snapshot_magic) + sizeof(uint64_t) ||
+        std::memcmp(file.data, snapshot_magic, sizeof(snapshot_magic)) != 0)
+    {
+        throw std::runtime_error("Not a snapshot file");
+    }
+    uint64_t header_bytes;
+    std::memcpy(&header_bytes, file.data + sizeof(snapshot_magic), sizeof(header_bytes));
+    size_t start = sizeof(snapshot_magic) + sizeof(uint64_t);
+    if (start + header_bytes > file.size)
+    {
+        throw std::runtime_error("Snapshot header is truncated");
+    }
+    SnapshotReader r(file.data + start, header_bytes);
+
+    SnapshotHeader header;
+    const auto &dtypes = snapshot_dtypes();
+    header.tensors.resize(r.get<uint64_t>());
+    for (auto &t : header.tensors)
+    {
+        t.name = r.get_string();
+        uint8_t code = r.get<uint8_t>();
+        if (code >= dtypes.size())
+        {
+            throw std::runtime_error("Unknown dtype in snapshot: " + t.name);
+        }
+        t.dtype = dtypes[code];
+        t.shape.resize(r.get<uint8_t>());
+        for (auto &d : t.shape)
+        {
+            d = r.get<int32_t>();
+        }
+        t.offset = r.get<uint64_t>();
+        t.nbytes = r.get<uint64_t>();
+    }
+    header.quantized.resize(r.get<uint64_t>());
+    for (auto &q : header.quantized)
+    {
+        q.path = r.get_string();
+        q.group_size = r.get<int32_t>();
+        q.bits = r.get<int32_t>();
+        q.weight = r.get<uint64_t>();
+        q.scales = r.get<uint64_t>();
+        q.biases = r.get<uint64_t>();
+        if (std::max({q.weight, q.scales, q.biases}) >= header.tensors.size())
+        {
+            throw std::runtime_error("Snapshot quantized layer points past the tensors: " + q.path);
+        }
+    }
+    header.fingerprint = r.get<uint64_t>();
+    header.data_start = align_up(start + header_bytes, snapshot_data_alignment);
+
+    for (auto &t : header.tensors)
+    {
+        if (header.data_start + t.offset + t.nbytes > file.size)
+        {
+            throw std::runtime_error("Snapshot data is truncated: " + t.name);
+        }
+    }
+    return header;
+}
+
+template <typename T>
+array copy_snapshot_tensor(const char *ptr, const SnapshotTensor &t)
+{
+    return array(reinterpret_cast<const T *>(ptr), t.shape, t.dtype);
+}
+
+array snapshot_array(const std::shared_ptr<MappedFile> &file, const SnapshotHeader &header, const SnapshotTensor &t)
+{
+    const char *ptr = file->data + header.data_start + t.offset;
+    if (!metal::is_available())
+    {
+        // CPU arrays can point straight into the mapping; the deleter only
+        // drops the array's reference to it
+        return array(
+            allocator::Buffer(const_cast<char *>(ptr)), t.shape, t.dtype,
+            [file](allocator::Buffer) {});
+    }
+    // Metal buffers belong to MLX's allocator, so each tensor is copied
+    // once out of the page cache as-is
+    Dtype d = t.dtype;
+    if (d == bool_)
+        return copy_snapshot_tensor<bool>(ptr, t);
+    if (d == uint8)
+        return copy_snapshot_tensor<uint8_t>(ptr, t);
+    if (d == uint16)
+        return copy_snapshot_tensor<uint16_t>(ptr, t);
+    if (d == uint32)
+        return copy_snapshot_tensor<uint32_t>(ptr, t);
+    if (d == uint64)
+        return copy_snapshot_tensor<uint64_t>(ptr, t);
+    if (d == int8)
+        return copy_snapshot_tensor<int8_t>(ptr, t);
+    if (d == int16)
+        return copy_snapshot_tensor<int16_t>(ptr, t);
+    if (d == int32)
+        return copy_snapshot_tensor<int32_t>(ptr, t);
+    if (d == int64)
+        return copy_snapshot_tensor<int64_t>(ptr, t);
+    if (d == float16)
+        return copy_snapshot_tensor<float16_t>(ptr, t);
+    if (d == bfloat16)
+        return copy_snapshot_tensor<bfloat16_t>(ptr, t);
+    if (d == complex64)
+        return copy_snapshot_tensor<complex64_t>(ptr, t);
+    return copy_snapshot_tensor<float>(ptr, t);
+}
+
+} // namespace mlx::core::nn
@@ -0,0 +1,222 @@
+// Speculative decoding for mlx_llm.cpp models
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "mlx/mlx.h"
+#include "generate.cpp"
+
+using namespace mlx::core;
+
+// A small draft model proposes `num_draft` tokens per step and the target
+// model scores all of them in a single forward. Drafts are accepted with
+// the usual rejection rule over the Sampler's distributions (for greedy,
+// while they match the target's argmax), so the output distribution is
+// what generate() would sample from the target model with the same
+// GenerationConfig.
+std::vector<int> speculative_generate(
+    Model &model,
+    Model &draft_model,
+    const std::vector<int> &prompt,
+    const GenerationConfig &config = GenerationConfig(),
+    int num_draft = 4,
+    const TokenCallback &callback = nullptr,
+    GenerationStats *stats = nullptr)
+{
+    if (prompt.empty())
+    {
+        throw std::invalid_argument("Prompt must contain at least one token");
+    }
+    if (num_draft < 1)
+    {
+        throw std::invalid_argument("num_draft must be at least 1");
+    }
+    if (!config.adapter.empty())
+    {
+        throw std::invalid_argument("speculative_generate() runs the base model; serve adapters through a Scheduler");
+    }
+
+    if (config.grammar)
+    {
+        throw std::invalid_argument("speculative_generate() does not support grammars");
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+
+    nn::KVCacheList cache = model.make_cache();
+    nn::KVCacheList draft_cache = draft_model.make_cache();
+    std::vector<int> tokens{};
+    int draft_tokens = 0, accepted_tokens = 0;
+
+    // Both models sample through the same Sampler and parameters, so draft
+    // and target distributions are comparable, and every random draw comes
+    // from the caller's seed when there is one
+    Sampler sampler;
+    SamplingParams sampling = config.sampling();
+    std::optional<array> key = std::nullopt;
+    if (config.seed)
+    {
+        key = random::key(*config.seed);
+    }
+    auto next_key = [&]() -> std::optional<array>
+    {
+        if (!key)
+        {
+            return std::nullopt;
+        }
+        auto [k, sub] = random::split(*key, nn::current_stream());
+        key = k;
+        return sub;
+    };
+    // Penalty windows, one row for each i in [from, to): the prompt and
+    // emitted tokens followed by the first i drafts
+    std::vector<int> context = prompt;
+    auto history = [&](const std::vector<int> &drafts, int from, int to) -> std::optional<array>
+    {
+        if (!sampling.penalized())
+        {
+            return std::nullopt;
+        }
+        int n = to - from;
+        std::vector<std::vector<int>> rows(n, context);
+        for (int i = 0; i < n; i++)
+        {
+            rows[i].insert(rows[i].end(), drafts.begin(), drafts.begin() + from + i);
+        }
+        std::vector<const std::vector<int> *> ptrs{};
+        for (auto &r : rows)
+        {
+            ptrs.push_back(&r);
+        }
+        return Sampler::history(ptrs, std::vector<SamplingParams>(n, sampling));
+    };
+
+    auto emit = [&](int token)
+    {
+        const auto &stop = config.stop_tokens;
+        if (std::find(stop.begin(), stop.end(), token) != stop.end())
+        {
+            return false;
+        }
+        tokens.push_back(token);
+        context.push_back(token);
+        if (callback && !callback(token))
+        {
+            return false;
+        }
+        return int(tokens.size()) < config.max_tokens;
+    };
+
+    // Prefill both models; only the target's logits are sampled
+    array logits = prefill(model, prompt, 0, cache, config.prefill_chunk_size);
+    array y = sampler.sample(logits, {sampling}, history({}, 0, 1), next_key()).tokens;
+    array draft_out = prefill(draft_model, prompt, 0, draft_cache, config.prefill_chunk_size);
+    eval(y, draft_out);
+    auto first_token = clock::now();
+
+    int last = y.item<int>();
+    bool running = config.max_tokens > 0 && emit(last);
+    // Tokens the draft model has not consumed yet
+    std::vector<int> draft_pending{last};
+
+    while (running)
+    {
+        int k = std::min(num_draft, config.max_tokens - int(tokens.size()));
+
+        // Draft k tokens autoregressively, keeping each step's distribution
+        std::vector<int> drafts{};
+        std::vector<array> draft_logprobs{};
+        array dx = array(draft_pending.begin(), {1, int(draft_pending.size())}, int32);
+        for (int i = 0; i < k; i++)
+        {
+            array q = sampler.distribution(
+                last_token_logits(draft_model.forward(dx, &draft_cache)), {sampling}, history(drafts, i, i + 1));
+            array d = random::categorical(q, -1, next_key());
+            draft_logprobs.push_back(q);
+            eval(d);
+            drafts.push_back(d.item<int>());
+            dx = reshape(d, {1, 1});
+        }
+        draft_tokens += k;
+
+        // Verify: the target scores the last token and all drafts at once
+        std::vector<int> verify{last};
+        verify.insert(verify.end(), drafts.begin(), drafts.end());
+        array target = model.forward(array(verify.begin(), {1, k + 1}, int32), &cache);
+        int V = target.shape(-1);
+        array p = sampler.distribution(
+            reshape(target, {k + 1, V}), std::vector<SamplingParams>(k + 1, sampling), history(drafts, 0, k + 1));
+        array q = concatenate(draft_logprobs, 0);
+
+        // Keep draft i with probability min(1, p/q); greedy distributions
+        // put all their mass on one token, so this accepts exactly the
+        // drafts that match the target's argmax
+        array idx = array(drafts.begin(), {k, 1}, int32);
+        array p_d = exp(reshape(take_along_axis(slice(p, {0, 0}, {k, V}), idx, 1), {k}));
+        array q_d = exp(reshape(take_along_axis(q, idx, 1), {k}));
+        array accept = less(multiply(random::uniform({k}, float32, next_key()), q_d), p_d);
+        eval(accept);
+        const bool *a = accept.data<bool>();
+        int n = 0;
+        while (n < k && a[n])
+        {
+            n++;
+        }
+        // On rejection resample from the residual max(p - q, 0), or from p
+        // where rounding left the residual no mass; if everything was
+        // accepted take a bonus token from p
+        array row = slice(p, {n, 0}, {n + 1, V});
+        if (n < k)
+        {
+            array p_row = exp(row);
+            array residual = maximum(subtract(p_row, exp(slice(q, {n, 0}, {n + 1, V}))), array(0.0f));
+            row = log(where(greater(sum(residual), array(0.0f)), residual, p_row));
+        }
+        array t = random::categorical(row, -1, next_key());
+        eval(t);
+        int next = t.item<int>();
+        accepted_tokens += n;
+
+        // Roll back what was not accepted. The target consumed
+        // last + k drafts; the draft consumed its pending tokens + k - 1 drafts.
+        for (auto &c : cache)
+        {
+            c->trim(k - n);
+        }
+        if (n < k)
+        {
+            for (auto &c : draft_cache)
+            {
+                c->trim(k - 1 - n);
+            }
+            draft_pending = {next};
+        }
+        else
+        {
+            draft_pending = {drafts[k - 1], next};
+        }
+
+        for (int i = 0; i < n && running; i++)
+        {
+            running = emit(drafts[i]);
+        }
+        if (running)
+        {
+            running = emit(next);
+        }
+        last = next;
+    }
+
+    if (stats != nullptr)
+    {
+        stats->prompt_tokens = prompt.size();
+        stats->generated_tokens = tokens.size();
+        stats->draft_tokens = draft_tokens;
+        stats->accepted_tokens = accepted_tokens;
+        stats->ttft_ms = std::chrono::duration<double, std::milli>(first_token - start).count();
+        stats->decode_ms = std::chrono::duration<double, std::milli>(clock::now() - first_token).count();
+    }
+    return tokens;
+}
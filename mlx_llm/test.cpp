@@ -9,6 +9,7 @@
 #include "mlx/mlx.h"
 #include "utils.cpp"
 #include "common.cpp"
+#include "trace.cpp"
 
 namespace mlx::core::nn{
 
@@ -17,6 +18,7 @@ class LinearLayer : public Module
 public:
     int input_dim, output_dim;
     bool with_bias = true;
+    int group_size = 0, bits = 0; // set once the weight is quantized
 
     LinearLayer() = default;
     LinearLayer(const LinearLayer &) = default;
@@ -34,18 +36,70 @@ public:
 
     ~LinearLayer() = default;
 
+    bool to_quantized(int _group_size, int _bits) override
+    {
+        if (bits || input_dim % _group_size != 0)
+        {
+            return false;
+        }
+        auto [w, scales, biases] = mlx::core::quantize(
+            transpose(parameters.at("weight"), {1, 0}), _group_size, _bits);
+        eval(w, scales, biases);
+        return load_quantized(w, scales, biases, _group_size, _bits);
+    }
+
+    bool load_quantized(
+        const array &w,
+        const array &scales,
+        const array &biases,
+        int _group_size,
+        int _bits) override
+    {
+        if (!can_load_quantized(w, scales, biases, _group_size, _bits))
+        {
+            return false;
+        }
+        register_parameter("weight", w);
+        register_parameter("scales", scales);
+        register_parameter("biases", biases);
+        group_size = _group_size;
+        bits = _bits;
+        return true;
+    }
+
+    bool can_load_quantized(
+        const array &w,
+        const array &scales,
+        const array & /*biases*/,
+        int _group_size,
+        int /*_bits*/) const override
+    {
+        // Packed as [out, in * bits / 32] with per-group scales and biases
+        return w.shape(0) == output_dim && scales.shape(-1) * _group_size == input_dim;
+    }
+
+    std::pair<int, int> quantization() const override
+    {
+        return {group_size, bits};
+    }
+
     array forward(const array &input) override
     {
+        ForwardScope scope(*this, input);
         // Check if input size matches number of weights in first layer
-        if (input.shape(-1) != parameters.at("weight").shape(0))
+        if (input.shape(-1) != input_dim)
         {
             throw std::invalid_argument(
                 "Input size doesn't match weight vector size");
         }
         // Allocate space for the outputs
-        array outputs = matmul(input, parameters.at("weight"));
+        array outputs = bits
+                            ? quantized_matmul(
+                                  input, parameters.at("weight"), parameters.at("scales"),
+                                  parameters.at("biases"), true, group_size, bits)
+                            : matmul(input, parameters.at("weight"));
 
-        return with_bias ? (outputs + parameters.at("bias")) : outputs;
+        return scope.done(with_bias ? (outputs + parameters.at("bias")) : outputs);
     }
 };
 
@@ -73,6 +127,7 @@ public:
 
     array forward(const array &input) override
     {
+        ForwardScope scope(*this, input);
         // Check if input size matches number of weights in first layer
         if (input.shape(-1) != parameters.at("weight").shape(0))
         {
@@ -82,7 +137,7 @@ public:
         // Allocate space for the outputs
         array outputs = matmul(input, parameters.at("weight"));
 
-        return with_bias ? (outputs + parameters.at("bias")) : outputs;
+        return scope.done(with_bias ? (outputs + parameters.at("bias")) : outputs);
     }
 };
 
@@ -113,6 +168,7 @@ public:
 
     array forward(const array &input) override
     {
+        ForwardScope scope(*this, input);
         // Check if input size matches number of weights in first layer
         if (input.shape(-1) != parameters.at("weight").shape(0))
         {
@@ -123,7 +179,7 @@ public:
         array outputs = matmul(input, parameters.at("weight"));
 
         auto y = with_bias ? (outputs + parameters.at("bias")) : outputs;
-        return l1->forward(y);
+        return scope.done(l1->forward(y));
     }
 };
 class TestModel : public Module
@@ -151,12 +207,13 @@ public:
     }
     array forward(const array &x) override
     {
+        ForwardScope scope(*this, x);
         auto y = fc2->forward(fc1->forward(x));
         for (auto &l : layers)
         {
             y = l->forward(y);
         }
-        return y;
+        return scope.done(y);
     }
 };
 } // namespace mlx::core::nn
@@ -0,0 +1,78 @@
+// Minimal assertions shared by the mlx_llm.cpp tests
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+inline int check_failures = 0;
+
+template <typename T>
+std::string show(const T &v)
+{
+    std::ostringstream out;
+    out << v;
+    return out.str();
+}
+
+template <typename T>
+std::string show(const std::vector<T> &v)
+{
+    std::string out = "{";
+    for (size_t i = 0; i < v.size(); i++)
+    {
+        out += (i ? ", " : "") + show(v[i]);
+    }
+    return out + "}";
+}
+
+inline void check_failed(const char *file, int line, const std::string &message)
+{
+    std::cerr << file << ":" << line << ": " << message << "\n";
+    check_failures++;
+}
+
+// Records a failure and carries on, so one run reports every broken case
+#define CHECK(cond)                                                    \
+    do                                                                 \
+    {                                                                  \
+        if (!(cond))                                                   \
+            check_failed(__FILE__, __LINE__, "check failed: " #cond); \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                                        \
+    do                                                                                                        \
+    {                                                                                                         \
+        auto _a = (a);                                                                                        \
+        auto _b = (b);                                                                                        \
+        if (!(_a == _b))                                                                                      \
+            check_failed(__FILE__, __LINE__, std::string(#a " == " #b ": ") + show(_a) + " vs " + show(_b)); \
+    } while (0)
+
+#define CHECK_THROWS(expr)                                                           \
+    do                                                                               \
+    {                                                                                \
+        bool _thrown = false;                                                        \
+        try                                                                          \
+        {                                                                            \
+            (void)(expr);                                                            \
+        }                                                                            \
+        catch (const std::exception &)                                               \
+        {                                                                            \
+            _thrown = true;                                                          \
+        }                                                                            \
+        if (!_thrown)                                                                \
+            check_failed(__FILE__, __LINE__, "expected an exception from: " #expr); \
+    } while (0)
+
+inline int check_report(const char *name)
+{
+    if (check_failures)
+    {
+        std::cerr << name << ": " << check_failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << name << ": all checks passed\n";
+    return 0;
+}
@@ -0,0 +1,115 @@
+# Regenerates the fixture tokenizers and the ids test_tokenizer.cpp expects.
+# Requires the HF `tokenizers` package: python make_tokenizers.py
+import json
+import os
+
+from tokenizers import Regex, Tokenizer, decoders, models, normalizers, pre_tokenizers, processors, trainers
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+CORPUS = [
+    "The quick brown fox jumps over the lazy dog.",
+    "It's what we'll do, isn't it? They've said I'm sure you'd agree.",
+    "Numbers like 12345 and 2024-10-17 or 3.14159 appear in text.",
+    "def main():\n    return 0\n\n\nfoo = bar  # comment",
+    "Café naïve résumé, 中文 text, and more words for merges.",
+    "\u201cQuoted.\u201d \u2014 it\u2019s x\u00b2, 10\u00b2\u00a0m\u00b2, \u4e2d\u6587\u3002\u300c\u5f15\u7528\u300d\u3001",
+] * 20
+
+SAMPLES = [
+    "Hello world",
+    "The lazy dog's fox jumps.",
+    "\n\nfoo",
+    "a  b   c \n",
+    "It's I'M we'll they've",
+    "12345 3.14159",
+    "Café résumé 中文",
+    "def f():\n\treturn 42\n",
+    "日本 🙂",
+    "\u201cQuoted.\u201d \u2014 it\u2019s fine",
+    "a\u00a0b\u00a0 c\u00a0\u00a0d",
+    "中文。「引用」、終わり",
+    "x² + 10² ٣٤٥ quick zyxw",
+    "<|endoftext|>done</s>",
+]
+
+
+def train(tokenizer, specials, vocab_size=320):
+    trainer = trainers.BpeTrainer(
+        vocab_size=vocab_size,
+        special_tokens=specials,
+        initial_alphabet=pre_tokenizers.ByteLevel.alphabet() if specials[0].startswith("<|") else [],
+        show_progress=False,
+    )
+    tokenizer.train_from_iterator(CORPUS, trainer)
+    return tokenizer
+
+
+def gpt2():
+    tok = Tokenizer(models.BPE())
+    tok.pre_tokenizer = pre_tokenizers.ByteLevel(add_prefix_space=False)
+    tok.decoder = decoders.ByteLevel()
+    return train(tok, ["<|endoftext|>"])
+
+
+def llama3():
+    pattern = (
+        "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| "
+        "?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
+    )
+    tok = Tokenizer(models.BPE())
+    tok.pre_tokenizer = pre_tokenizers.Sequence(
+        [
+            pre_tokenizers.Split(Regex(pattern), behavior="isolated"),
+            pre_tokenizers.ByteLevel(add_prefix_space=False, use_regex=False),
+        ]
+    )
+    tok.decoder = decoders.ByteLevel()
+    train(tok, ["<|begin_of_text|>", "<|end_of_text|>"])
+    tok.post_processor = processors.TemplateProcessing(
+        single="<|begin_of_text|> $A",
+        special_tokens=[("<|begin_of_text|>", tok.token_to_id("<|begin_of_text|>"))],
+    )
+    # Llama 3 looks whole words up before merging: give one word a vocab
+    # entry no merge reaches
+    config = json.loads(tok.to_str())
+    config["model"]["ignore_merges"] = True
+    config["model"]["vocab"]["\u0120zyxw"] = len(config["model"]["vocab"])
+    return Tokenizer.from_str(json.dumps(config))
+
+
+def sentencepiece():
+    # Llama 2 layout: "▁" normalization and <0xXX> byte fallback
+    tok = Tokenizer(models.BPE(unk_token="<unk>", byte_fallback=True))
+    tok.normalizer = normalizers.Sequence([normalizers.Prepend("▁"), normalizers.Replace(" ", "▁")])
+    tok.decoder = decoders.Sequence(
+        [decoders.Replace("▁", " "), decoders.ByteFallback(), decoders.Fuse(), decoders.Strip(" ", 1, 0)]
+    )
+    specials = ["<unk>", "<s>", "</s>"] + ["<0x%02X>" % b for b in range(256)]
+    train(tok, specials, vocab_size=400)
+    tok.post_processor = processors.TemplateProcessing(
+        single="<s> $A", special_tokens=[("<s>", tok.token_to_id("<s>"))]
+    )
+    # Byte tokens are ordinary vocab entries in Llama 2, not added tokens
+    config = json.loads(tok.to_str())
+    config["added_tokens"] = [t for t in config["added_tokens"] if not t["content"].startswith("<0x")]
+    return Tokenizer.from_str(json.dumps(config))
+
+
+def main():
+    expected = {}
+    for name, make in [("gpt2", gpt2), ("llama3", llama3), ("sentencepiece", sentencepiece)]:
+        tok = make()
+        tok.save(os.path.join(HERE, name + "_tokenizer.json"), pretty=False)
+        expected[name] = [tok.encode(s).ids for s in SAMPLES]
+        for s, ids in zip(SAMPLES, expected[name]):
+            if tok.decode(ids) != s:
+                print("decode mismatch", name, json.dumps(s), json.dumps(tok.decode(ids)))
+    for name, rows in expected.items():
+        print(name)
+        for ids in rows:
+            print("    {" + ", ".join(map(str, ids)) + "},")
+
+
+if __name__ == "__main__":
+    main()
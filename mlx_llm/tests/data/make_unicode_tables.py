@@ -0,0 +1,95 @@
+# Regenerates mlx_llm/unicode.cpp: the \p{L}, \p{N} and \s classes exactly
+# as the regex engine of HF `tokenizers` matches them, so the tokenizer's
+# word splits agree with HF's. Requires the HF `tokenizers` package:
+# python make_unicode_tables.py
+import os
+
+from tokenizers import Regex, pre_tokenizers
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+OUT = os.path.join(HERE, "..", "..", "unicode.cpp")
+
+
+def members(pattern):
+    # Code points a one-character class pattern removes from the text
+    split = pre_tokenizers.Split(Regex(pattern), behavior="removed")
+    out = []
+    chunk = 4096
+    for base in range(0, 0x110000, chunk):
+        cps = [c for c in range(base, min(base + chunk, 0x110000)) if not 0xD800 <= c <= 0xDFFF]
+        kept = set()
+        for _, (start, end) in split.pre_tokenize_str("".join(map(chr, cps))):
+            kept.update(range(start, end))
+        out += [c for k, c in enumerate(cps) if k not in kept]
+    return out
+
+
+def ranges(cps):
+    out = []
+    for c in cps:
+        if out and out[-1][1] == c - 1:
+            out[-1][1] = c
+        else:
+            out.append([c, c])
+    return out
+
+
+def table(name, cps):
+    rows = ["{0x%04X, 0x%04X}" % (lo, hi) for lo, hi in ranges(cps)]
+    lines = ["    " + ", ".join(rows[i : i + 6]) + "," for i in range(0, len(rows), 6)]
+    return "inline constexpr UnicodeRange %s[] = {\n%s\n};\n" % (name, "\n".join(lines))
+
+
+def main():
+    with open(OUT, "w") as f:
+        f.write(
+            "// Unicode character classes for the tokenizer's word splits\n"
+            "// Generated by tests/data/make_unicode_tables.py, do not edit\n"
+            "#pragma once\n\n"
+            "#include <algorithm>\n"
+            "#include <cstddef>\n"
+            "#include <cstdint>\n"
+            "#include <iterator>\n\n"
+            "// Inclusive code point range\n"
+            "struct UnicodeRange\n{\n    uint32_t first, last;\n};\n\n"
+            "// \\p{L} as HF tokenizers' regex engine matches it\n"
+        )
+        f.write(table("unicode_letters", members("\\p{L}")))
+        f.write("\n// \\p{N}\n")
+        f.write(table("unicode_numbers", members("\\p{N}")))
+        f.write("\n// \\s\n")
+        f.write(table("unicode_spaces", members("\\s")))
+        f.write(
+            "\n"
+            "template <size_t N>\n"
+            "bool in_unicode_ranges(const UnicodeRange (&ranges)[N], uint32_t cp)\n"
+            "{\n"
+            "    auto it = std::upper_bound(std::begin(ranges), std::end(ranges), cp, [](uint32_t c, const UnicodeRange &r)\n"
+            "                               { return c < r.first; });\n"
+            "    return it != std::begin(ranges) && cp <= std::prev(it)->last;\n"
+            "}\n\n"
+            "inline bool is_unicode_letter(uint32_t cp)\n"
+            "{\n"
+            "    if (cp < 0x80)\n"
+            "    {\n"
+            "        return (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z');\n"
+            "    }\n"
+            "    return in_unicode_ranges(unicode_letters, cp);\n"
+            "}\n\n"
+            "inline bool is_unicode_number(uint32_t cp)\n"
+            "{\n"
+            "    if (cp < 0x80)\n"
+            "    {\n"
+            "        return cp >= '0' && cp <= '9';\n"
+            "    }\n"
+            "    return in_unicode_ranges(unicode_numbers, cp);\n"
+            "}\n\n"
+            "inline bool is_unicode_space(uint32_t cp)\n"
+            "{\n"
+            "    return in_unicode_ranges(unicode_spaces, cp);\n"
+            "}\n"
+        )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,70 @@
+// Compiled mode tests: decode steps through compiled blocks give the logits
+// of the uncompiled forward, for dense and quantized weights, traditional
+// RoPE and a rotating cache
+#include <algorithm>
+#include <vector>
+#include "mlx/mlx.h"
+#include "mlx_llm/phi3.cpp"
+#include "check.cpp"
+
+using namespace mlx::core;
+
+// max |a - b| relative to max |b|
+float relative_error(const array &a, const array &b)
+{
+    float diff = max(abs(subtract(a, b))).item<float>();
+    return diff / std::max(max(abs(b)).item<float>(), 1e-6f);
+}
+
+Model tiny_model(bool traditional = false)
+{
+    PhiModelConfig config;
+    config.model_type = "phi3";
+    config.num_hidden_layers = 2;
+    config.vocab_size = 64;
+    config.hidden_size = 32;
+    config.intermediate_size = 64;
+    config.num_attention_heads = 4;
+    config.num_key_value_heads = 2;
+    config.rope_traditional = traditional;
+    random::seed(0);
+    return Model(config);
+}
+
+// Prefills the same prompt into two caches, then decodes the same tokens
+// with compiled mode off and on
+void check_decode(Model &model, int max_kv_size = 0)
+{
+    std::vector<int> prompt = {1, 2, 3, 4, 5, 6};
+    nn::KVCacheList plain = model.make_cache(max_kv_size, 2), compiled = model.make_cache(max_kv_size, 2);
+    array tokens = array(prompt.begin(), {1, int(prompt.size())}, int32);
+    model.set_compiled(false);
+    eval(model.forward_last(tokens, &plain), model.forward_last(tokens, &compiled));
+
+    for (int token : {7, 8, 9, 10, 11})
+    {
+        array step = array({token}, {1, 1});
+        model.set_compiled(false);
+        array expected = model.forward_last(step, &plain);
+        model.set_compiled(true);
+        array got = model.forward_last(step, &compiled);
+        CHECK_EQ(got.shape(), expected.shape());
+        CHECK(relative_error(got, expected) < 1e-3);
+    }
+    model.set_compiled(false);
+}
+
+int main()
+{
+    Model dense = tiny_model();
+    check_decode(dense);
+    check_decode(dense, 8);
+
+    Model traditional = tiny_model(true);
+    check_decode(traditional);
+
+    Model quantized = tiny_model();
+    CHECK(quantized.quantize(4, 32) > 0);
+    check_decode(quantized);
+    return check_report("test_compiled");
+}
@@ -0,0 +1,208 @@
+// Grammar tests: GBNF parsing, byte-level acceptance, token masks and
+// JSON schema conversion, over the GPT-2 fixture tokenizer (its byte
+// tokens let any text through, so acceptance is decided by the grammar)
+#include <string>
+#include <vector>
+#include "mlx/mlx.h"
+#include "mlx_llm/grammar.cpp"
+#include "check.cpp"
+
+using namespace mlx::core;
+
+// Whether the grammar takes `text` token by token and, with `whole`, is
+// complete after it
+bool accepts(const Grammar &grammar, const Tokenizer &tokenizer, const std::string &text, bool whole = true)
+{
+    Grammar::State state = grammar.initial();
+    try
+    {
+        for (int id : tokenizer.encode(text, false))
+        {
+            state = grammar.accept(state, id);
+        }
+    }
+    catch (const std::invalid_argument &)
+    {
+        return false;
+    }
+    return !whole || grammar.complete(state);
+}
+
+bool schema_accepts(const std::string &schema, const Tokenizer &tokenizer, const std::string &text)
+{
+    auto grammar = Grammar::from_json_schema(nn::parse_json(schema), tokenizer);
+    return accepts(*grammar, tokenizer, text);
+}
+
+void check_grammars(const Tokenizer &tokenizer)
+{
+    Grammar choice("root ::= \"yes\" | \"no\"", tokenizer);
+    CHECK(accepts(choice, tokenizer, "yes"));
+    CHECK(accepts(choice, tokenizer, "no"));
+    CHECK(accepts(choice, tokenizer, "ye", false));
+    CHECK(!accepts(choice, tokenizer, "ye"));
+    CHECK(!accepts(choice, tokenizer, "yess", false));
+    CHECK(!accepts(choice, tokenizer, "maybe", false));
+
+    Grammar list("root ::= \"[\" item (\",\" item)* \"]\"\n"
+                 "item ::= [0-9]+ | \"null\" # a comment\n",
+                 tokenizer);
+    CHECK(accepts(list, tokenizer, "[1]"));
+    CHECK(accepts(list, tokenizer, "[1,22,null,333]"));
+    CHECK(!accepts(list, tokenizer, "[]"));
+    CHECK(!accepts(list, tokenizer, "[1,]"));
+    CHECK(!accepts(list, tokenizer, "[nul]"));
+
+    Grammar classes("root ::= [^a-z]+ [a-c]? (\"x\" | [yz])*", tokenizer);
+    CHECK(accepts(classes, tokenizer, "ABC 12"));
+    CHECK(accepts(classes, tokenizer, "Q\xC3\xA9" "bxyzz"));
+    CHECK(!accepts(classes, tokenizer, "ad"));
+    CHECK(!accepts(classes, tokenizer, "b"));
+
+    Grammar utf8("root ::= \"caf\xC3\xA9\" \"!\"?", tokenizer);
+    CHECK(accepts(utf8, tokenizer, "caf\xC3\xA9"));
+    CHECK(accepts(utf8, tokenizer, "caf\xC3\xA9!"));
+    CHECK(!accepts(utf8, tokenizer, "cafe"));
+
+    // Right recursion stays flat however long the input
+    Grammar digits("root ::= \"[\" xs \"]\"\nxs ::= [0-9] xs |\n", tokenizer);
+    Grammar::State state = digits.initial();
+    state = digits.accept(state, tokenizer.encode("[", false)[0]);
+    size_t depth = 0;
+    int seven = tokenizer.encode("7", false)[0];
+    for (int i = 0; i < 500; i++)
+    {
+        state = digits.accept(state, seven);
+        for (auto &stack : state)
+        {
+            depth = std::max(depth, stack.size());
+        }
+    }
+    CHECK(depth <= 2);
+    state = digits.accept(state, tokenizer.encode("]", false)[0]);
+    CHECK(digits.complete(state));
+
+    // The end token is only taken once the grammar is complete
+    int eos = tokenizer.eos_id;
+    CHECK(eos >= 0);
+    Grammar::State done = choice.accept(choice.accept(choice.initial(), tokenizer.encode("n", false)[0]),
+                                        tokenizer.encode("o", false)[0]);
+    CHECK(choice.complete(done));
+    CHECK(choice.accept(done, eos) == done);
+    CHECK_THROWS(choice.accept(choice.initial(), eos));
+    // A grammar that could never end is refused up front
+    CHECK_THROWS(Grammar("root ::= \"a\"", tokenizer, 0, {-1}));
+    CHECK_THROWS(Grammar("root ::= \"a\"", tokenizer, 0, {tokenizer.vocab_size()}));
+
+    CHECK_THROWS(Grammar("root ::= foo", tokenizer));
+    CHECK_THROWS(Grammar("root ::= \"open", tokenizer));
+    CHECK_THROWS(Grammar("root ::= [a-", tokenizer));
+    CHECK_THROWS(Grammar("root ::= (\"a\"", tokenizer));
+    CHECK_THROWS(Grammar("root ::= root \"a\" | \"b\"", tokenizer).initial());
+}
+
+void check_schemas(const Tokenizer &tokenizer)
+{
+    // Properties come in key order; `name` is required
+    const std::string person = R"({
+        "type": "object",
+        "properties": {
+            "name": {"type": "string"},
+            "age": {"type": "integer"},
+            "tags": {"type": "array", "items": {"enum": ["a", "b"]}}
+        },
+        "required": ["name"]
+    })";
+    CHECK(schema_accepts(person, tokenizer, R"({"name": "Bob"})"));
+    CHECK(schema_accepts(person, tokenizer, R"({"age": 42, "name": "Bob", "tags": ["a", "b"]})"));
+    CHECK(schema_accepts(person, tokenizer, " {\"name\":\"x\\\"y\\u00e9\",\n  \"tags\": []} "));
+    CHECK(!schema_accepts(person, tokenizer, R"({"age": 42})"));
+    CHECK(!schema_accepts(person, tokenizer, R"({"name": 1})"));
+    CHECK(!schema_accepts(person, tokenizer, R"({"name": "Bob", "age": 42})"));
+    CHECK(!schema_accepts(person, tokenizer, R"({"name": "Bob", "tags": ["c"]})"));
+    CHECK(!schema_accepts(person, tokenizer, R"({"name": "Bob",})"));
+    CHECK(!schema_accepts(person, tokenizer, R"({"age": 04, "name": "x"})"));
+    CHECK(!schema_accepts(person, tokenizer, R"({"name": "Bob"} x)"));
+
+    // Nothing required: any in-order subset, including none
+    const std::string optional = R"({"type": "object", "properties": {"a": {"type": "boolean"}, "b": {"type": "null"}}})";
+    CHECK(schema_accepts(optional, tokenizer, "{}"));
+    CHECK(schema_accepts(optional, tokenizer, R"({"b": null})"));
+    CHECK(schema_accepts(optional, tokenizer, R"({"a": true, "b": null})"));
+    CHECK(!schema_accepts(optional, tokenizer, R"({"b": null, "a": true})"));
+    CHECK(!schema_accepts(optional, tokenizer, "{,}"));
+
+    const std::string any = R"({"anyOf": [{"const": "x"}, {"type": ["number", "null"]}]})";
+    CHECK(schema_accepts(any, tokenizer, "\"x\""));
+    CHECK(schema_accepts(any, tokenizer, "-1.5e3"));
+    CHECK(schema_accepts(any, tokenizer, "0"));
+    CHECK(schema_accepts(any, tokenizer, "null"));
+    CHECK(!schema_accepts(any, tokenizer, "\"y\""));
+    CHECK(!schema_accepts(any, tokenizer, "true"));
+    CHECK(!schema_accepts(any, tokenizer, "01"));
+    CHECK(!schema_accepts(any, tokenizer, "1."));
+
+    // No type: any JSON value
+    CHECK(schema_accepts("{}", tokenizer, R"([1, {"k": [true, null]}, "s"])"));
+    CHECK(!schema_accepts("{}", tokenizer, "[1 2]"));
+}
+
+// Ids set in the grammar's [vocab] mask
+std::vector<int> allowed_tokens(Grammar &grammar, const Grammar::State &state)
+{
+    array allowed = grammar.allowed(state);
+    eval(allowed);
+    std::vector<int> ids{};
+    for (size_t i = 0; i < allowed.size(); i++)
+    {
+        if (allowed.data<bool>()[i])
+        {
+            ids.push_back(i);
+        }
+    }
+    return ids;
+}
+
+void check_masks(const Tokenizer &tokenizer)
+{
+    // Allowed: every token whose bytes start "yes" or "no"
+    Grammar choice("root ::= \"yes\" | \"no\"", tokenizer);
+    std::vector<int> expected{};
+    for (int id = 0; id < tokenizer.vocab_size(); id++)
+    {
+        std::string bytes = tokenizer.is_special(id) ? "" : tokenizer.token_bytes(id);
+        if (!bytes.empty() && (std::string("yes").compare(0, bytes.size(), bytes) == 0 ||
+                               std::string("no").compare(0, bytes.size(), bytes) == 0))
+        {
+            expected.push_back(id);
+        }
+    }
+    CHECK(!expected.empty());
+    CHECK_EQ(allowed_tokens(choice, choice.initial()), expected);
+    // Again, from the cache
+    CHECK_EQ(allowed_tokens(choice, choice.initial()), expected);
+
+    Grammar::State done = choice.initial();
+    for (int id : tokenizer.encode("yes", false))
+    {
+        done = choice.accept(done, id);
+    }
+    CHECK_EQ(allowed_tokens(choice, done), std::vector<int>{tokenizer.eos_id});
+
+    // A logit width past the tokenizer's leaves the padding disallowed
+    Grammar wide("root ::= [a-z]*", tokenizer, tokenizer.vocab_size() + 40);
+    array allowed = wide.allowed(wide.initial());
+    CHECK_EQ(allowed.shape(0), tokenizer.vocab_size() + 40);
+    std::vector<int> ids = allowed_tokens(wide, wide.initial());
+    CHECK(!ids.empty() && ids.back() < tokenizer.vocab_size());
+}
+
+int main(int argc, char *argv[])
+{
+    std::string data = argc > 1 ? argv[1] : "mlx_llm/tests/data";
+    Tokenizer tokenizer(data + "/gpt2_tokenizer.json");
+    check_grammars(tokenizer);
+    check_schemas(tokenizer);
+    check_masks(tokenizer);
+    return check_report("test_grammar");
+}
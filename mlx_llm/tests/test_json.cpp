@@ -0,0 +1,78 @@
+// JSON reader tests: values, escapes, nesting and malformed input
+#include <string>
+#include "mlx_llm/json.cpp"
+#include "check.cpp"
+
+using mlx::core::nn::JsonValue;
+using mlx::core::nn::parse_json;
+
+int main(int argc, char *argv[])
+{
+    std::string data = argc > 1 ? argv[1] : "mlx_llm/tests/data";
+
+    // Scalars
+    CHECK(parse_json("null").is_null());
+    CHECK(parse_json(" true ").boolean);
+    CHECK(!parse_json("false").boolean);
+    CHECK(parse_json("false").type == JsonValue::Type::Bool);
+    CHECK_EQ(parse_json("42").as_int(), 42);
+    CHECK_EQ(parse_json("-0.5").number, -0.5);
+    CHECK_EQ(parse_json("1e-3").number, 1e-3);
+    CHECK_EQ(parse_json("2.5E+2").number, 250.0);
+
+    // Strings: escapes, \u escapes and surrogate pairs to UTF-8
+    CHECK_EQ(parse_json(R"("a\"b\\c\/d")").string, std::string("a\"b\\c/d"));
+    CHECK_EQ(parse_json(R"("\b\f\n\r\t")").string, std::string("\b\f\n\r\t"));
+    CHECK_EQ(parse_json(R"("\u0041\u00e9\u4e2d")").string, std::string("A\xC3\xA9\xE4\xB8\xAD"));
+    CHECK_EQ(parse_json(R"("\ud83d\ude42")").string, std::string("\xF0\x9F\x99\x82"));
+    CHECK_EQ(parse_json("\"caf\xC3\xA9\"").string, std::string("caf\xC3\xA9"));
+
+    // Containers
+    JsonValue v = parse_json(R"({
+        "name": "phi3",
+        "layers": [1, 2, {"deep": [[], {}]}],
+        "empty": {},
+        "flag": true
+    })");
+    CHECK(v.is_object());
+    CHECK_EQ(v.size(), size_t(4));
+    CHECK_EQ(v.at("name").string, std::string("phi3"));
+    CHECK(v.contains("empty") && v.at("empty").is_object() && v.at("empty").size() == 0);
+    CHECK(!v.contains("missing"));
+    const JsonValue &layers = v.at("layers");
+    CHECK(layers.is_array());
+    CHECK_EQ(layers.size(), size_t(3));
+    CHECK_EQ(layers.at(size_t(1)).as_int(), 2);
+    CHECK(layers.at(size_t(2)).at("deep").at(size_t(0)).is_array());
+    CHECK(layers.at(size_t(2)).at("deep").at(size_t(1)).is_object());
+    CHECK_THROWS(v.at("missing"));
+    CHECK_THROWS(layers.at(size_t(3)));
+    CHECK_THROWS(v.at(size_t(0)));
+
+    // Malformed input
+    for (const char *bad : {"", "   ", "{", "[1, 2", "{\"a\" 1}", "{\"a\": 1,}", "[1,]", "\"open",
+                            "\"\\q\"", "\"\\u12\"", "tru", "nul", "1 2", "{} x", "-", "@"})
+    {
+        bool thrown = false;
+        try
+        {
+            parse_json(bad);
+        }
+        catch (const std::exception &)
+        {
+            thrown = true;
+        }
+        if (!thrown)
+        {
+            check_failed(__FILE__, __LINE__, std::string("accepted malformed JSON: ") + bad);
+        }
+    }
+
+    // A real file: the fixture tokenizers are JSON too
+    JsonValue tokenizer = mlx::core::nn::load_json(data + "/gpt2_tokenizer.json");
+    CHECK_EQ(tokenizer.at("model").at("type").string, std::string("BPE"));
+    CHECK(tokenizer.at("model").at("vocab").size() > 256);
+    CHECK_THROWS(mlx::core::nn::load_json(data + "/missing.json"));
+
+    return check_report("test_json");
+}
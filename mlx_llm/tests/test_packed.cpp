@@ -0,0 +1,162 @@
+// Packing tests: pack / pack_sequences layout, the block-diagonal causal
+// mask, and packed forwards matching one forward per sequence
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "mlx/mlx.h"
+#include "mlx_llm/phi3.cpp"
+#include "check.cpp"
+
+using namespace mlx::core;
+
+std::vector<int> host_ints(array x)
+{
+    x = astype(x, int32);
+    eval(x);
+    return std::vector<int>(x.data<int>(), x.data<int>() + x.size());
+}
+
+// max |a - b| relative to max |b|
+float relative_error(const array &a, const array &b)
+{
+    float diff = max(abs(subtract(a, b))).item<float>();
+    return diff / std::max(max(abs(b)).item<float>(), 1e-6f);
+}
+
+void check_pack()
+{
+    PackedBatch batch = pack({{5, 6, 7}, {8}, {9, 10}});
+    CHECK_EQ(batch.size(), 3);
+    CHECK_EQ(batch.length(), 6);
+    CHECK_EQ(batch.offsets, (std::vector<int>{0, 3, 4, 6}));
+    CHECK_EQ(batch.indices, (std::vector<int>{0, 1, 2}));
+    CHECK_EQ(batch.tokens.shape(), (std::vector<int>{1, 6}));
+    CHECK_EQ(host_ints(batch.tokens), (std::vector<int>{5, 6, 7, 8, 9, 10}));
+    CHECK_EQ(host_ints(batch.positions), (std::vector<int>{0, 1, 2, 0, 0, 1}));
+    CHECK_EQ(host_ints(batch.segments), (std::vector<int>{0, 0, 0, 1, 2, 2}));
+
+    CHECK_THROWS(pack({}));
+    CHECK_THROWS(pack({{1}, {}}));
+}
+
+void check_pack_sequences()
+{
+    // Longest first into the first pack with room: the 8-token sequence,
+    // over the budget, alone, then 5+1, 4+2 and 3
+    std::vector<std::vector<int>> sequences = {
+        {1, 1, 1}, {2, 2, 2, 2, 2}, {3, 3}, {4, 4, 4, 4}, {5}, {6, 6, 6, 6, 6, 6, 6, 6}};
+    std::vector<PackedBatch> packs = pack_sequences(sequences, 6);
+    CHECK_EQ(packs.size(), size_t(4));
+    if (packs.size() != 4)
+    {
+        return;
+    }
+    CHECK_EQ(packs[0].indices, (std::vector<int>{5}));
+    CHECK_EQ(packs[1].indices, (std::vector<int>{1, 4}));
+    CHECK_EQ(packs[2].indices, (std::vector<int>{3, 2}));
+    CHECK_EQ(packs[3].indices, (std::vector<int>{0}));
+
+    std::vector<int> seen(sequences.size(), 0);
+    for (auto &p : packs)
+    {
+        CHECK(p.length() <= 6 || p.size() == 1);
+        std::vector<int> tokens = host_ints(p.tokens);
+        for (int i = 0; i < p.size(); i++)
+        {
+            int index = p.indices[i];
+            seen[index]++;
+            std::vector<int> member(tokens.begin() + p.offsets[i], tokens.begin() + p.offsets[i + 1]);
+            CHECK_EQ(member, sequences[index]);
+        }
+    }
+    CHECK_EQ(seen, std::vector<int>(sequences.size(), 1));
+}
+
+void check_mask()
+{
+    std::vector<int> segments = {0, 0, 1, 1, 1, 2};
+    int T = segments.size();
+    array mask = create_packed_causal_mask(array(segments.begin(), {T}, int32), float16);
+    CHECK_EQ(mask.dtype(), float16);
+    CHECK_EQ(mask.shape(), (std::vector<int>{T, T}));
+    mask = astype(mask, float32);
+    eval(mask);
+    for (int i = 0; i < T; i++)
+    {
+        for (int j = 0; j < T; j++)
+        {
+            bool visible = segments[i] == segments[j] && j <= i;
+            float m = mask.data<float>()[i * T + j];
+            if (visible ? m != 0 : m > -1e4)
+            {
+                check_failed(__FILE__, __LINE__, "mask[" + std::to_string(i) + "][" + std::to_string(j) + "] = " + show(m));
+            }
+        }
+    }
+}
+
+void check_forward()
+{
+    PhiModelConfig config;
+    config.model_type = "phi3";
+    config.num_hidden_layers = 2;
+    config.vocab_size = 64;
+    config.hidden_size = 32;
+    config.intermediate_size = 64;
+    config.num_attention_heads = 4;
+    config.num_key_value_heads = 2;
+    random::seed(0);
+    Model model(config);
+
+    std::vector<std::vector<int>> sequences = {{1, 2, 3, 4}, {5, 6}, {7, 8, 9}};
+    PackedBatch batch = pack(sequences);
+    array packed = model.forward_packed(batch);
+    int V = config.vocab_size;
+    CHECK_EQ(packed.shape(), (std::vector<int>{1, batch.length(), V}));
+
+    // Same logits as running each sequence on its own from position 0
+    std::vector<float> expected_scores{};
+    for (int i = 0; i < batch.size(); i++)
+    {
+        const std::vector<int> &seq = sequences[i];
+        int L = seq.size();
+        array alone = model.forward(array(seq.begin(), {1, L}, int32));
+        array part = slice(packed, {0, batch.offsets[i], 0}, {1, batch.offsets[i + 1], V});
+        CHECK(relative_error(part, alone) < 1e-3);
+
+        array logprobs = subtract(alone, logsumexp(alone, -1, true));
+        eval(logprobs);
+        float total = 0;
+        for (int t = 0; t + 1 < L; t++)
+        {
+            total += logprobs.data<float>()[t * V + seq[t + 1]];
+        }
+        expected_scores.push_back(total);
+    }
+
+    array scores = model.score(batch);
+    eval(scores);
+    for (int i = 0; i < batch.size(); i++)
+    {
+        float got = scores.data<float>()[i], expected = expected_scores[i];
+        CHECK(std::fabs(got - expected) <= 1e-3 * std::max(1.0f, std::fabs(expected)));
+    }
+
+    // Last-token pooling picks each sequence's final hidden state; mean
+    // pooling, normalized, has unit norm
+    array last = model.embed(batch, Pooling::Last, false);
+    CHECK(relative_error(last, astype(model.last_hidden(batch), float32)) < 1e-5);
+    array mean = model.embed(batch, Pooling::Mean, true);
+    CHECK_EQ(mean.shape(), (std::vector<int>{batch.size(), config.hidden_size}));
+    array norms = sqrt(sum(square(mean), 1));
+    CHECK(relative_error(norms, ones({batch.size()})) < 1e-4);
+}
+
+int main()
+{
+    check_pack();
+    check_pack_sequences();
+    check_mask();
+    check_forward();
+    return check_report("test_packed");
+}
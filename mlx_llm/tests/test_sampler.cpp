@@ -0,0 +1,208 @@
+// Sampler tests: greedy rows, temperature, min_p, top_k and top_p
+// truncation, per-row parameters, penalties, masks and log-probabilities
+#include <cmath>
+#include <set>
+#include <vector>
+#include "mlx/mlx.h"
+#include "mlx_llm/sampler.cpp"
+#include "check.cpp"
+
+using namespace mlx::core;
+
+// One row of next-token probabilities, most likely first
+const std::vector<float> probs = {0.4, 0.25, 0.15, 0.1, 0.06, 0.04};
+const int V = probs.size();
+
+bool close(float a, float b, float tol = 1e-4)
+{
+    return std::isinf(a) || std::isinf(b) ? a == b : std::fabs(a - b) <= tol;
+}
+
+// `rows` copies of log(probs) as [rows, V]
+array logits(int rows)
+{
+    std::vector<float> data{};
+    for (int b = 0; b < rows; b++)
+    {
+        for (float p : probs)
+        {
+            data.push_back(std::log(p));
+        }
+    }
+    return array(data.begin(), {rows, V}, float32);
+}
+
+std::vector<float> host_row(array x, int b)
+{
+    x = astype(x, float32);
+    eval(x);
+    int width = x.shape(1);
+    return std::vector<float>(x.data<float>() + b * width, x.data<float>() + (b + 1) * width);
+}
+
+std::vector<int> host_ids(array x)
+{
+    x = astype(x, int32);
+    eval(x);
+    return std::vector<int>(x.data<int>(), x.data<int>() + x.size());
+}
+
+// Probabilities row `b` of a distribution() result should match: `keep`
+// renormalized, everything else zero
+void check_distribution(const array &dist, int b, const std::vector<float> &keep)
+{
+    std::vector<float> row = host_row(dist, b);
+    float total = 0;
+    for (float p : keep)
+    {
+        total += p;
+    }
+    for (int v = 0; v < V; v++)
+    {
+        float expected = keep[v] / total, got = std::exp(row[v]);
+        if (!close(got, expected))
+        {
+            check_failed(__FILE__, __LINE__, "row " + std::to_string(b) + " token " + std::to_string(v) + ": " +
+                                                 show(got) + " vs " + show(expected));
+        }
+    }
+}
+
+void check_truncation()
+{
+    Sampler sampler;
+    SamplingParams greedy, top_k, top_p, tiny_p, min_p, hot;
+    top_k.temperature = top_p.temperature = tiny_p.temperature = min_p.temperature = 1;
+    top_k.top_k = 2;
+    top_p.top_p = 0.7; // mass before token 2 is 0.65, before token 3 0.8
+    tiny_p.top_p = 0.1;
+    min_p.min_p = 0.5; // floor 0.2
+    hot.temperature = 2;
+
+    // Every row keeps its own parameters within one batch
+    std::vector<SamplingParams> params = {greedy, top_k, top_p, tiny_p, min_p, hot};
+    array dist = sampler.distribution(logits(params.size()), params);
+    check_distribution(dist, 0, {1, 0, 0, 0, 0, 0});
+    check_distribution(dist, 1, {0.4, 0.25, 0, 0, 0, 0});
+    check_distribution(dist, 2, {0.4, 0.25, 0.15, 0, 0, 0});
+    check_distribution(dist, 3, {1, 0, 0, 0, 0, 0});
+    check_distribution(dist, 4, {0.4, 0.25, 0, 0, 0, 0});
+    std::vector<float> flattened{};
+    for (float p : probs)
+    {
+        flattened.push_back(std::sqrt(p));
+    }
+    check_distribution(dist, 5, flattened);
+
+    // top_k and top_p together: the smaller set wins
+    SamplingParams both = top_p;
+    both.top_k = 1;
+    check_distribution(sampler.distribution(logits(1), {both}), 0, {1, 0, 0, 0, 0, 0});
+
+    // All-greedy batches skip truncation
+    check_distribution(sampler.distribution(logits(2), {greedy, greedy}), 1, {1, 0, 0, 0, 0, 0});
+}
+
+void check_sampling()
+{
+    Sampler sampler;
+    const int rows = 512;
+    SamplingParams greedy, top_k;
+    top_k.temperature = 1;
+    top_k.top_k = 2;
+
+    std::vector<SamplingParams> params(rows, top_k);
+    params[0] = greedy;
+    array key = random::key(7);
+    std::vector<int> ids = host_ids(sampler.sample(logits(rows), params, std::nullopt, key).tokens);
+    CHECK_EQ(ids[0], 0);
+    std::set<int> seen(ids.begin() + 1, ids.end());
+    CHECK_EQ(std::vector<int>(seen.begin(), seen.end()), (std::vector<int>{0, 1}));
+
+    // Same key, same draws
+    CHECK_EQ(host_ids(sampler.sample(logits(rows), params, std::nullopt, key).tokens), ids);
+
+    // With a key per row, a row draws what it would alone with that key
+    std::vector<std::optional<array>> keys{};
+    for (int b = 0; b < 8; b++)
+    {
+        keys.push_back(random::key(b));
+    }
+    std::vector<SamplingParams> sampled(keys.size(), top_k);
+    std::vector<int> batched = host_ids(sampler.sample(logits(keys.size()), sampled, std::nullopt, keys).tokens);
+    for (size_t b = 0; b < keys.size(); b++)
+    {
+        CHECK_EQ(host_ids(sampler.sample(logits(1), {top_k}, std::nullopt, keys[b]).tokens)[0], batched[b]);
+    }
+    CHECK_THROWS(sampler.sample(logits(2), {top_k, top_k}, std::nullopt, std::vector<std::optional<array>>{key}));
+
+    // A masked-out argmax moves greedy to the next token
+    std::vector<int> mask = {0, 1, 1, 1, 1, 1};
+    array allowed = astype(array(mask.begin(), {1, V}, int32), bool_);
+    CHECK_EQ(host_ids(sampler.sample(logits(1), {greedy}, std::nullopt, std::nullopt, allowed).tokens),
+             std::vector<int>{1});
+}
+
+void check_penalties()
+{
+    Sampler sampler;
+    SamplingParams p;
+    p.frequency_penalty = 1; // two occurrences of token 0: -2
+    std::vector<int> seen = {0, 0, 5};
+    array history = Sampler::history({&seen}, {p});
+    CHECK_EQ(history.shape(1), 3);
+
+    // log(0.4) - 2 < log(0.25): greedy moves to token 1
+    CHECK_EQ(host_ids(sampler.sample(logits(1), {p}, history).tokens), std::vector<int>{1});
+
+    // Repetition penalty multiplies negative logits, presence subtracts once
+    SamplingParams r;
+    r.repetition_penalty = 2;
+    r.presence_penalty = 0.5;
+    std::vector<float> row = host_row(sampler.distribution(logits(1), {r}, history), 0);
+    CHECK(std::isinf(row[0]) && row[1] == 0);
+    SamplingParams t = r;
+    t.temperature = 1;
+    row = host_row(sampler.distribution(logits(1), {t}, history), 0);
+    std::vector<float> expected(probs.begin(), probs.end());
+    expected[0] = std::exp(std::log(probs[0]) * 2 - 0.5);
+    expected[5] = std::exp(std::log(probs[5]) * 2 - 0.5);
+    float total = 0;
+    for (float e : expected)
+    {
+        total += e;
+    }
+    for (int v = 0; v < V; v++)
+    {
+        CHECK(close(std::exp(row[v]), expected[v] / total));
+    }
+
+    // Only the last penalty_window tokens count
+    p.penalty_window = 1;
+    CHECK_EQ(host_ids(sampler.sample(logits(1), {p}, Sampler::history({&seen}, {p})).tokens), std::vector<int>{0});
+}
+
+void check_logprobs()
+{
+    Sampler sampler;
+    SamplingParams p;
+    p.logprobs = 3;
+    SampledTokens sampled = sampler.sample(logits(2), {p, p});
+    eval(sampled.outputs());
+    TokenLogprobs t = Sampler::token_logprobs(sampled, 1, 2);
+    CHECK_EQ(t.token, 0);
+    CHECK(close(t.logprob, std::log(probs[0])));
+    CHECK_EQ(t.top.size(), size_t(2));
+    CHECK_EQ(t.top[0].first, 0);
+    CHECK_EQ(t.top[1].first, 1);
+    CHECK(close(t.top[1].second, std::log(probs[1])));
+}
+
+int main()
+{
+    check_truncation();
+    check_sampling();
+    check_penalties();
+    check_logprobs();
+    return check_report("test_sampler");
+}
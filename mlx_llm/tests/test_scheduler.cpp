@@ -0,0 +1,198 @@
+// Scheduler tests: batched decoding matches generate() (seeded sampling
+// and bounded caches included), a request whose adapter fails to load
+// fails alone, and a failed load leaves the adapter it would evict intact
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "mlx/mlx.h"
+#include "mlx_llm/lora.cpp"
+#include "mlx_llm/scheduler.cpp"
+#include "check.cpp"
+
+using namespace mlx::core;
+
+Model tiny_model()
+{
+    PhiModelConfig config;
+    config.model_type = "phi3";
+    config.num_hidden_layers = 2;
+    config.vocab_size = 64;
+    config.hidden_size = 32;
+    config.intermediate_size = 64;
+    config.num_attention_heads = 4;
+    config.num_key_value_heads = 2;
+    random::seed(0);
+    return Model(config);
+}
+
+struct Outcome
+{
+    std::vector<int> tokens{};
+    std::vector<std::string> errors{};
+};
+
+int submit(Scheduler &scheduler, Outcome &outcome, const std::vector<int> &prompt, const GenerationConfig &config)
+{
+    return scheduler.submit(
+        prompt, config,
+        [&outcome](int token)
+        {
+            outcome.tokens.push_back(token);
+            return true;
+        },
+        nullptr, [&outcome](const std::string &message) { outcome.errors.push_back(message); });
+}
+
+void check_failed_adapter()
+{
+    Model model = tiny_model();
+    nn::LoRAManager adapters(model, 2);
+    adapters.register_adapter("missing", "/nonexistent/adapter.safetensors", 1);
+
+    Scheduler scheduler(model, 4);
+    scheduler.adapters = &adapters;
+    GenerationConfig config;
+    config.max_tokens = 5;
+    GenerationConfig adapted = config;
+    adapted.adapter = "missing";
+
+    std::vector<std::vector<int>> prompts = {{1, 2, 3}, {4, 5}, {6, 7, 8, 9}};
+    std::vector<Outcome> outcomes(prompts.size());
+    submit(scheduler, outcomes[0], prompts[0], config);
+    int failed = submit(scheduler, outcomes[1], prompts[1], adapted);
+    submit(scheduler, outcomes[2], prompts[2], config);
+
+    // The failed request is dropped during admission; the others are
+    // admitted behind it and run to completion
+    scheduler.step();
+    CHECK(!scheduler.contains(failed));
+    CHECK_EQ(outcomes[1].errors.size(), size_t(1));
+    CHECK(outcomes[1].tokens.empty());
+    scheduler.run();
+
+    for (size_t i : {size_t(0), size_t(2)})
+    {
+        CHECK(outcomes[i].errors.empty());
+        CHECK_EQ(outcomes[i].tokens, generate(model, prompts[i], config));
+    }
+}
+
+// A float32 safetensors file of `tensors`, as adapters are stored
+void write_safetensors(const std::string &file, const std::vector<std::pair<std::string, array>> &tensors)
+{
+    std::string header = "{", data{};
+    for (auto &[name, tensor] : tensors)
+    {
+        array t = astype(tensor, float32);
+        eval(t);
+        size_t begin = data.size();
+        data.append(reinterpret_cast<const char *>(t.data<float>()), t.size() * sizeof(float));
+        header += "\"" + name + "\":{\"dtype\":\"F32\",\"shape\":[" + std::to_string(t.shape(0)) + "," +
+                  std::to_string(t.shape(1)) + "],\"data_offsets\":[" + std::to_string(begin) + "," +
+                  std::to_string(data.size()) + "]},";
+    }
+    header.back() = '}';
+    uint64_t length = header.size();
+    std::ofstream out(file, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    out << header << data;
+}
+
+float max_difference(const array &a, const array &b)
+{
+    return max(abs(subtract(a, b))).item<float>();
+}
+
+void check_adapter_rollback()
+{
+    Model model = tiny_model();
+    std::string good = "/tmp/mlx_llm_test_good.safetensors", bad = "/tmp/mlx_llm_test_bad.safetensors";
+    std::string o_proj = "model.layers.0.self_attn.o_proj", later = "model.layers.1.self_attn.o_proj";
+    write_safetensors(good, {{o_proj + ".lora_a", random::normal({32, 4})}, {o_proj + ".lora_b", random::normal({4, 32})}});
+    // Fits the first layer, not the second
+    write_safetensors(bad, {{o_proj + ".lora_a", random::normal({32, 4})},
+                            {o_proj + ".lora_b", random::normal({4, 32})},
+                            {later + ".lora_a", random::normal({32, 4})},
+                            {later + ".lora_b", random::normal({4, 31})}});
+
+    nn::LoRAManager adapters(model, 1);
+    adapters.register_adapter("good", good, 1);
+    adapters.register_adapter("bad", bad, 1);
+    array prompt = array({1, 2, 3}, {1, 3});
+    auto logits = [&](int slot)
+    {
+        nn::LoRAScope lora(std::vector<int>{slot});
+        array out = model.forward(prompt);
+        eval(out);
+        return out;
+    };
+
+    CHECK_EQ(adapters.acquire("good"), 1);
+    adapters.release("good");
+    array expected = logits(1);
+    CHECK(max_difference(expected, logits(0)) > 1e-3);
+
+    // "bad" would evict "good" from the only slot, but fails validation
+    // before writing: "good" stays resident, unchanged
+    CHECK_THROWS(adapters.acquire("bad"));
+    CHECK_EQ(adapters.resident(), 1);
+    CHECK_EQ(max_difference(logits(1), expected), 0.0f);
+    CHECK_EQ(adapters.acquire("good"), 1);
+    std::remove(good.c_str());
+    std::remove(bad.c_str());
+}
+
+void check_config()
+{
+    Model model = tiny_model();
+    GenerationConfig seeded;
+    seeded.max_tokens = 6;
+    seeded.temperature = 1;
+    seeded.seed = 42;
+    GenerationConfig bounded;
+    bounded.max_tokens = 6;
+    bounded.max_kv_size = 8;
+    bounded.kv_keep = 2;
+    GenerationConfig unseeded = seeded;
+    unseeded.seed = std::nullopt;
+
+    std::vector<int> prompt = {1, 2, 3, 4, 5, 6};
+    std::vector<int> expected_seeded = generate(model, prompt, seeded);
+    std::vector<int> expected_bounded = generate(model, prompt, bounded);
+
+    // A seeded request draws the same tokens alone as next to unseeded
+    // sampled rows, and the same as generate() with that seed
+    for (int others : {0, 2})
+    {
+        Scheduler scheduler(model, 4);
+        std::vector<Outcome> outcomes(others + 2);
+        submit(scheduler, outcomes[0], prompt, seeded);
+        submit(scheduler, outcomes[1], prompt, bounded);
+        for (int i = 0; i < others; i++)
+        {
+            submit(scheduler, outcomes[2 + i], {7, 8, 9}, unseeded);
+        }
+        scheduler.step();
+        CHECK(std::dynamic_pointer_cast<nn::RotatingKVCache>(scheduler.running[1].cache[0]) != nullptr);
+        CHECK(std::dynamic_pointer_cast<nn::RotatingKVCache>(scheduler.running[0].cache[0]) == nullptr);
+        scheduler.run();
+        CHECK_EQ(outcomes[0].tokens, expected_seeded);
+        CHECK_EQ(outcomes[1].tokens, expected_bounded);
+    }
+
+    // Paged caches cannot honour a bounded one
+    auto pool = std::make_shared<nn::BlockPool>(2, 16, 16, 2, 8);
+    Scheduler paged(model, 4, pool);
+    CHECK_THROWS(paged.submit(prompt, bounded));
+}
+
+int main()
+{
+    check_failed_adapter();
+    check_adapter_rollback();
+    check_config();
+    return check_report("test_scheduler");
+}
@@ -0,0 +1,94 @@
+// Session tests: two threads, each generating on its own Session over one
+// frozen model, get the tokens a single thread would and run their token
+// callbacks concurrently
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "mlx/mlx.h"
+#include "mlx_llm/session.cpp"
+#include "check.cpp"
+
+using namespace mlx::core;
+
+// Both threads wait in their first callback until the other one has reached
+// its own; that only happens if neither holds the session lock meanwhile
+struct Rendezvous
+{
+    std::mutex mutex;
+    std::condition_variable arrived;
+    int count = 0;
+
+    bool meet()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        count++;
+        arrived.notify_all();
+        return arrived.wait_for(lock, std::chrono::seconds(30), [&]() { return count >= 2; });
+    }
+};
+
+int main()
+{
+    PhiModelConfig config;
+    config.model_type = "phi3";
+    config.num_hidden_layers = 2;
+    config.vocab_size = 64;
+    config.hidden_size = 32;
+    config.intermediate_size = 64;
+    config.num_attention_heads = 4;
+    config.num_key_value_heads = 2;
+    random::seed(0);
+    Model model(config);
+    model.freeze();
+
+    std::vector<std::vector<int>> prompts = {{1, 2, 3, 4}, {5, 6, 7}};
+    GenerationConfig generation;
+    generation.max_tokens = 6;
+
+    std::vector<std::vector<int>> expected{};
+    for (auto &prompt : prompts)
+    {
+        Session session(model, 0, Device::cpu);
+        expected.push_back(session.generate(prompt, generation));
+        CHECK_EQ(expected.back().size(), size_t(generation.max_tokens));
+    }
+
+    Rendezvous rendezvous;
+    std::vector<std::vector<int>> got(prompts.size());
+    std::vector<std::vector<int>> streamed(prompts.size());
+    std::vector<bool> met(prompts.size(), false);
+    std::vector<std::thread> threads{};
+    for (size_t i = 0; i < prompts.size(); i++)
+    {
+        threads.emplace_back(
+            [&, i]()
+            {
+                Session session(model, 0, Device::cpu);
+                got[i] = session.generate(
+                    prompts[i], generation,
+                    [&, i](int token)
+                    {
+                        if (streamed[i].empty())
+                        {
+                            met[i] = rendezvous.meet();
+                        }
+                        streamed[i].push_back(token);
+                        return true;
+                    });
+            });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+
+    for (size_t i = 0; i < prompts.size(); i++)
+    {
+        CHECK(met[i]);
+        CHECK_EQ(got[i], expected[i]);
+        CHECK_EQ(streamed[i], expected[i]);
+    }
+    return check_report("test_session");
+}
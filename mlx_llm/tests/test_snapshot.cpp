@@ -0,0 +1,188 @@
+// Snapshot tests: save_snapshot / load_snapshot round trips, plain and
+// quantized, and refusal of files that do not fit the module, without
+// changing it
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <unistd.h>
+#include "mlx/mlx.h"
+#include "mlx_llm/phi3.cpp"
+#include "check.cpp"
+
+using namespace mlx::core;
+
+PhiModelConfig tiny_config(int layers = 2)
+{
+    PhiModelConfig config;
+    config.model_type = "phi3";
+    config.num_hidden_layers = layers;
+    config.vocab_size = 96;
+    config.hidden_size = 64;
+    config.intermediate_size = 128;
+    config.num_attention_heads = 4;
+    config.num_key_value_heads = 2;
+    return config;
+}
+
+// Same names, dtypes, shapes and values, in the same order
+bool same_parameters(nn::Module &a, nn::Module &b)
+{
+    const nn::ParameterTable &ta = a.named_parameters(), &tb = b.named_parameters();
+    if (ta.names != tb.names)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < ta.size(); i++)
+    {
+        const array &x = *ta.handles[i], &y = *tb.handles[i];
+        if (x.dtype() != y.dtype() || x.shape() != y.shape() || !all(equal(x, y)).item<bool>())
+        {
+            check_failed(__FILE__, __LINE__, "parameter differs: " + ta.names[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool same_outputs(Model &a, Model &b)
+{
+    array tokens = array({3, 14, 15, 92, 65, 35}, {1, 6});
+    return all(equal(a.forward(tokens), b.forward(tokens))).item<bool>();
+}
+
+std::string temp_file(const std::string &name)
+{
+    return (std::filesystem::temp_directory_path() / (std::to_string(getpid()) + "_" + name)).string();
+}
+
+void check_round_trip()
+{
+    std::string file = temp_file("plain.mlxsnap");
+    random::seed(1);
+    Model saved(tiny_config());
+    saved.save_snapshot(file);
+
+    random::seed(2);
+    Model loaded(tiny_config());
+    CHECK(!same_outputs(saved, loaded));
+    loaded.load_snapshot(file);
+    CHECK(same_parameters(saved, loaded));
+    CHECK(same_outputs(saved, loaded));
+    std::remove(file.c_str());
+}
+
+void check_quantized_round_trip()
+{
+    // Packed weights, scales and biases come back bound to their layers,
+    // in a replica that was never quantized itself
+    std::string file = temp_file("q4.mlxsnap");
+    random::seed(3);
+    Model saved(tiny_config());
+    CHECK(saved.quantize(4, 64) > 0);
+    saved.save_snapshot(file);
+
+    random::seed(4);
+    Model loaded(tiny_config());
+    loaded.load_weights(file);
+    CHECK(same_parameters(saved, loaded));
+    CHECK(same_outputs(saved, loaded));
+    std::remove(file.c_str());
+}
+
+void check_replaced_child()
+{
+    // A submodule replaced by copy assignment is what the owner's table,
+    // and so its snapshot, holds afterwards
+    std::string file = temp_file("replaced.mlxsnap");
+    random::seed(6);
+    Model saved(tiny_config());
+    MLP mlp(64, 128);
+    CHECK(mlp.quantize(4, 64) > 0);
+    saved.named_parameters();
+    saved.model.layers[0].mlp = mlp;
+    array *scales = saved.named_parameters().find("model.layers.0.mlp.gate_up_proj.scales");
+    CHECK(scales != nullptr && scales == &saved.model.layers[0].mlp.gate_up_proj.parameters.at("scales"));
+    saved.save_snapshot(file);
+
+    Model loaded(tiny_config());
+    loaded.model.layers[0].mlp = MLP(64, 128);
+    CHECK(loaded.model.layers[0].mlp.quantize(4, 64) > 0);
+    loaded.load_snapshot(file);
+    CHECK(same_parameters(saved, loaded));
+    CHECK(same_outputs(saved, loaded));
+    std::remove(file.c_str());
+}
+
+void check_mismatch()
+{
+    std::string file = temp_file("mismatch.mlxsnap");
+    Model saved(tiny_config(2));
+    saved.save_snapshot(file);
+
+    Model fewer_layers(tiny_config(1));
+    CHECK_THROWS(fewer_layers.load_snapshot(file));
+    PhiModelConfig wider = tiny_config(2);
+    wider.intermediate_size = 256;
+    Model other_shape(wider);
+    CHECK_THROWS(other_shape.load_snapshot(file));
+
+    // Rejected files leave the module as it was: a float16 snapshot in a
+    // float32 model, and packed layers a wider model only partly fits
+    std::string half_file = temp_file("half.mlxsnap"), q_file = temp_file("q4_mismatch.mlxsnap");
+    std::unordered_map<std::string, array> half{};
+    const nn::ParameterTable &table = saved.named_parameters();
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        half.insert({table.names[i], astype(*table.handles[i], float16)});
+    }
+    Model half_saved(tiny_config(2));
+    half_saved.update(half);
+    half_saved.save_snapshot(half_file);
+    Model quantized(tiny_config(2));
+    CHECK(quantized.quantize(4, 64) > 0);
+    quantized.save_snapshot(q_file);
+
+    random::seed(5);
+    Model untouched(wider);
+    random::seed(5);
+    Model rejecting(wider);
+    CHECK_THROWS(rejecting.load_snapshot(half_file));
+    CHECK_THROWS(rejecting.load_snapshot(q_file));
+    CHECK(same_parameters(untouched, rejecting));
+    Model full(tiny_config(2));
+    CHECK_THROWS(full.load_snapshot(half_file));
+    CHECK_EQ(full.named_parameters().handles[0]->dtype(), float32);
+    std::remove(half_file.c_str());
+    std::remove(q_file.c_str());
+
+    // Truncated and foreign files
+    std::string bytes{};
+    {
+        std::ifstream in(file, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    std::string cut = temp_file("cut.mlxsnap");
+    std::ofstream(cut, std::ios::binary).write(bytes.data(), 64);
+    Model target(tiny_config(2));
+    CHECK_THROWS(target.load_snapshot(cut));
+    std::ofstream(cut, std::ios::binary) << "not a snapshot at all";
+    CHECK_THROWS(target.load_snapshot(cut));
+    CHECK_THROWS(target.load_snapshot(temp_file("missing.mlxsnap")));
+
+    // A failed load leaves the module usable for a good one
+    target.load_snapshot(file);
+    CHECK(same_parameters(saved, target));
+    std::remove(cut.c_str());
+    std::remove(file.c_str());
+}
+
+int main()
+{
+    check_round_trip();
+    check_quantized_round_trip();
+    check_replaced_child();
+    check_mismatch();
+    return check_report("test_snapshot");
+}
@@ -0,0 +1,129 @@
+// Tokenizer tests against ids produced by HF `tokenizers` for the same
+// tokenizer.json (regenerate both with data/make_tokenizers.py)
+#include <string>
+#include <vector>
+#include "mlx_llm/tokenizer.cpp"
+#include "check.cpp"
+
+const std::vector<std::string> samples = {
+    "Hello world",
+    "The lazy dog's fox jumps.",
+    "\n\nfoo",
+    "a  b   c \n",
+    "It's I'M we'll they've",
+    "12345 3.14159",
+    "Caf\xC3\xA9 r\xC3\xA9sum\xC3\xA9 \xE4\xB8\xAD\xE6\x96\x87",
+    "def f():\n\treturn 42\n",
+    "\xE6\x97\xA5\xE6\x9C\xAC \xF0\x9F\x99\x82",
+    "\xE2\x80\x9CQuoted.\xE2\x80\x9D \xE2\x80\x94 it\xE2\x80\x99s fine",
+    "a\xC2\xA0" "b\xC2\xA0 c\xC2\xA0\xC2\xA0" "d",
+    "\xE4\xB8\xAD\xE6\x96\x87\xE3\x80\x82\xE3\x80\x8C\xE5\xBC\x95\xE7\x94\xA8\xE3\x80\x8D\xE3\x80\x81\xE7\xB5\x82\xE3\x82\x8F\xE3\x82\x8A",
+    "x\xC2\xB2 + 10\xC2\xB2 \xD9\xA3\xD9\xA4\xD9\xA5 quick zyxw",
+    "<|endoftext|>done</s>",
+};
+
+// The last sample holds special tokens, so it is left out of round trips
+const size_t plain_samples = samples.size() - 1;
+
+void check_tokenizer(const std::string &file, const std::vector<std::vector<int>> &expected, const std::string &special_free)
+{
+    Tokenizer tokenizer(file);
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        std::vector<int> ids = tokenizer.encode(samples[i]);
+        CHECK_EQ(ids, expected[i]);
+        if (i < plain_samples)
+        {
+            CHECK_EQ(tokenizer.decode(ids), samples[i]);
+
+            StreamingDetokenizer detokenizer(tokenizer);
+            std::string streamed{};
+            for (int id : ids)
+            {
+                std::string piece = detokenizer.add(id);
+                streamed += piece;
+                // Only whole UTF-8 characters are released
+                CHECK(samples[i].compare(0, streamed.size(), streamed) == 0);
+                CHECK(streamed.size() == samples[i].size() || (samples[i][streamed.size()] & 0xC0) != 0x80);
+            }
+            streamed += detokenizer.flush();
+            CHECK_EQ(streamed, samples[i]);
+        }
+    }
+    CHECK_EQ(tokenizer.decode(expected.back()), special_free);
+
+    std::vector<std::vector<int>> batch = tokenizer.encode_batch(samples, true, 4);
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        CHECK_EQ(batch[i], expected[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string data = argc > 1 ? argv[1] : "mlx_llm/tests/data";
+
+    // GPT-2: ByteLevel pre-tokenizer with its own regex
+    check_tokenizer(data + "/gpt2_tokenizer.json",
+                    {
+                        {40, 69, 76, 76, 79, 270, 257, 76, 68},
+                        {272, 284, 315, 89, 288, 71, 298, 221, 276, 88, 221, 74, 266, 80, 83, 14},
+                        {199, 199, 276, 79},
+                        {65, 221, 283, 286, 221, 67, 221, 199},
+                        {311, 298, 221, 41, 7, 45, 270, 69, 296, 76, 221, 84, 263, 89, 300},
+                        {304, 309, 21, 221, 19, 14, 305, 306, 25},
+                        {310, 70, 268, 221, 82, 268, 83, 266, 268, 294},
+                        {68, 69, 70, 221, 70, 301, 26, 199, 198, 264, 84, 85, 82, 78, 221, 20, 18, 199},
+                        {163, 246, 99, 163, 251, 106, 221, 173, 254, 248, 225},
+                        {258, 251, 313, 79, 265, 68, 302, 252, 221, 258, 243, 291, 258, 248, 83, 221, 70, 73, 78, 69},
+                        {65, 127, 255, 66, 127, 255, 221, 67, 127, 255, 127, 255, 68},
+                        {281, 292, 259, 225, 259, 235, 162, 121, 244, 164, 243, 102, 259, 236, 259, 224, 164, 114, 225, 160, 225, 238, 160, 225, 233},
+                        {88, 267, 221, 11, 221, 271, 267, 221, 150, 97, 150, 98, 150, 99, 221, 81, 85, 73, 318, 221, 90, 89, 88, 87},
+                        {0, 275, 78, 69, 28, 15, 83, 30},
+                    },
+                    "done</s>");
+
+    // Llama 3: Split with the Llama 3 regex, then ByteLevel without one,
+    // ignore_merges, and <|begin_of_text|> from the post-processor
+    check_tokenizer(data + "/llama3_tokenizer.json",
+                    {
+                        {0, 41, 70, 77, 77, 80, 271, 258, 77, 69},
+                        {0, 273, 286, 318, 90, 290, 72, 300, 222, 277, 89, 222, 75, 267, 81, 84, 15},
+                        {0, 284, 277, 80},
+                        {0, 66, 222, 285, 288, 222, 68, 222, 200},
+                        {0, 314, 300, 222, 42, 8, 46, 271, 70, 298, 77, 222, 85, 264, 90, 302},
+                        {0, 306, 20, 310, 222, 20, 15, 307, 18, 311},
+                        {0, 313, 71, 269, 222, 83, 269, 84, 267, 269, 296},
+                        {0, 69, 70, 71, 222, 71, 303, 312, 199, 265, 85, 86, 83, 79, 222, 21, 19, 200},
+                        {0, 164, 247, 100, 164, 252, 107, 222, 174, 255, 249, 226},
+                        {0, 259, 252, 316, 80, 266, 69, 304, 253, 222, 259, 244, 293, 259, 249, 84, 222, 71, 74, 79, 70},
+                        {0, 66, 128, 256, 67, 128, 256, 222, 68, 128, 256, 128, 256, 69},
+                        {0, 282, 294, 260, 226, 260, 236, 163, 122, 245, 165, 244, 103, 260, 237, 260, 225, 165, 115, 226, 161, 226, 239, 161, 226, 234},
+                        {0, 89, 268, 222, 12, 222, 272, 268, 222, 151, 98, 151, 99, 151, 100, 222, 82, 86, 74, 68, 76, 320},
+                        {0, 29, 93, 70, 79, 276, 71, 266, 280, 93, 31, 276, 79, 70, 29, 16, 84, 31},
+                    },
+                    "<|endoftext|>done</s>");
+
+    // Llama 2 layout: "▁" normalizer, <0xXX> byte fallback and <s>
+    check_tokenizer(data + "/sentencepiece_tokenizer.json",
+                    {
+                        {1, 317, 75, 287, 294, 294, 297, 317, 305, 345, 294, 286},
+                        {1, 353, 326, 294, 395, 307, 356, 289, 363, 331, 306, 317, 292, 334, 298, 301, 266},
+                        {1, 317, 337, 331, 297},
+                        {1, 317, 283, 336, 284, 336, 317, 285, 317, 259},
+                        {1, 317, 389, 363, 279, 261, 80, 317, 305, 287, 361, 294, 317, 302, 290, 287, 307, 261, 304, 287},
+                        {1, 317, 374, 378, 382, 379, 381, 274},
+                        {1, 317, 388, 288, 311, 317, 300, 311, 301, 334, 311, 317, 354},
+                        {1, 335, 287, 288, 317, 288, 367, 275, 259, 12, 346, 302, 348, 332, 271, 269, 259},
+                        {1, 317, 233, 154, 168, 233, 159, 175, 317, 243, 162, 156, 133},
+                        {1, 317, 315, 392, 297, 333, 286, 369, 317, 313, 317, 344, 314, 329, 288, 291, 296, 287},
+                        {1, 317, 283, 309, 284, 309, 317, 285, 309, 309, 286},
+                        {1, 317, 354, 319, 320, 323, 325, 321, 318, 234, 184, 133, 230, 133, 146, 230, 133, 141},
+                        {1, 317, 306, 310, 317, 46, 317, 376, 317, 220, 166, 220, 167, 220, 168, 317, 299, 303, 291, 399, 317, 308, 307, 306, 305},
+                        {1, 317, 63, 127, 287, 296, 286, 297, 288, 355, 127, 65, 286, 297, 296, 287, 2},
+                    },
+                    "<|endoftext|>done");
+
+    CHECK_THROWS(Tokenizer(data + "/missing_tokenizer.json"));
+    return check_report("test_tokenizer");
+}
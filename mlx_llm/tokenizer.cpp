@@ -0,0 +1,941 @@
+// BPE tokenizer for mlx_llm.cpp, loaded from a HF `tokenizer.json`
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "json.cpp"
+#include "unicode.cpp"
+
+using mlx::core::nn::JsonValue;
+
+// Handles the two BPE layouts used by current checkpoints:
+//  - SentencePiece style (Phi-3, Llama 2): spaces become "▁", no
+//    pre-tokenizer, <0xXX> byte fallback for characters outside the vocab
+//  - byte-level (GPT-2, Llama 3, Qwen 2): bytes mapped to printable
+//    characters and split into words before BPE, with the GPT-2 or the
+//    Llama 3 pattern; other pre-tokenizers are rejected
+class Tokenizer
+{
+public:
+    int bos_id = -1, eos_id = -1, unk_id = -1;
+
+    Tokenizer() = default;
+    Tokenizer(const std::string &file)
+    {
+        load(load_json_file(file));
+    }
+
+    int vocab_size() const
+    {
+        return pieces.size();
+    }
+
+    int token_to_id(const std::string &token) const
+    {
+        auto it = vocab.find(token);
+        return it == vocab.end() ? -1 : it->second;
+    }
+
+    const std::string &id_to_token(int id) const
+    {
+        return pieces.at(id);
+    }
+
+    bool is_special(int id) const
+    {
+        return id >= 0 && id < int(special.size()) && special[id];
+    }
+
+    std::vector<int> encode(const std::string &text, bool add_special_tokens = true) const
+    {
+        std::vector<int> ids{};
+        if (add_special_tokens)
+        {
+            ids.insert(ids.end(), prefix_tokens.begin(), prefix_tokens.end());
+        }
+        std::unordered_map<std::string, std::vector<int>> word_cache{};
+
+        // Added tokens are matched verbatim first; the text between them
+        // goes through normalization and BPE
+        size_t start = 0, pos = 0;
+        bool first_segment = true;
+        while (pos <= text.size())
+        {
+            int added_id = -1;
+            size_t added_len = 0;
+            if (pos < text.size())
+            {
+                match_added(text, pos, added_id, added_len);
+            }
+            if (added_id < 0 && pos < text.size())
+            {
+                pos++;
+                continue;
+            }
+            if (pos > start)
+            {
+                encode_segment(text.substr(start, pos - start), first_segment, ids, word_cache);
+                first_segment = false;
+            }
+            if (added_id < 0)
+            {
+                break;
+            }
+            ids.push_back(added_id);
+            pos += added_len;
+            start = pos;
+        }
+        return ids;
+    }
+
+    std::vector<std::vector<int>> encode_batch(
+        const std::vector<std::string> &texts,
+        bool add_special_tokens = true,
+        int num_threads = 0) const
+    {
+        std::vector<std::vector<int>> out(texts.size());
+        if (num_threads <= 0)
+        {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        num_threads = std::min<int>(num_threads, texts.size());
+        if (num_threads <= 1)
+        {
+            for (size_t i = 0; i < texts.size(); i++)
+            {
+                out[i] = encode(texts[i], add_special_tokens);
+            }
+            return out;
+        }
+        // encode() only reads shared state, so threads split the batch
+        std::vector<std::thread> workers{};
+        for (int t = 0; t < num_threads; t++)
+        {
+            workers.emplace_back([&, t]()
+                                 {
+                for (size_t i = t; i < texts.size(); i += num_threads)
+                {
+                    out[i] = encode(texts[i], add_special_tokens);
+                } });
+        }
+        for (auto &w : workers)
+        {
+            w.join();
+        }
+        return out;
+    }
+
+    // Raw bytes a token stands for (not necessarily valid UTF-8 on its own)
+    std::string token_bytes(int id) const
+    {
+        if (id < 0 || id >= int(pieces.size()))
+        {
+            return "";
+        }
+        if (byte_level)
+        {
+            std::string out{};
+            const std::string &piece = pieces[id];
+            size_t i = 0;
+            while (i < piece.size())
+            {
+                uint32_t cp = next_codepoint(piece, i);
+                auto it = byte_decoder.find(cp);
+                if (it != byte_decoder.end())
+                {
+                    out += char(it->second);
+                }
+            }
+            return out;
+        }
+        if (byte_token_value[id] >= 0)
+        {
+            return std::string(1, char(byte_token_value[id]));
+        }
+        std::string out = pieces[id];
+        if (metaspace)
+        {
+            replace_all(out, "\xE2\x96\x81", " ");
+        }
+        return out;
+    }
+
+    std::string decode(const std::vector<int> &ids, bool skip_special_tokens = true) const
+    {
+        std::string out{};
+        for (int id : ids)
+        {
+            if (skip_special_tokens && is_special(id))
+            {
+                continue;
+            }
+            out += token_bytes(id);
+        }
+        if (strip_leading_space && !out.empty() && out[0] == ' ')
+        {
+            out.erase(0, 1);
+        }
+        return out;
+    }
+
+    bool strips_leading_space() const
+    {
+        return strip_leading_space;
+    }
+
+private:
+    std::unordered_map<std::string, int> vocab{};
+    std::vector<std::string> pieces{};
+    std::vector<bool> special{};
+    // (left id, right id) packed into one key -> (rank, merged id)
+    std::unordered_map<uint64_t, std::pair<int, int>> merges{};
+    // Added tokens indexed by their first byte, longest first
+    std::vector<std::vector<std::pair<std::string, int>>> added_by_byte =
+        std::vector<std::vector<std::pair<std::string, int>>>(256);
+    std::vector<int> prefix_tokens{};
+
+    // How byte-level text is cut into words before BPE
+    enum class WordSplit
+    {
+        None,
+        GPT2,
+        Llama3
+    };
+
+    bool byte_fallback = false;
+    bool byte_level = false;
+    bool ignore_merges = false; // words already in the vocab skip BPE (Llama 3)
+    WordSplit word_split = WordSplit::None;
+    int max_digits = 3; // digits per word with WordSplit::Llama3
+    bool add_prefix_space = false;
+    bool metaspace = false;
+    bool prepend_all_segments = false;
+    bool prepend_first_segment = false;
+    bool strip_leading_space = false;
+    int byte_tokens[256];
+    std::vector<int> byte_token_value{};
+    std::string byte_encoder[256];
+    std::unordered_map<uint32_t, int> byte_decoder{};
+
+    static JsonValue load_json_file(const std::string &file)
+    {
+        return mlx::core::nn::load_json(file);
+    }
+
+    static uint64_t pair_key(int left, int right)
+    {
+        return (uint64_t(uint32_t(left)) << 32) | uint32_t(right);
+    }
+
+    static void replace_all(std::string &s, const std::string &from, const std::string &to)
+    {
+        size_t pos = 0;
+        while ((pos = s.find(from, pos)) != std::string::npos)
+        {
+            s.replace(pos, from.size(), to);
+            pos += to.size();
+        }
+    }
+
+    static size_t utf8_length(unsigned char c)
+    {
+        if (c < 0x80)
+            return 1;
+        if ((c >> 5) == 0x6)
+            return 2;
+        if ((c >> 4) == 0xE)
+            return 3;
+        if ((c >> 3) == 0x1E)
+            return 4;
+        return 1;
+    }
+
+    static uint32_t next_codepoint(const std::string &s, size_t &i)
+    {
+        unsigned char c = s[i];
+        size_t n = std::min(utf8_length(c), s.size() - i);
+        uint32_t cp = n == 1 ? c : (c & (0xFF >> (n + 1)));
+        for (size_t k = 1; k < n; k++)
+        {
+            cp = (cp << 6) | (s[i + k] & 0x3F);
+        }
+        i += n;
+        return cp;
+    }
+
+    static std::string encode_utf8(uint32_t cp)
+    {
+        std::string out{};
+        if (cp < 0x80)
+        {
+            out += char(cp);
+        }
+        else if (cp < 0x800)
+        {
+            out += char(0xC0 | (cp >> 6));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += char(0xE0 | (cp >> 12));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        return out;
+    }
+
+    void load(const JsonValue &config)
+    {
+        const JsonValue &model = config.at("model");
+        if (model.contains("type") && model.at("type").string != "BPE")
+        {
+            throw std::invalid_argument("Only BPE tokenizers are supported, got: " + model.at("type").string);
+        }
+
+        int max_id = -1;
+        for (auto &[piece, id] : model.at("vocab").members)
+        {
+            max_id = std::max(max_id, id.as_int());
+        }
+        if (config.contains("added_tokens"))
+        {
+            for (auto &t : config.at("added_tokens").items)
+            {
+                max_id = std::max(max_id, t.at("id").as_int());
+            }
+        }
+        pieces.assign(max_id + 1, "");
+        special.assign(max_id + 1, false);
+        for (auto &[piece, id] : model.at("vocab").members)
+        {
+            vocab[piece] = id.as_int();
+            pieces[id.as_int()] = piece;
+        }
+
+        for (auto &t : config.contains("added_tokens") ? config.at("added_tokens").items : std::vector<JsonValue>{})
+        {
+            int id = t.at("id").as_int();
+            const std::string &content = t.at("content").string;
+            vocab[content] = id;
+            pieces[id] = content;
+            special[id] = t.contains("special") && t.at("special").boolean;
+            if (!content.empty())
+            {
+                added_by_byte[(unsigned char)content[0]].push_back({content, id});
+            }
+        }
+        for (auto &bucket : added_by_byte)
+        {
+            std::sort(bucket.begin(), bucket.end(), [](const auto &a, const auto &b)
+                      { return a.first.size() > b.first.size(); });
+        }
+
+        byte_fallback = model.contains("byte_fallback") && model.at("byte_fallback").boolean;
+        ignore_merges = model.contains("ignore_merges") && model.at("ignore_merges").boolean;
+        if (model.contains("unk_token") && model.at("unk_token").is_string())
+        {
+            unk_id = token_to_id(model.at("unk_token").string);
+        }
+
+        byte_token_value.assign(pieces.size(), -1);
+        for (int b = 0; b < 256; b++)
+        {
+            char name[8];
+            snprintf(name, sizeof(name), "<0x%02X>", b);
+            byte_tokens[b] = token_to_id(name);
+            if (byte_tokens[b] >= 0)
+            {
+                byte_token_value[byte_tokens[b]] = b;
+            }
+        }
+
+        // Merge ranks: either "a b" strings or ["a", "b"] pairs
+        const auto &merge_list = model.at("merges").items;
+        for (size_t rank = 0; rank < merge_list.size(); rank++)
+        {
+            std::string left, right;
+            const JsonValue &m = merge_list[rank];
+            if (m.is_array())
+            {
+                left = m.at(size_t(0)).string;
+                right = m.at(size_t(1)).string;
+            }
+            else
+            {
+                size_t space = m.string.find(' ', 1);
+                left = m.string.substr(0, space);
+                right = m.string.substr(space + 1);
+            }
+            int l = token_to_id(left), r = token_to_id(right), merged = token_to_id(left + right);
+            if (l >= 0 && r >= 0 && merged >= 0)
+            {
+                merges.insert({pair_key(l, r), {int(rank), merged}});
+            }
+        }
+
+        load_normalization(config);
+        load_post_processor(config);
+
+        for (const char *name : {"<s>", "<|begin_of_text|>", "<|endoftext|>"})
+        {
+            if (bos_id < 0 && std::string(name) != "<|endoftext|>")
+                bos_id = token_to_id(name);
+        }
+        for (const char *name : {"</s>", "<|endoftext|>", "<|end_of_text|>"})
+        {
+            if (eos_id < 0)
+                eos_id = token_to_id(name);
+        }
+    }
+
+    void load_normalization(const JsonValue &config)
+    {
+        auto collect = [](const JsonValue &v, const std::string &field)
+        {
+            std::vector<const JsonValue *> out{};
+            if (!v.is_object())
+                return out;
+            if (v.contains(field))
+            {
+                for (auto &item : v.at(field).items)
+                    out.push_back(&item);
+            }
+            else
+            {
+                out.push_back(&v);
+            }
+            return out;
+        };
+
+        if (config.contains("normalizer"))
+        {
+            for (auto *n : collect(config.at("normalizer"), "normalizers"))
+            {
+                std::string type = n->contains("type") ? n->at("type").string : "";
+                if (type == "Prepend")
+                {
+                    prepend_all_segments = true;
+                    metaspace = true;
+                }
+                else if (type == "Replace")
+                {
+                    metaspace = true;
+                }
+            }
+        }
+        if (config.contains("pre_tokenizer"))
+        {
+            for (auto *p : collect(config.at("pre_tokenizer"), "pretokenizers"))
+            {
+                std::string type = p->contains("type") ? p->at("type").string : "";
+                if (type == "ByteLevel")
+                {
+                    byte_level = true;
+                    add_prefix_space = p->contains("add_prefix_space") && p->at("add_prefix_space").boolean;
+                    if (!p->contains("use_regex") || p->at("use_regex").boolean)
+                    {
+                        if (word_split != WordSplit::None)
+                        {
+                            throw std::invalid_argument("Unsupported pre-tokenizer: Split followed by a ByteLevel regex");
+                        }
+                        word_split = WordSplit::GPT2;
+                    }
+                }
+                else if (type == "Split")
+                {
+                    load_split(*p);
+                }
+                else if (type == "Metaspace")
+                {
+                    metaspace = true;
+                    std::string scheme = p->contains("prepend_scheme") ? p->at("prepend_scheme").string : "always";
+                    bool add_prefix = !p->contains("add_prefix_space") || p->at("add_prefix_space").boolean;
+                    prepend_all_segments = add_prefix && scheme == "always";
+                    prepend_first_segment = add_prefix && scheme == "first";
+                }
+                else if (!type.empty())
+                {
+                    throw std::invalid_argument("Unsupported pre-tokenizer: " + type);
+                }
+            }
+        }
+        if (word_split != WordSplit::None && !byte_level)
+        {
+            throw std::invalid_argument("Unsupported pre-tokenizer: Split without ByteLevel");
+        }
+        strip_leading_space = metaspace && (prepend_all_segments || prepend_first_segment);
+
+        if (byte_level)
+        {
+            // GPT-2 byte <-> printable character table
+            int n = 0;
+            for (int b = 0; b < 256; b++)
+            {
+                bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+                uint32_t cp = printable ? b : 256 + n++;
+                byte_encoder[b] = encode_utf8(cp);
+                byte_decoder[cp] = b;
+            }
+        }
+    }
+
+    // Split pre-tokenizers are recognised by their pattern; anything else
+    // would silently tokenize differently from HF, so it is rejected
+    void load_split(const JsonValue &split)
+    {
+        const std::string gpt2 = "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+";
+        const std::string llama3 = "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| "
+                                   "?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+        const std::string qwen2 = "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| "
+                                  "?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+        std::string pattern = split.contains("pattern") && split.at("pattern").contains("Regex")
+                                  ? split.at("pattern").at("Regex").string
+                                  : "";
+        std::string behavior = split.contains("behavior") ? split.at("behavior").string : "";
+        bool invert = split.contains("invert") && split.at("invert").boolean;
+        if (word_split != WordSplit::None || behavior != "Isolated" || invert)
+        {
+            throw std::invalid_argument("Unsupported Split pre-tokenizer");
+        }
+        if (pattern == gpt2)
+        {
+            word_split = WordSplit::GPT2;
+        }
+        else if (pattern == llama3 || pattern == qwen2)
+        {
+            word_split = WordSplit::Llama3;
+            max_digits = pattern == llama3 ? 3 : 1;
+        }
+        else
+        {
+            throw std::invalid_argument("Unsupported Split pre-tokenizer pattern: " + pattern);
+        }
+    }
+
+    void load_post_processor(const JsonValue &config)
+    {
+        if (!config.contains("post_processor") || !config.at("post_processor").is_object())
+        {
+            return;
+        }
+        const JsonValue &post = config.at("post_processor");
+        if (!post.contains("single"))
+        {
+            return;
+        }
+        // Special tokens placed before the sequence, e.g. <s> for Llama
+        for (auto &piece : post.at("single").items)
+        {
+            if (piece.contains("Sequence"))
+            {
+                break;
+            }
+            if (piece.contains("SpecialToken"))
+            {
+                int id = token_to_id(piece.at("SpecialToken").at("id").string);
+                if (id >= 0)
+                {
+                    prefix_tokens.push_back(id);
+                }
+            }
+        }
+    }
+
+    void match_added(const std::string &text, size_t pos, int &id, size_t &len) const
+    {
+        for (auto &[content, token_id] : added_by_byte[(unsigned char)text[pos]])
+        {
+            if (text.compare(pos, content.size(), content) == 0)
+            {
+                id = token_id;
+                len = content.size();
+                return;
+            }
+        }
+    }
+
+    void encode_segment(
+        const std::string &segment,
+        bool first_segment,
+        std::vector<int> &ids,
+        std::unordered_map<std::string, std::vector<int>> &word_cache) const
+    {
+        if (byte_level)
+        {
+            std::string text = add_prefix_space && segment.compare(0, 1, " ") != 0 ? " " + segment : segment;
+            std::vector<std::string> words = word_split == WordSplit::GPT2     ? split_words(text)
+                                             : word_split == WordSplit::Llama3 ? split_words_llama3(text, max_digits)
+                                                                               : std::vector<std::string>{text};
+            for (auto &word : words)
+            {
+                auto it = word_cache.find(word);
+                if (it == word_cache.end())
+                {
+                    std::string mapped{};
+                    for (unsigned char c : word)
+                    {
+                        mapped += byte_encoder[c];
+                    }
+                    it = word_cache.insert({word, bpe(mapped)}).first;
+                }
+                ids.insert(ids.end(), it->second.begin(), it->second.end());
+            }
+            return;
+        }
+
+        std::string normalized = segment;
+        if (metaspace)
+        {
+            replace_all(normalized, " ", "\xE2\x96\x81");
+            if (prepend_all_segments || (prepend_first_segment && first_segment))
+            {
+                normalized = "\xE2\x96\x81" + normalized;
+            }
+        }
+        std::vector<int> out = bpe(normalized);
+        ids.insert(ids.end(), out.begin(), out.end());
+    }
+
+    // The pattern classes \s, \p{L} and \p{N}, on code points
+    static bool is_space(uint32_t c)
+    {
+        return is_unicode_space(c);
+    }
+
+    static bool is_newline(uint32_t c)
+    {
+        return c == '\r' || c == '\n';
+    }
+
+    static bool is_letter(uint32_t c)
+    {
+        return is_unicode_letter(c);
+    }
+
+    static bool is_number(uint32_t c)
+    {
+        return is_unicode_number(c);
+    }
+
+    static bool is_symbol(uint32_t c)
+    {
+        return !is_space(c) && !is_letter(c) && !is_number(c);
+    }
+
+    // Code points of `text`, and the byte offset of each plus the end
+    static void decode_codepoints(const std::string &text, std::vector<uint32_t> &cps, std::vector<size_t> &offsets)
+    {
+        size_t i = 0;
+        while (i < text.size())
+        {
+            offsets.push_back(i);
+            cps.push_back(next_codepoint(text, i));
+        }
+        offsets.push_back(text.size());
+    }
+
+    // Length of the contraction ('s, 't, 're, 've, 'm, 'll, 'd) at `i`, or 0
+    static size_t contraction(const std::vector<uint32_t> &cps, size_t i, bool ignore_case)
+    {
+        if (cps[i] != '\'')
+        {
+            return 0;
+        }
+        for (const char *suffix : {"s", "t", "re", "ve", "m", "ll", "d"})
+        {
+            size_t len = std::char_traits<char>::length(suffix);
+            if (i + len >= cps.size())
+                continue;
+            bool match = true;
+            for (size_t k = 0; k < len && match; k++)
+            {
+                uint32_t ch = cps[i + 1 + k];
+                match = (ignore_case && ch < 0x80 ? uint32_t(std::tolower(int(ch))) : ch) == uint32_t(suffix[k]);
+            }
+            if (match)
+                return len + 1;
+        }
+        return 0;
+    }
+
+    // GPT-2 word split, `'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+|
+    // ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+`, without regex backtracking.
+    // Runs over code points; words are cut at their byte offsets.
+    static std::vector<std::string> split_words(const std::string &text)
+    {
+        std::vector<uint32_t> cps{};
+        std::vector<size_t> at{};
+        decode_codepoints(text, cps, at);
+        std::vector<std::string> words{};
+        auto word = [&](size_t begin, size_t end)
+        { words.push_back(text.substr(at[begin], at[end] - at[begin])); };
+        size_t i = 0, n = cps.size();
+        while (i < n)
+        {
+            uint32_t c = cps[i];
+            if (size_t len = contraction(cps, i, false))
+            {
+                word(i, i + len);
+                i += len;
+                continue;
+            }
+            if (is_space(c))
+            {
+                size_t j = i;
+                while (j < n && is_space(cps[j]))
+                    j++;
+                if (j == n)
+                {
+                    word(i, n);
+                    break;
+                }
+                // \s+(?!\S) leaves the run's last character to what
+                // follows: a space leads the next word, anything else
+                // stands alone
+                if (j - 1 > i)
+                    word(i, j - 1);
+                if (cps[j - 1] != ' ')
+                {
+                    word(j - 1, j);
+                    i = j;
+                    continue;
+                }
+                i = j - 1;
+            }
+            size_t start = i;
+            if (cps[i] == ' ')
+                i++;
+            uint32_t first = cps[i];
+            bool (*same)(uint32_t) = is_letter(first) ? is_letter : is_number(first) ? is_number
+                                                                                     : is_symbol;
+            while (i < n && same(cps[i]))
+                i++;
+            word(start, i);
+        }
+        return words;
+    }
+
+    // Llama 3 word split, `(?i:'s|'t|'re|'ve|'m|'ll|'d)|
+    // [^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|
+    // \s*[\r\n]+|\s+(?!\S)|\s+`; Qwen 2 is the same with single digits
+    static std::vector<std::string> split_words_llama3(const std::string &text, int max_digits)
+    {
+        std::vector<uint32_t> cps{};
+        std::vector<size_t> at{};
+        decode_codepoints(text, cps, at);
+        std::vector<std::string> words{};
+        size_t i = 0, n = cps.size();
+        while (i < n)
+        {
+            uint32_t c = cps[i];
+            size_t j = i;
+            if (size_t len = contraction(cps, i, true))
+            {
+                j = i + len;
+            }
+            else if (is_letter(c) || (!is_number(c) && !is_newline(c) && i + 1 < n && is_letter(cps[i + 1])))
+            {
+                j = i + 1;
+                while (j < n && is_letter(cps[j]))
+                    j++;
+            }
+            else if (is_number(c))
+            {
+                while (j < n && int(j - i) < max_digits && is_number(cps[j]))
+                    j++;
+            }
+            else if (is_symbol(c) || (c == ' ' && i + 1 < n && is_symbol(cps[i + 1])))
+            {
+                j = c == ' ' ? i + 1 : i;
+                while (j < n && is_symbol(cps[j]))
+                    j++;
+                while (j < n && is_newline(cps[j]))
+                    j++;
+            }
+            else
+            {
+                size_t end = i;
+                while (end < n && is_space(cps[end]))
+                    end++;
+                // Up to the run's last newline, else all of it but the
+                // character before the next word
+                size_t last = end;
+                for (size_t k = i; k < end; k++)
+                {
+                    if (is_newline(cps[k]))
+                        last = k;
+                }
+                j = last < end ? last + 1 : (end < n && end - i > 1 ? end - 1 : end);
+            }
+            words.push_back(text.substr(at[i], at[j] - at[i]));
+            i = j;
+        }
+        return words;
+    }
+
+    std::vector<int> bpe(const std::string &text) const
+    {
+        if (ignore_merges)
+        {
+            int id = token_to_id(text);
+            if (id >= 0)
+            {
+                return {id};
+            }
+        }
+
+        // Start from one symbol per character (or per byte for characters
+        // outside the vocab) and repeatedly merge the lowest-ranked pair,
+        // tracked with a heap over a linked list of symbols
+        std::vector<int> ids{};
+        size_t i = 0;
+        while (i < text.size())
+        {
+            size_t start = i;
+            next_codepoint(text, i);
+            int id = token_to_id(text.substr(start, i - start));
+            if (id >= 0)
+            {
+                ids.push_back(id);
+            }
+            else if (byte_fallback)
+            {
+                for (size_t k = start; k < i; k++)
+                {
+                    ids.push_back(byte_tokens[(unsigned char)text[k]]);
+                }
+            }
+            else if (unk_id >= 0)
+            {
+                ids.push_back(unk_id);
+            }
+        }
+
+        int n = ids.size();
+        if (n < 2)
+        {
+            return ids;
+        }
+        std::vector<int> prev(n), next(n);
+        for (int k = 0; k < n; k++)
+        {
+            prev[k] = k - 1;
+            next[k] = k + 1 < n ? k + 1 : -1;
+        }
+
+        // (rank, left position, left id, right id); stale entries are skipped
+        using Candidate = std::tuple<int, int, int, int>;
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> heap;
+        auto push_pair = [&](int left)
+        {
+            int right = next[left];
+            if (left < 0 || right < 0)
+                return;
+            auto it = merges.find(pair_key(ids[left], ids[right]));
+            if (it != merges.end())
+                heap.push({it->second.first, left, ids[left], ids[right]});
+        };
+        for (int k = 0; k + 1 < n; k++)
+        {
+            push_pair(k);
+        }
+
+        while (!heap.empty())
+        {
+            auto [rank, left, left_id, right_id] = heap.top();
+            heap.pop();
+            int right = next[left];
+            if (ids[left] != left_id || right < 0 || ids[right] != right_id)
+            {
+                continue;
+            }
+            ids[left] = merges.at(pair_key(left_id, right_id)).second;
+            ids[right] = -1;
+            next[left] = next[right];
+            if (next[right] >= 0)
+                prev[next[right]] = left;
+            push_pair(prev[left]);
+            push_pair(left);
+        }
+
+        std::vector<int> out{};
+        for (int k = 0; k >= 0; k = next[k])
+        {
+            out.push_back(ids[k]);
+        }
+        return out;
+    }
+};
+
+// Turns a stream of token ids into text as soon as complete UTF-8
+// characters are available, so multi-byte characters split across byte
+// fallback tokens are never emitted half-way
+class StreamingDetokenizer
+{
+public:
+    StreamingDetokenizer(const Tokenizer &_tokenizer) : tokenizer(_tokenizer) {}
+
+    std::string add(int id)
+    {
+        if (tokenizer.is_special(id))
+        {
+            return "";
+        }
+        pending += tokenizer.token_bytes(id);
+        if (first && !pending.empty())
+        {
+            if (tokenizer.strips_leading_space() && pending[0] == ' ')
+            {
+                pending.erase(0, 1);
+            }
+            first = false;
+        }
+        size_t complete = complete_prefix(pending);
+        std::string out = pending.substr(0, complete);
+        pending.erase(0, complete);
+        return out;
+    }
+
+    std::string flush()
+    {
+        std::string out = pending;
+        pending.clear();
+        return out;
+    }
+
+    void reset()
+    {
+        pending.clear();
+        first = true;
+    }
+
+private:
+    const Tokenizer &tokenizer;
+    std::string pending{};
+    bool first = true;
+
+    static size_t complete_prefix(const std::string &s)
+    {
+        // Length of s without a trailing incomplete UTF-8 sequence
+        size_t n = s.size();
+        for (size_t back = 1; back <= 4 && back <= n; back++)
+        {
+            unsigned char c = s[n - back];
+            if ((c & 0xC0) == 0x80)
+            {
+                continue;
+            }
+            size_t need = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1;
+            return need > back ? n - back : n;
+        }
+        return n;
+    }
+};
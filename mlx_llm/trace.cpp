@@ -0,0 +1,213 @@
+// Forward hooks and tracing for mlx_llm.cpp modules
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "mlx/mlx.h"
+#include "common.cpp"
+
+namespace mlx::core::nn {
+
+struct TraceEvent
+{
+    std::string name;
+    double start_us;
+    double duration_us;
+    std::vector<int> shape;
+    int tid = 0;
+};
+
+struct TraceStats
+{
+    int calls = 0;
+    double total_ms = 0;
+    std::vector<int> shape{};
+};
+
+class Tracer
+{
+public:
+    // Checked by every ForwardScope; while false tracing costs one branch
+    static inline std::atomic<bool> active = false;
+
+    // Shared by every thread and guarded by `mutex`; read them once
+    // tracing has stopped
+    std::vector<TraceEvent> events{};
+    std::map<std::string, TraceStats> stats{};
+
+    static Tracer &instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    void start()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.clear();
+        stats.clear();
+        stack.clear();
+        origin = std::chrono::steady_clock::now().time_since_epoch().count();
+        active = true;
+    }
+
+    void stop()
+    {
+        active = false;
+    }
+
+    double now_us()
+    {
+        auto since = std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(origin);
+        return std::chrono::duration<double, std::micro>(since).count();
+    }
+
+    void enter(const std::string &module_name)
+    {
+        stack.push_back(stack.empty() ? module_name : stack.back() + "." + module_name);
+    }
+
+    void exit(double start_us, const std::vector<int> &shape)
+    {
+        double end_us = now_us();
+        const std::string &path = stack.back();
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back({path, start_us, end_us - start_us, shape, thread_id()});
+        TraceStats &s = stats[path];
+        s.calls++;
+        s.total_ms += (end_us - start_us) / 1000;
+        s.shape = shape;
+        stack.pop_back();
+    }
+
+    void abandon()
+    {
+        stack.pop_back();
+    }
+
+    // Chrome/Perfetto trace format: one complete ("X") event per forward,
+    // one track per thread
+    void dump_chrome_trace(const std::string &file)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(file);
+        out << "{\"traceEvents\":[";
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const TraceEvent &e = events[i];
+            out << (i ? "," : "") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << e.tid
+                << ",\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us
+                << ",\"args\":{\"shape\":\"" << shape_string(e.shape) << "\"}}";
+        }
+        out << "]}\n";
+    }
+
+    void print_summary()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cout << "\n[\ntrace:\n";
+        for (auto &[k, v] : stats)
+        {
+            std::cout << k << ": " << v.calls << " calls, " << v.total_ms << " ms, "
+                      << shape_string(v.shape) << "\n";
+        }
+        std::cout << "]\n";
+    }
+
+private:
+    // Module paths open on this thread; each thread nests its own forwards
+    static inline thread_local std::vector<std::string> stack{};
+    std::mutex mutex;
+    std::atomic<std::chrono::steady_clock::rep> origin = std::chrono::steady_clock::now().time_since_epoch().count();
+
+    static int thread_id()
+    {
+        static std::atomic<int> next = 0;
+        static thread_local int id = next++;
+        return id;
+    }
+
+    static std::string shape_string(const std::vector<int> &shape)
+    {
+        std::ostringstream oss;
+        oss << "[";
+        for (size_t i = 0; i < shape.size(); i++)
+        {
+            oss << (i ? ", " : "") << shape[i];
+        }
+        oss << "]";
+        return oss.str();
+    }
+};
+
+class ForwardScope
+{
+public:
+    // Opened at the top of a forward and closed with done(output). Runs the
+    // module's hooks and, while tracing, times the call between eval
+    // boundaries. With no hooks and tracing off it does nothing.
+    ForwardScope(Module &_module, const array &input) : module(_module)
+    {
+        if (!Tracer::active && module.forward_pre_hooks.empty() && module.forward_hooks.empty())
+        {
+            return;
+        }
+        active = true;
+        for (auto &hook : module.forward_pre_hooks)
+        {
+            hook(module, input);
+        }
+        if (Tracer::active)
+        {
+            eval(input);
+            Tracer &tracer = Tracer::instance();
+            tracer.enter(module.name.empty() ? "forward" : module.name);
+            start_us = tracer.now_us();
+            traced = true;
+        }
+    }
+
+    ForwardScope(const ForwardScope &) = delete;
+
+    ~ForwardScope()
+    {
+        // Left by an exception before done()
+        if (traced)
+        {
+            Tracer::instance().abandon();
+        }
+    }
+
+    array done(const array &output)
+    {
+        if (!active)
+        {
+            return output;
+        }
+        if (traced)
+        {
+            eval(output);
+            Tracer::instance().exit(start_us, output.shape());
+            traced = false;
+        }
+        for (auto &hook : module.forward_hooks)
+        {
+            hook(module, output);
+        }
+        return output;
+    }
+
+private:
+    Module &module;
+    bool active = false;
+    bool traced = false;
+    double start_us = 0;
+};
+
+} // namespace mlx::core::nn
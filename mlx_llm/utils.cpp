@@ -4,6 +4,8 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 
 namespace mlx::core::nn {
@@ -44,4 +46,51 @@ bool ends_with(const std::string &str, const std::string &suffix)
         return false;
     return str.substr(str.size() - suffix.size()) == suffix;
 }
+
+// Maps llama.cpp GGUF tensor names onto the HF-style names used by the
+// modules, e.g. `blk.3.attn_qkv.scales` -> `model.layers.3.self_attn.qkv_proj.scales`
+std::string gguf_to_hf_name(const std::string &name)
+{
+    static const std::vector<std::pair<std::string, std::string>> top_level = {
+        {"token_embd", "model.embed_tokens"},
+        {"output_norm", "model.norm"},
+        {"output", "lm_head"},
+    };
+    static const std::vector<std::pair<std::string, std::string>> block_level = {
+        {"attn_qkv", "self_attn.qkv_proj"},
+        {"attn_q", "self_attn.q_proj"},
+        {"attn_k", "self_attn.k_proj"},
+        {"attn_v", "self_attn.v_proj"},
+        {"attn_output", "self_attn.o_proj"},
+        {"attn_norm", "input_layernorm"},
+        {"ffn_norm", "post_attention_layernorm"},
+        {"ffn_up", "mlp.gate_up_proj"},
+        {"ffn_down", "mlp.down_proj"},
+    };
+
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+        return name;
+    std::string stem = name.substr(0, dot), suffix = name.substr(dot);
+
+    if (stem.compare(0, 4, "blk.") == 0)
+    {
+        size_t layer_end = stem.find('.', 4);
+        if (layer_end == std::string::npos)
+            return name;
+        std::string layer = stem.substr(4, layer_end - 4), part = stem.substr(layer_end + 1);
+        for (auto &[from, to] : block_level)
+        {
+            if (part == from)
+                return "model.layers." + layer + "." + to + suffix;
+        }
+        return name;
+    }
+    for (auto &[from, to] : top_level)
+    {
+        if (stem == from)
+            return to + suffix;
+    }
+    return name;
+}
 } // namespace mlx::core::nn
\ No newline at end of file
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "mlx/mlx.h"
+#include "mlx_llm/generate.cpp"
+
+using namespace mlx::core;
+
+// End-to-end throughput of a Phi-3 shaped Model with random weights.
+// Nothing is downloaded; the shape comes from the command line.
+
+struct BenchOptions {
+  PhiModelConfig config;
+  std::vector<int> prompt_lengths{128, 512, 2048};
+  std::vector<int> batch_sizes{1, 4, 8};
+  int decode_tokens = 64;
+  int decode_context = 128;
+  int warmup = 1;
+  int repeat = 3;
+  int quantize_bits = 0;
+  int block_size = 16;
+  std::string json_path;
+};
+
+using bench_clock = std::chrono::steady_clock;
+
+double elapsed_ms(bench_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+std::vector<int> parse_list(const std::string& value) {
+  std::vector<int> out;
+  std::stringstream ss(value);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    out.push_back(std::stoi(item));
+  }
+  return out;
+}
+
+array random_tokens(int B, int L, int vocab_size) {
+  return random::randint(array(0), array(vocab_size), {B, L}, int32);
+}
+
+// Runs `fn` warmup + repeat times and returns the mean of the timed runs in ms
+template <typename F>
+double time_runs(const BenchOptions& opts, F fn) {
+  for (int i = 0; i < opts.warmup; i++) {
+    fn();
+  }
+  double total = 0;
+  for (int i = 0; i < opts.repeat; i++) {
+    auto start = bench_clock::now();
+    fn();
+    total += elapsed_ms(start);
+  }
+  return total / std::max(opts.repeat, 1);
+}
+
+void print_usage(const char* prog) {
+  std::cerr
+      << "Usage: " << prog << " [options]\n"
+      << "  --layers N            hidden layers (32)\n"
+      << "  --hidden N            hidden size (3072)\n"
+      << "  --heads N             attention heads (32)\n"
+      << "  --kv-heads N          key/value heads (32)\n"
+      << "  --intermediate N      MLP hidden size (8192)\n"
+      << "  --vocab N             vocabulary size (32064)\n"
+      << "  --prompt-lengths L,.. prefill lengths (128,512,2048)\n"
+      << "  --batch-sizes B,..    decode batch sizes (1,4,8)\n"
+      << "  --decode-tokens N     decode steps per batch size (64)\n"
+      << "  --decode-context N    prompt length before decoding (128)\n"
+      << "  --quantize BITS       quantize linear layers (off)\n"
+      << "  --block-size N        paged KV cache page size, 0 skips paged decode (16)\n"
+      << "  --warmup N            untimed runs (1)\n"
+      << "  --repeat N            timed runs (3)\n"
+      << "  --json PATH           also write results as JSON\n";
+}
+
+int main(int argc, char* argv[]) {
+  BenchOptions opts;
+  opts.config.model_type = "phi3";
+  opts.config.num_hidden_layers = 32;
+  opts.config.hidden_size = 3072;
+  opts.config.num_attention_heads = 32;
+  opts.config.num_key_value_heads = 32;
+  opts.config.intermediate_size = 8192;
+  opts.config.vocab_size = 32064;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--layers") opts.config.num_hidden_layers = std::stoi(value);
+    else if (arg == "--hidden") opts.config.hidden_size = std::stoi(value);
+    else if (arg == "--heads") opts.config.num_attention_heads = std::stoi(value);
+    else if (arg == "--kv-heads") opts.config.num_key_value_heads = std::stoi(value);
+    else if (arg == "--intermediate") opts.config.intermediate_size = std::stoi(value);
+    else if (arg == "--vocab") opts.config.vocab_size = std::stoi(value);
+    else if (arg == "--prompt-lengths") opts.prompt_lengths = parse_list(value);
+    else if (arg == "--batch-sizes") opts.batch_sizes = parse_list(value);
+    else if (arg == "--decode-tokens") opts.decode_tokens = std::stoi(value);
+    else if (arg == "--decode-context") opts.decode_context = std::stoi(value);
+    else if (arg == "--quantize") opts.quantize_bits = std::stoi(value);
+    else if (arg == "--block-size") opts.block_size = std::stoi(value);
+    else if (arg == "--warmup") opts.warmup = std::stoi(value);
+    else if (arg == "--repeat") opts.repeat = std::stoi(value);
+    else if (arg == "--json") opts.json_path = value;
+    else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Load: build the model and materialize every parameter
+  auto load_start = bench_clock::now();
+  Model model(opts.config);
+  if (opts.quantize_bits) {
+    model.quantize(opts.quantize_bits, 64);
+  }
+  std::vector<array> params;
+  const auto& table = model.named_parameters();
+  for (auto* p : table.handles) {
+    params.push_back(*p);
+  }
+  eval(params);
+  double load_ms = elapsed_ms(load_start);
+  std::cout << "load: " << load_ms << " ms (" << table.size() << " tensors)\n";
+
+  std::ostringstream json;
+  json << "{\"config\":{\"layers\":" << opts.config.num_hidden_layers
+       << ",\"hidden\":" << opts.config.hidden_size
+       << ",\"heads\":" << opts.config.num_attention_heads
+       << ",\"kv_heads\":" << opts.config.kv_heads()
+       << ",\"intermediate\":" << opts.config.intermediate_size
+       << ",\"vocab\":" << opts.config.vocab_size
+       << ",\"quantize_bits\":" << opts.quantize_bits
+       << ",\"warmup\":" << opts.warmup << ",\"repeat\":" << opts.repeat << "}"
+       << ",\"load_ms\":" << load_ms;
+
+  // Prefill: one prompt of each length through a fresh cache. TTFT adds
+  // sampling the first token on top of the prefill forward.
+  json << ",\"prefill\":[";
+  for (size_t i = 0; i < opts.prompt_lengths.size(); i++) {
+    int L = opts.prompt_lengths[i];
+    array prompt = random_tokens(1, L, opts.config.vocab_size);
+    eval(prompt);
+    double ttft_ms = time_runs(opts, [&]() {
+      nn::KVCacheList cache = model.make_cache();
+      array y = sample_token(last_token_logits(model.forward(prompt, &cache)), 0);
+      eval(y);
+    });
+    double tps = L / (ttft_ms / 1000);
+    std::cout << "prefill L=" << L << ": " << tps << " tok/s, ttft " << ttft_ms << " ms\n";
+    json << (i ? "," : "") << "{\"prompt_length\":" << L << ",\"tokens_per_sec\":" << tps
+         << ",\"ttft_ms\":" << ttft_ms << "}";
+  }
+  json << "]";
+
+  // Decode: B sequences prefilled to `decode_context`, then single-token
+  // steps over the whole batch
+  json << ",\"decode\":[";
+  for (size_t i = 0; i < opts.batch_sizes.size(); i++) {
+    int B = opts.batch_sizes[i];
+    // Only the decode loop is timed, not the prefill that sets it up
+    auto run_decode = [&]() {
+      nn::KVCacheList cache = model.make_cache();
+      array prompt = random_tokens(B, opts.decode_context, opts.config.vocab_size);
+      array y = argmax(last_token_logits(model.forward(prompt, &cache)), -1);
+      eval(y);
+      auto start = bench_clock::now();
+      for (int t = 0; t < opts.decode_tokens; t++) {
+        y = argmax(last_token_logits(model.forward(reshape(y, {B, 1}), &cache)), -1);
+        eval(y);
+      }
+      return elapsed_ms(start);
+    };
+    for (int r = 0; r < opts.warmup; r++) {
+      run_decode();
+    }
+    double loop_ms = 0;
+    for (int r = 0; r < opts.repeat; r++) {
+      loop_ms += run_decode();
+    }
+    loop_ms /= std::max(opts.repeat, 1);
+    double step_ms = loop_ms / opts.decode_tokens;
+    double tps = B * opts.decode_tokens / (loop_ms / 1000);
+    std::cout << "decode B=" << B << ": " << tps << " tok/s, " << step_ms << " ms/step\n";
+    json << (i ? "," : "") << "{\"batch_size\":" << B << ",\"tokens_per_sec\":" << tps
+         << ",\"ms_per_step\":" << step_ms << "}";
+  }
+  json << "]";
+
+  // Paged decode: the same steps with every sequence's cache drawn from a
+  // shared block pool, one paged cache per row
+  if (opts.block_size > 0) {
+    json << ",\"paged_decode\":[";
+    int head_dim = opts.config.hidden_size / opts.config.num_attention_heads;
+    for (size_t i = 0; i < opts.batch_sizes.size(); i++) {
+      int B = opts.batch_sizes[i];
+      auto run_decode = [&]() {
+        int per_row = (opts.decode_context + opts.decode_tokens + opts.block_size) / opts.block_size;
+        auto pool = std::make_shared<nn::BlockPool>(
+            opts.config.num_hidden_layers, B * per_row, opts.block_size, opts.config.kv_heads(), head_dim);
+        std::vector<nn::KVCacheList> caches;
+        std::vector<nn::KVCacheList*> rows;
+        std::vector<array> first;
+        for (int b = 0; b < B; b++) {
+          caches.push_back(nn::make_paged_kv_cache(pool));
+        }
+        for (int b = 0; b < B; b++) {
+          rows.push_back(&caches[b]);
+          array prompt = random_tokens(1, opts.decode_context, opts.config.vocab_size);
+          first.push_back(argmax(model.forward_last(prompt, &caches[b]), -1));
+          eval(first.back());
+        }
+        array y = concatenate(first, 0);
+        eval(y);
+        auto start = bench_clock::now();
+        for (int t = 0; t < opts.decode_tokens; t++) {
+          y = argmax(model.forward_last(reshape(y, {B, 1}), rows), -1);
+          eval(y);
+        }
+        return elapsed_ms(start);
+      };
+      for (int r = 0; r < opts.warmup; r++) {
+        run_decode();
+      }
+      double loop_ms = 0;
+      for (int r = 0; r < opts.repeat; r++) {
+        loop_ms += run_decode();
+      }
+      loop_ms /= std::max(opts.repeat, 1);
+      double step_ms = loop_ms / opts.decode_tokens;
+      double tps = B * opts.decode_tokens / (loop_ms / 1000);
+      std::cout << "paged decode B=" << B << ": " << tps << " tok/s, " << step_ms << " ms/step\n";
+      json << (i ? "," : "") << "{\"batch_size\":" << B << ",\"block_size\":" << opts.block_size
+           << ",\"tokens_per_sec\":" << tps << ",\"ms_per_step\":" << step_ms << "}";
+    }
+    json << "]";
+  }
+
+  // Without Metal the allocator figure is the peak RSS as well
+  double peak_mb = nn::allocator_stats().peak / (1024.0 * 1024.0);
+  double rss_mb = nn::peak_rss_bytes() / (1024.0 * 1024.0);
+  std::cout << "peak memory: " << peak_mb << " MB (allocator), " << rss_mb << " MB (rss)\n";
+  json << ",\"peak_memory_mb\":" << peak_mb << ",\"peak_rss_mb\":" << rss_mb << "}\n";
+
+  if (!opts.json_path.empty()) {
+    std::ofstream out(opts.json_path);
+    out << json.str();
+    std::cout << "wrote " << opts.json_path << "\n";
+  }
+  return 0;
+}
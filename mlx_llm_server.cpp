@@ -0,0 +1,572 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "mlx/mlx.h"
+#include "mlx_llm/scheduler.cpp"
+#include "mlx_llm/tokenizer.cpp"
+
+using namespace mlx::core;
+
+// Loopback HTTP server with an OpenAI-style `/v1/completions` endpoint.
+// Connection threads parse and tokenize; a single worker thread owns the
+// model and runs every request through one continuous-batching Scheduler.
+
+struct ServerOptions {
+  std::string model_dir;
+  std::string host = "127.0.0.1";
+  int port = 8080;
+  int max_batch_size = 8;
+  int max_tokens = 256;
+};
+
+// A request shared between its connection thread and the worker
+struct Completion {
+  std::vector<int> prompt;
+  GenerationConfig config;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<int> tokens;
+  int generated = 0;
+  bool done = false;
+  std::string error;
+  std::atomic<bool> cancelled{false};
+
+  void push(int token) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tokens.push_back(token);
+    generated++;
+    cv.notify_one();
+  }
+
+  // The first outcome sticks, so an error is not overwritten when the
+  // worker later sees the request gone from the scheduler
+  void finish(const std::string& message = "") {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (done) {
+      return;
+    }
+    done = true;
+    error = message;
+    cv.notify_one();
+  }
+};
+
+class InferenceWorker {
+ public:
+  InferenceWorker(Model& model, int max_batch_size) : scheduler(model, max_batch_size) {}
+
+  void start() {
+    thread = std::thread([this]() { run(); });
+  }
+
+  void submit(std::shared_ptr<Completion> completion) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.push_back(std::move(completion));
+    cv.notify_one();
+  }
+
+ private:
+  Scheduler scheduler;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<Completion>> pending;
+  // Only touched by the worker thread, like the scheduler itself
+  std::map<int, std::shared_ptr<Completion>> active;
+  std::thread thread;
+
+  void run() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return !pending.empty() || scheduler.has_work(); });
+        while (!pending.empty()) {
+          auto completion = std::move(pending.front());
+          pending.pop_front();
+          if (completion->cancelled) {
+            completion->finish();
+            continue;
+          }
+          Completion* c = completion.get();
+          int id = scheduler.submit(
+              c->prompt, c->config,
+              [c](int token) {
+                c->push(token);
+                return !c->cancelled;
+              },
+              nullptr, [c](const std::string& message) { c->finish(message); });
+          active[id] = std::move(completion);
+        }
+      }
+
+      for (auto& [id, completion] : active) {
+        if (completion->cancelled) {
+          scheduler.cancel(id);
+        }
+      }
+      try {
+        scheduler.step();
+      } catch (const std::exception& e) {
+        // e.g. the memory budget: fail what is in flight, keep serving
+        for (auto& [id, completion] : active) {
+          scheduler.cancel(id);
+          completion->finish(e.what());
+        }
+        active.clear();
+        continue;
+      }
+      for (auto it = active.begin(); it != active.end();) {
+        if (!scheduler.contains(it->first)) {
+          it->second->finish();
+          it = active.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+  }
+};
+
+struct ServerContext {
+  ServerContext(std::string _model_name, Tokenizer _tokenizer)
+      : model_name(std::move(_model_name)), tokenizer(std::move(_tokenizer)) {}
+
+  std::string model_name;
+  Tokenizer tokenizer;
+  std::vector<int> stop_tokens{};
+  int max_tokens = 0;
+  InferenceWorker* worker = nullptr;
+  std::atomic<int> next_id{0};
+  int vocab_size = 0;
+  // Compiled grammars by EBNF text, so repeated schemas reuse their
+  // vocabulary index and mask cache
+  std::mutex grammar_mutex;
+  std::map<std::string, std::shared_ptr<Grammar>> grammars;
+};
+
+std::shared_ptr<Grammar> compiled_grammar(ServerContext& ctx, const std::string& ebnf) {
+  {
+    std::lock_guard<std::mutex> lock(ctx.grammar_mutex);
+    auto it = ctx.grammars.find(ebnf);
+    if (it != ctx.grammars.end()) {
+      return it->second;
+    }
+  }
+  auto grammar = std::make_shared<Grammar>(ebnf, ctx.tokenizer, ctx.vocab_size, ctx.stop_tokens);
+  std::lock_guard<std::mutex> lock(ctx.grammar_mutex);
+  if (ctx.grammars.size() >= 32) {
+    ctx.grammars.erase(ctx.grammars.begin());
+  }
+  ctx.grammars[ebnf] = grammar;
+  return grammar;
+}
+
+// ----------------------------- HTTP -----------------------------
+
+struct HttpRequest {
+  std::string method;
+  std::string path;
+  std::string body;
+};
+
+const size_t max_body_size = 16 << 20;
+
+// Returns 200 once `req` is complete, the status to answer a malformed
+// request with, or 0 if the peer went away
+int read_request(int fd, HttpRequest& req) {
+  std::string data;
+  char buffer[4096];
+  size_t header_end;
+  while ((header_end = data.find("\r\n\r\n")) == std::string::npos) {
+    if (data.size() > (1 << 16)) {
+      return 431;
+    }
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) {
+      return 0;
+    }
+    data.append(buffer, n);
+  }
+
+  std::istringstream head(data.substr(0, header_end));
+  std::string line;
+  std::getline(head, line);
+  std::istringstream request_line(line);
+  request_line >> req.method >> req.path;
+
+  size_t content_length = 0;
+  while (std::getline(head, line)) {
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, colon);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    if (key == "content-length") {
+      // Digits only, and never more than the cap, so parsing cannot throw
+      size_t begin = line.find_first_not_of(" \t", colon + 1);
+      size_t end = line.find_last_not_of(" \t\r");
+      if (begin == std::string::npos || end < begin) {
+        return 400;
+      }
+      std::string value = line.substr(begin, end - begin + 1);
+      if (!std::all_of(value.begin(), value.end(), ::isdigit)) {
+        return 400;
+      }
+      if (value.size() > 9 || std::stoul(value) > max_body_size) {
+        return 413;
+      }
+      content_length = std::stoul(value);
+    }
+  }
+
+  req.body = data.substr(header_end + 4);
+  while (req.body.size() < content_length) {
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) {
+      return 0;
+    }
+    req.body.append(buffer, n);
+  }
+  req.body.resize(content_length);
+  return 200;
+}
+
+bool send_all(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+void send_response(int fd, int status, const std::string& body) {
+  const char* reason = status == 200   ? "OK"
+                       : status == 400 ? "Bad Request"
+                       : status == 404 ? "Not Found"
+                       : status == 413 ? "Payload Too Large"
+                       : status == 431 ? "Request Header Fields Too Large"
+                                       : "Internal Server Error";
+  std::ostringstream out;
+  out << "HTTP/1.1 " << status << " " << reason << "\r\n"
+      << "Content-Type: application/json\r\n"
+      << "Content-Length: " << body.size() << "\r\n"
+      << "Connection: close\r\n\r\n"
+      << body;
+  send_all(fd, out.str());
+}
+
+// The peer hung up if the socket reads as closed
+bool client_closed(int fd) {
+  pollfd p{fd, POLLIN, 0};
+  if (poll(&p, 1, 0) <= 0) {
+    return false;
+  }
+  if (p.revents & (POLLHUP | POLLERR)) {
+    return true;
+  }
+  char c;
+  return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+std::string json_escape(const std::string& s) {
+  std::string out = "\"";
+  for (unsigned char c : s) {
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char esc[8];
+          snprintf(esc, sizeof(esc), "\\u%04x", c);
+          out += esc;
+        } else {
+          out += c;
+        }
+    }
+  }
+  return out + "\"";
+}
+
+// ----------------------------- Endpoints -----------------------------
+
+// Waits for the next tokens of `c`; returns false once generation is over.
+// A client that hangs up cancels its request.
+bool next_tokens(Completion& c, int fd, std::vector<int>& out) {
+  std::unique_lock<std::mutex> lock(c.mutex);
+  while (c.tokens.empty() && !c.done) {
+    c.cv.wait_for(lock, std::chrono::milliseconds(50));
+    if (c.tokens.empty() && !c.done && client_closed(fd)) {
+      c.cancelled = true;
+      return false;
+    }
+  }
+  out.assign(c.tokens.begin(), c.tokens.end());
+  c.tokens.clear();
+  return !out.empty() || !c.done;
+}
+
+std::string completion_chunk(
+    const ServerContext& ctx,
+    const std::string& id,
+    const std::string& text,
+    const std::string& finish_reason,
+    const std::string& extra = "") {
+  std::ostringstream out;
+  out << "{\"id\":\"" << id << "\",\"object\":\"text_completion\",\"created\":" << time(nullptr)
+      << ",\"model\":" << json_escape(ctx.model_name) << ",\"choices\":[{\"index\":0,\"text\":"
+      << json_escape(text) << ",\"finish_reason\":"
+      << (finish_reason.empty() ? "null" : json_escape(finish_reason)) << "}]" << extra << "}";
+  return out.str();
+}
+
+void handle_completion(int fd, const HttpRequest& req, ServerContext& ctx) {
+  auto c = std::make_shared<Completion>();
+  bool stream = false;
+  try {
+    nn::JsonValue body = nn::parse_json(req.body);
+    if (!body.contains("prompt") || !body.at("prompt").is_string()) {
+      send_response(fd, 400, "{\"error\":\"'prompt' must be a string\"}");
+      return;
+    }
+    c->prompt = ctx.tokenizer.encode(body.at("prompt").string);
+    c->config.max_tokens = body.contains("max_tokens") ? body.at("max_tokens").as_int() : ctx.max_tokens;
+    if (body.contains("temperature")) {
+      c->config.temperature = body.at("temperature").number;
+    }
+    if (body.contains("top_k")) {
+      c->config.top_k = body.at("top_k").as_int();
+    }
+    for (auto [name, field] : {std::pair<const char*, float GenerationConfig::*>{"top_p", &GenerationConfig::top_p},
+                               {"min_p", &GenerationConfig::min_p},
+                               {"repetition_penalty", &GenerationConfig::repetition_penalty},
+                               {"frequency_penalty", &GenerationConfig::frequency_penalty},
+                               {"presence_penalty", &GenerationConfig::presence_penalty}}) {
+      if (body.contains(name)) {
+        c->config.*field = body.at(name).number;
+      }
+    }
+    // "grammar" takes EBNF text; "response_format" an OpenAI-style
+    // {"type": "json_object"} or {"type": "json_schema", "json_schema": {"schema": ...}}
+    if (body.contains("grammar")) {
+      c->config.grammar = compiled_grammar(ctx, body.at("grammar").string);
+    } else if (body.contains("response_format")) {
+      const auto& format = body.at("response_format");
+      const std::string& type = format.at("type").string;
+      if (type == "json_schema") {
+        c->config.grammar = compiled_grammar(ctx, JsonSchemaConverter().convert(format.at("json_schema").at("schema")));
+      } else if (type == "json_object") {
+        c->config.grammar = compiled_grammar(ctx, JsonSchemaConverter().convert(nn::parse_json("{\"type\":\"object\"}")));
+      }
+    }
+    stream = body.contains("stream") && body.at("stream").boolean;
+  } catch (const std::exception& e) {
+    send_response(fd, 400, "{\"error\":" + json_escape(e.what()) + "}");
+    return;
+  }
+  c->config.stop_tokens = ctx.stop_tokens;
+  if (c->prompt.empty()) {
+    send_response(fd, 400, "{\"error\":\"empty prompt\"}");
+    return;
+  }
+  std::string id = "cmpl-" + std::to_string(ctx.next_id++);
+  ctx.worker->submit(c);
+
+  StreamingDetokenizer detokenizer(ctx.tokenizer);
+  std::vector<int> tokens;
+  std::string text;
+  if (stream) {
+    if (!send_all(fd, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+                      "Cache-Control: no-cache\r\nConnection: close\r\n\r\n")) {
+      c->cancelled = true;
+      return;
+    }
+  }
+  while (next_tokens(*c, fd, tokens)) {
+    std::string piece;
+    for (int t : tokens) {
+      piece += detokenizer.add(t);
+    }
+    if (!stream) {
+      text += piece;
+    } else if (!piece.empty() && !send_all(fd, "data: " + completion_chunk(ctx, id, piece, "") + "\n\n")) {
+      c->cancelled = true;
+      return;
+    }
+  }
+  if (c->cancelled) {
+    return;
+  }
+
+  std::string rest = detokenizer.flush();
+  std::string finish_reason = c->generated >= c->config.max_tokens ? "length" : "stop";
+  if (!c->error.empty()) {
+    if (stream) {
+      send_all(fd, "data: {\"error\":" + json_escape(c->error) + "}\n\ndata: [DONE]\n\n");
+    } else {
+      send_response(fd, 500, "{\"error\":" + json_escape(c->error) + "}");
+    }
+    return;
+  }
+  if (stream) {
+    send_all(fd, "data: " + completion_chunk(ctx, id, rest, finish_reason) + "\n\ndata: [DONE]\n\n");
+    return;
+  }
+  int prompt_tokens = c->prompt.size();
+  std::ostringstream usage;
+  usage << ",\"usage\":{\"prompt_tokens\":" << prompt_tokens << ",\"completion_tokens\":" << c->generated
+        << ",\"total_tokens\":" << prompt_tokens + c->generated << "}";
+  send_response(fd, 200, completion_chunk(ctx, id, text + rest, finish_reason, usage.str()));
+}
+
+void handle_connection(int fd, ServerContext& ctx) {
+  // Runs on a detached thread, where an escaping exception would take
+  // the whole server down
+  try {
+    HttpRequest req;
+    int status = read_request(fd, req);
+    if (status != 200) {
+      if (status != 0) {
+        send_response(fd, status, "{\"error\":\"malformed request\"}");
+      }
+    } else if (req.method == "POST" && req.path == "/v1/completions") {
+      handle_completion(fd, req, ctx);
+    } else if (req.method == "GET" && req.path == "/v1/models") {
+      send_response(fd, 200, "{\"object\":\"list\",\"data\":[{\"id\":" + json_escape(ctx.model_name) +
+                                 ",\"object\":\"model\"}]}");
+    } else if (req.method == "GET" && req.path == "/health") {
+      send_response(fd, 200, "{\"status\":\"ok\"}");
+    } else {
+      send_response(fd, 404, "{\"error\":\"not found\"}");
+    }
+  } catch (const std::exception& e) {
+    send_response(fd, 500, "{\"error\":" + json_escape(e.what()) + "}");
+  }
+  close(fd);
+}
+
+// ----------------------------- Main -----------------------------
+
+void print_usage(const char* prog) {
+  std::cerr
+      << "Usage: " << prog << " --model DIR [options]\n"
+      << "  --model DIR           checkpoint with config.json, tokenizer.json and safetensors\n"
+      << "  --host ADDR           address to bind (127.0.0.1)\n"
+      << "  --port N              port to listen on (8080)\n"
+      << "  --max-batch N         sequences decoded together (8)\n"
+      << "  --max-tokens N        default completion length (256)\n";
+}
+
+int main(int argc, char* argv[]) {
+  ServerOptions opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--help" || arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--model") opts.model_dir = value;
+    else if (arg == "--host") opts.host = value;
+    else if (arg == "--port") opts.port = std::stoi(value);
+    else if (arg == "--max-batch") opts.max_batch_size = std::stoi(value);
+    else if (arg == "--max-tokens") opts.max_tokens = std::stoi(value);
+    else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (opts.model_dir.empty()) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // Load the model once; every request shares it through the worker
+  std::filesystem::path dir = opts.model_dir;
+  std::string config_path = (dir / "config.json").string();
+  Model model(load_phi_config(config_path));
+  if (std::filesystem::exists(dir / "model.mlxsnap")) {
+    // Already laid out and quantized, see Module::save_snapshot
+    model.load_snapshot((dir / "model.mlxsnap").string());
+  } else {
+    nn::JsonValue raw_config = nn::load_json(config_path);
+    if (raw_config.contains("quantization")) {
+      const auto& q = raw_config.at("quantization");
+      model.quantize(q.at("bits").as_int(), q.at("group_size").as_int());
+    }
+    if (std::filesystem::exists(dir / "model.safetensors.index.json")) {
+      model.load_weights(dir.string());
+    } else {
+      model.load_weights((dir / "model.safetensors").string());
+    }
+  }
+
+  ServerContext ctx(dir.filename().string(), Tokenizer((dir / "tokenizer.json").string()));
+  for (const char* name : {"<|end|>", "<|endoftext|>", "<|eot_id|>"}) {
+    int id = ctx.tokenizer.token_to_id(name);
+    if (id >= 0) {
+      ctx.stop_tokens.push_back(id);
+    }
+  }
+  if (ctx.tokenizer.eos_id >= 0) {
+    ctx.stop_tokens.push_back(ctx.tokenizer.eos_id);
+  }
+  ctx.max_tokens = opts.max_tokens;
+  ctx.vocab_size = model.args.vocab_size;
+
+  InferenceWorker worker(model, opts.max_batch_size);
+  ctx.worker = &worker;
+  worker.start();
+
+  // Writes to a closed socket must fail with an error, not kill the process
+  signal(SIGPIPE, SIG_IGN);
+  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(opts.port);
+  if (inet_pton(AF_INET, opts.host.c_str(), &addr.sin_addr) != 1 ||
+      bind(server_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(server_fd, 64) != 0) {
+    std::cerr << "Could not listen on " << opts.host << ":" << opts.port << "\n";
+    return 1;
+  }
+  std::cout << "Serving " << ctx.model_name << " on http://" << opts.host << ":" << opts.port << "\n";
+
+  while (true) {
+    int fd = accept(server_fd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    std::thread([fd, &ctx]() { handle_connection(fd, ctx); }).detach();
+  }
+}
@@ -1,3 +1,4 @@
+#include <climits>
 #include <iostream>
 #include <map>
 #include <memory>